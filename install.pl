@@ -59,6 +59,22 @@ sub install_proxy
 }
 
 
+sub install_snapshot
+{
+	my $tgt_bin = "/usr/local/bin/harddns-snapshot";
+	my $src_bin = "src/build/harddns-snapshot";
+
+	print "[*] Installing ${tgt_bin} and creating /etc/harddns/harddns.snap\n";
+
+	system("cp", "-f", $src_bin, $tgt_bin);
+	chown(0, 0, $tgt_bin);
+	chmod(0755, $tgt_bin);
+
+	# connects to the upstreams to find their trust anchors
+	system($tgt_bin);
+}
+
+
 sub print_cfg
 {
 print<<EOM;
@@ -89,5 +105,6 @@ umask(0);
 install_cfg();
 install_lib();
 install_proxy();
+install_snapshot();
 print_cfg();
 
@@ -0,0 +1,99 @@
+/*
+ * This file is part of harddns.
+ *
+ * (C) 2023 by Sebastian Krahmer,
+ *             sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * harddns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * harddns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with harddns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <new>
+#include <atomic>
+#include <cstdlib>
+#include <cstdint>
+#include "arena.h"
+
+
+namespace harddns {
+
+static std::atomic<uint64_t> n_allocs{0};
+
+
+uint64_t alloc_count()
+{
+	return n_allocs.load(std::memory_order_relaxed);
+}
+
+}
+
+
+#ifdef ALLOC_STATS
+
+// Instrumentation mode only. Counts every global allocation so that
+// the proxy can log allocations per query. Don't ship the NSS module built that way,
+// as it would replace operator new of the whole process that loaded it.
+
+void *operator new(std::size_t n)
+{
+	harddns::n_allocs.fetch_add(1, std::memory_order_relaxed);
+	if (void *p = std::malloc(n ? n : 1))
+		return p;
+	throw std::bad_alloc();
+}
+
+
+void *operator new[](std::size_t n)
+{
+	return ::operator new(n);
+}
+
+
+void *operator new(std::size_t n, const std::nothrow_t &) noexcept
+{
+	harddns::n_allocs.fetch_add(1, std::memory_order_relaxed);
+	return std::malloc(n ? n : 1);
+}
+
+
+void *operator new[](std::size_t n, const std::nothrow_t &) noexcept
+{
+	return ::operator new(n, std::nothrow);
+}
+
+
+void operator delete(void *p) noexcept
+{
+	std::free(p);
+}
+
+
+void operator delete[](void *p) noexcept
+{
+	std::free(p);
+}
+
+
+void operator delete(void *p, std::size_t) noexcept
+{
+	std::free(p);
+}
+
+
+void operator delete[](void *p, std::size_t) noexcept
+{
+	std::free(p);
+}
+
+#endif
+
@@ -0,0 +1,82 @@
+/*
+ * This file is part of harddns.
+ *
+ * (C) 2023 by Sebastian Krahmer,
+ *             sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * harddns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * harddns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with harddns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef harddns_arena_h
+#define harddns_arena_h
+
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+
+
+namespace harddns {
+
+
+// Per-query monotonic arena. All short-lived strings of a single
+// request/response round (HTTP request, recv buffer, body copies, reply assembly)
+// are carved out of d_buf and dropped at once by reset(). If a query
+// ever needs more, the upstream new/delete resource takes over until the next reset().
+template<std::size_t N>
+class query_arena {
+
+	alignas(std::max_align_t) char d_buf[N];
+
+	std::pmr::monotonic_buffer_resource d_mr;
+
+public:
+
+	query_arena()
+		: d_mr(d_buf, sizeof(d_buf), std::pmr::new_delete_resource())
+	{
+	}
+
+	query_arena(const query_arena &) = delete;
+
+	query_arena &operator=(const query_arena &) = delete;
+
+	std::pmr::memory_resource *resource()
+	{
+		return &d_mr;
+	}
+
+	// Must only be called when no object allocated from this arena is alive anymore
+	void reset()
+	{
+		d_mr.release();
+	}
+};
+
+
+// Same trick as with WANT_TLS_0RTT in config.h: use "if constexpr (WANT_ALLOC_STATS)"
+// rather than #ifdefs inside the .cc files.
+#ifdef ALLOC_STATS
+constexpr bool WANT_ALLOC_STATS = 1;
+#else
+constexpr bool WANT_ALLOC_STATS = 0;
+#endif
+
+// Number of global operator new calls since start of the process.
+// Always 0 unless built with -DALLOC_STATS.
+uint64_t alloc_count();
+
+}
+
+#endif
+
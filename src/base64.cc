@@ -19,101 +19,167 @@
 
 #include <string>
 #include <cstring>
+#include <cstdint>
 #include <limits>
+#include "base64.h"
 
 namespace harddns {
 
 
-// actually base64url alphabet
-static const char *b64 = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+using namespace std;
 
 
-using namespace std;
+// actually base64url alphabet
+static constexpr char b64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
 
-/* The base64 routines have been taken from the Samba 3 source (GPL)
- * and have been C++-ified
- */
 
-string &b64url_encode(const string &src, string &dst)
-{
-	unsigned int bits = 0;
-	int char_count = 0, i = 0;
+// decoding table flags, the invalid chars have all bits set
+enum : uint8_t {
+	B64_STD = 0x40,		// '+' and '/'
+	B64_URL = 0x80,		// '-' and '_'
+	B64_BAD = 0xff
+};
 
-	dst = "";
-	if (src.size() >= numeric_limits<unsigned int>::max()/2)
-		return dst;
 
-	dst.reserve(src.size() + src.size()/3 + 10);
-	string::size_type len = src.size();
-	while (len--) {
-		unsigned int c = (unsigned char)src[i++];
-		bits += c;
-		char_count++;
-		if (char_count == 3) {
-			dst += b64[bits >> 18];
-			dst += b64[(bits >> 12) & 0x3f];
-			dst += b64[(bits >> 6) & 0x3f];
-	    		dst += b64[bits & 0x3f];
-		    	bits = 0;
-		    	char_count = 0;
-		} else	{
-	    		bits <<= 8;
-		}
-    	}
-	if (char_count != 0) {
-		bits <<= 16 - (8 * char_count);
-		dst += b64[bits >> 18];
-		dst += b64[(bits >> 12) & 0x3f];
-		if (char_count == 1) {
-			//dst += '=';
-			//dst += '=';
-		} else {
-			dst += b64[(bits >> 6) & 0x3f];
-			//dst += '=';
+// Two output chars for each possible 12 bit input, so that 3 input bytes
+// need just two lookups.
+struct b64_tables {
+	char enc[4096][2];
+	uint8_t dec[256];
+
+	constexpr b64_tables() : enc{{0}}, dec{0}
+	{
+		for (int i = 0; i < 4096; ++i) {
+			enc[i][0] = b64[i >> 6];
+			enc[i][1] = b64[i & 0x3f];
 		}
+		for (int i = 0; i < 256; ++i)
+			dec[i] = B64_BAD;
+		for (int i = 0; i < 64; ++i)
+			dec[(unsigned char)b64[i]] = i;
+		dec['-'] |= B64_URL;
+		dec['_'] |= B64_URL;
+
+		// also accept the standard alphabet when decoding, but not mixed
+		dec['+'] = 62|B64_STD;
+		dec['/'] = 63|B64_STD;
 	}
-	return dst;
+};
+
+static constexpr b64_tables tables;
+
+
+size_t b64url_encode(const void *vsrc, size_t srclen, char *dst)
+{
+	const unsigned char *src = reinterpret_cast<const unsigned char *>(vsrc);
+	char *d = dst;
+	size_t i = 0;
+
+	for (; i + 3 <= srclen; i += 3) {
+		uint32_t v = (src[i] << 16)|(src[i + 1] << 8)|src[i + 2];
+		memcpy(d, tables.enc[v >> 12], 2);
+		memcpy(d + 2, tables.enc[v & 0xfff], 2);
+		d += 4;
+	}
+
+	// no '=' padding for base64url
+	if (srclen - i == 1) {
+		uint32_t v = src[i] << 16;
+		memcpy(d, tables.enc[v >> 12], 2);
+		d += 2;
+	} else if (srclen - i == 2) {
+		uint32_t v = (src[i] << 16)|(src[i + 1] << 8);
+		memcpy(d, tables.enc[v >> 12], 2);
+		*(d + 2) = tables.enc[v & 0xfff][0];
+		d += 3;
+	}
+
+	return d - dst;
 }
 
 
 string &b64url_encode(const char *src, size_t srclen, string &dst)
 {
-	unsigned int bits = 0;
-	int char_count = 0, i = 0;
-
 	dst = "";
 	if (srclen >= numeric_limits<unsigned int>::max()/2)
 		return dst;
 
-	dst.reserve(srclen + srclen/3 + 10);
-	while (srclen--) {
-		unsigned int c = (unsigned char)src[i++];
-		bits += c;
-		char_count++;
-		if (char_count == 3) {
-			dst += b64[bits >> 18];
-			dst += b64[(bits >> 12) & 0x3f];
-			dst += b64[(bits >> 6) & 0x3f];
-	    		dst += b64[bits & 0x3f];
-		    	bits = 0;
-		    	char_count = 0;
-		} else	{
-	    		bits <<= 8;
-		}
-    	}
-	if (char_count != 0) {
-		bits <<= 16 - (8 * char_count);
-		dst += b64[bits >> 18];
-		dst += b64[(bits >> 12) & 0x3f];
-
-		if (char_count == 1) {
-			//dst += '=';
-			//dst += '=';
-		} else {
-			dst += b64[(bits >> 6) & 0x3f];
-			//dst += '=';
-		}
+	dst.resize(b64url_encoded_len(srclen));
+	b64url_encode(src, srclen, &dst[0]);
+	return dst;
+}
+
+
+string &b64url_encode(const string &src, string &dst)
+{
+	return b64url_encode(src.c_str(), src.size(), dst);
+}
+
+
+// Decodes base64url or standard base64, with or without '=' padding.
+// Only the canonical encoding is taken: padding, if any, to a multiple of
+// 4 chars, one of the two alphabets and unused trailing bits zero. Returns
+// the number of bytes written to dst or -1 on invalid input.
+ssize_t b64_decode(const char *src, size_t srclen, char *dst, size_t dstlen)
+{
+	size_t pad = 0;
+	while (pad < 2 && srclen > 0 && src[srclen - 1] == '=') {
+		--srclen;
+		++pad;
 	}
+
+	if (srclen % 4 == 1 || (pad && (srclen + pad) % 4 != 0) || b64_decoded_len(srclen) > dstlen)
+		return -1;
+
+	const unsigned char *s = reinterpret_cast<const unsigned char *>(src);
+	char *d = dst;
+	size_t i = 0;
+	uint32_t seen = 0;
+
+	for (; i + 4 <= srclen; i += 4) {
+		uint32_t a = tables.dec[s[i]], b = tables.dec[s[i + 1]], c = tables.dec[s[i + 2]], e = tables.dec[s[i + 3]];
+		if (((a|b|c|e) & B64_BAD) == B64_BAD)
+			return -1;
+		seen |= a|b|c|e;
+		uint32_t v = ((a & 0x3f) << 18)|((b & 0x3f) << 12)|((c & 0x3f) << 6)|(e & 0x3f);
+		*d++ = v >> 16;
+		*d++ = v >> 8;
+		*d++ = v;
+	}
+
+	if (srclen - i >= 2) {
+		uint32_t a = tables.dec[s[i]], b = tables.dec[s[i + 1]], c = 0;
+		if (srclen - i == 3)
+			c = tables.dec[s[i + 2]];
+		if (((a|b|c) & B64_BAD) == B64_BAD)
+			return -1;
+		seen |= a|b|c;
+		uint32_t v = ((a & 0x3f) << 18)|((b & 0x3f) << 12)|((c & 0x3f) << 6);
+
+		// the bits after the last byte
+		if (v & (srclen - i == 3 ? 0xff : 0xffff))
+			return -1;
+		*d++ = v >> 16;
+		if (srclen - i == 3)
+			*d++ = v >> 8;
+	}
+
+	if ((seen & (B64_STD|B64_URL)) == (B64_STD|B64_URL))
+		return -1;
+
+	return d - dst;
+}
+
+
+string &b64_decode(const string &src, string &dst)
+{
+	dst.resize(b64_decoded_len(src.size()));
+
+	ssize_t r = b64_decode(src.c_str(), src.size(), &dst[0], dst.size());
+	if (r < 0)
+		dst = "";
+	else
+		dst.resize(r);
 	return dst;
 }
 
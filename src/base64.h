@@ -25,10 +25,27 @@
 
 namespace harddns {
 
+// unpadded base64url
+constexpr size_t b64url_encoded_len(size_t n)
+{
+	return (n/3)*4 + (n % 3 ? n % 3 + 1 : 0);
+}
+
+// upper bound, as padding is optional
+constexpr size_t b64_decoded_len(size_t n)
+{
+	return (n/4)*3 + (n % 4 ? n % 4 - 1 : 0);
+}
+
+size_t b64url_encode(const void *, size_t, char *);
+
 std::string &b64url_encode(const std::string&, std::string&);
 
 std::string &b64url_encode(const char *, size_t, std::string&);
 
+ssize_t b64_decode(const char *, size_t, char *, size_t);
+
+std::string &b64_decode(const std::string &, std::string &);
 
 }
 
@@ -0,0 +1,1293 @@
+/*
+ * This file is part of harddns.
+ *
+ * (C) 2023 by Sebastian Krahmer,
+ *             sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * harddns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * harddns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with harddns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Microbenchmarks for the hot path helpers. Run via "make bench".
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <string>
+#include <map>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <memory_resource>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <atomic>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "misc.h"
+#include "base64.h"
+#include "arena.h"
+#include "dnshttps.h"
+#include "proxy.h"
+#include "forward.h"
+#include "blocklist.h"
+#include "shmcache.h"
+#include "nss-cache.h"
+#include "net-headers.h"
+#include "config.h"
+#include "ssl.h"
+
+extern "C" {
+#include <openssl/ec.h>
+#include <openssl/sha.h>
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+
+using namespace std;
+using namespace harddns;
+using namespace net_headers;
+
+
+namespace harddns {
+
+int make_query(const string &, uint16_t, pmr::string &);
+
+
+class bench_access {
+public:
+
+	static int parse(dnshttps &d, bool rfc8484, const string &name, uint16_t qtype, dnshttps::dns_reply &result,
+	                 string &raw, const pmr::string &reply, string::size_type content_idx, size_t cl)
+	{
+		d.arena.reset();
+		if (rfc8484)
+			return d.parse_rfc8484(name, qtype, result, raw, reply, content_idx, cl);
+		return d.parse_json(name, qtype, result, raw, reply, content_idx, cl);
+	}
+
+	static void cache_insert(doh_proxy &p, const string &fqdn, uint16_t qtype, const dnshttps::dns_reply &reply)
+	{
+		p.cache_insert(fqdn, qtype, reply);
+	}
+
+	static bool cache_lookup(doh_proxy &p, const string &fqdn, uint16_t qtype, const dnshttps::dns_reply *&result)
+	{
+		uint32_t ttl = 0;
+		return p.cache_lookup(fqdn, qtype, result, ttl);
+	}
+};
+
+}
+
+
+namespace legacy {
+
+const uint8_t dns_max_label = 63;
+
+// The name codec as it was before it encoded into fixed buffers,
+// kept as reference to compare against.
+
+int host2qname(const string &host, string &result)
+{
+	string split_host = "";
+	string::size_type pos1 = 0, pos2 = 0;
+
+	result = "";
+
+	for (;pos1 < host.size();) {
+		pos2 = host.find(".", pos1);
+		if (pos2 == string::npos) {
+			split_host += host.substr(pos1);
+			break;
+		}
+
+		if (pos2 - pos1 > dns_max_label) {
+			split_host += host.substr(pos1, dns_max_label);
+			pos1 += dns_max_label;
+		} else {
+			split_host += host.substr(pos1, pos2 - pos1);
+			pos1 = pos2 + 1;
+		}
+
+		split_host += ".";
+	}
+
+	if (split_host.size() >= 2048)
+		return -1;
+
+	char buf[4096] = {0};
+	memcpy(buf + 1, split_host.c_str(), split_host.size());
+
+	string::size_type last_dot = 0;
+	for (; last_dot < split_host.size();) {
+		uint8_t i = 0;
+		while (buf[last_dot + i] != '.' && buf[last_dot + i] != 0)
+			++i;
+		buf[last_dot] = i - 1;
+		last_dot += i;
+
+		if (buf[last_dot] == 0)
+			break;
+		if (buf[last_dot + 1] == 0) {
+			buf[last_dot] = 0;
+			break;
+		}
+	}
+
+	result = string(buf, last_dot + 1);
+	return last_dot + 1;
+}
+
+
+int qname2host(const string &msg, string &result, string::size_type start_idx = 0)
+{
+	string::size_type i = start_idx, r = 0;
+	uint8_t len = 0, compress_depth = 0;
+
+	result = "";
+	string s = "";
+	s.reserve(msg.length());
+
+	while ((len = msg[i]) != 0) {
+		if (len > dns_max_label) {
+			if (start_idx == 0 || ++compress_depth > 10)
+				return -1;
+			if (len & 0xc0) {
+				if (i + 1 >= msg.size())
+					return -1;
+				i = msg[i + 1] & 0xff;
+				if (i >= msg.size())
+					return -1;
+				if (compress_depth <= 1)
+					r += 1;
+				continue;
+			} else
+				return -1;
+		}
+		if (len + i + 1 > msg.size())
+			return -1;
+		s += msg.substr(i + 1, len);
+		s += ".";
+
+		i += len + 1;
+
+		if (compress_depth == 0)
+			r += len + 1;
+	}
+
+	result = s;
+	if (result.size() == 0)
+		return 0;
+
+	if (result.size() > 255) {
+		result = "";
+		return -1;
+	}
+
+	return r + 1;
+}
+
+
+string &b64url_encode(const string &src, string &dst)
+{
+	static const char *b64 = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+	unsigned int bits = 0;
+	int char_count = 0, i = 0;
+
+	dst = "";
+	dst.reserve(src.size() + src.size()/3 + 10);
+	string::size_type len = src.size();
+	while (len--) {
+		unsigned int c = (unsigned char)src[i++];
+		bits += c;
+		char_count++;
+		if (char_count == 3) {
+			dst += b64[bits >> 18];
+			dst += b64[(bits >> 12) & 0x3f];
+			dst += b64[(bits >> 6) & 0x3f];
+			dst += b64[bits & 0x3f];
+			bits = 0;
+			char_count = 0;
+		} else {
+			bits <<= 8;
+		}
+	}
+	if (char_count != 0) {
+		bits <<= 16 - (8 * char_count);
+		dst += b64[bits >> 18];
+		dst += b64[(bits >> 12) & 0x3f];
+		if (char_count != 1)
+			dst += b64[(bits >> 6) & 0x3f];
+	}
+	return dst;
+}
+
+
+bool valid_name(const string &name)
+{
+	size_t l = name.size();
+	if (l > 254 || l < 2)
+		return 0;
+
+	for (size_t i = 0; i < l; ++i) {
+		if (name[i] >= '0' && name[i] <= '9')
+			continue;
+		if (name[i] >= 'a' && name[i] <= 'z')
+			continue;
+		if (name[i] >= 'A' && name[i] <= 'Z')
+			continue;
+		if (name[i] == '-' || name[i] == '.')
+			continue;
+
+		return 0;
+	}
+
+	return 1;
+}
+
+
+string lcs(const string &s)
+{
+	string rs = s;
+	transform(rs.begin(), rs.end(), rs.begin(), [](unsigned char c){ return tolower(c); });
+	return rs;
+}
+
+}
+
+
+// keep the compiler from optimizing away benchmarked results
+template<class T> static inline void keep(const T &v)
+{
+	asm volatile("" : : "g"(&v) : "memory");
+}
+
+
+static inline uint64_t cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+
+// Runs f() until it took at least 200ms and prints time and heap allocations
+// per op. If the
+// benchmarked function processes bytes, also print bytes per (TSC) cycle.
+template<class F> static void bench(const char *what, size_t ops_per_round, F f, size_t bytes_per_round = 0)
+{
+	using clk = chrono::steady_clock;
+
+	// warm up caches and branch predictors
+	for (int i = 0; i < 1000; ++i)
+		f();
+
+	size_t rounds = 1000;
+	double ns = 0;
+	uint64_t cyc = 0, allocs = 0;
+	for (;;) {
+		auto start = clk::now();
+		uint64_t c0 = cycles(), a0 = alloc_count();
+		for (size_t i = 0; i < rounds; ++i)
+			f();
+		cyc = cycles() - c0;
+		allocs = alloc_count() - a0;
+		ns = chrono::duration<double, nano>(clk::now() - start).count();
+		if (ns > 2e8 || rounds > (1UL<<30))
+			break;
+		rounds *= 4;
+	}
+
+	size_t ops = rounds * ops_per_round;
+	printf("%-52s %12zu ops %10.2f ns/op %8.2f allocs/op", what, ops, ns / ops, (double)allocs / ops);
+	if (bytes_per_round && cyc)
+		printf(" %8.3f B/cycle", (double)bytes_per_round * rounds / cyc);
+	printf("\n");
+}
+
+
+static void die(const char *msg, const string &s = "")
+{
+	fprintf(stderr, "bench: %s %s\n", msg, s.c_str());
+	exit(1);
+}
+
+
+// realistic names: short, CDN chains, PTR names, maximum label and
+// maximum name lengths, with and without trailing dot
+static const vector<string> name_corpus = {
+	"a.io",
+	"google.com",
+	"www.google.com",
+	"mail.google.com.",
+	"cloudflare-dns.com",
+	"dns.digitale-gesellschaft.ch",
+	"e6858.dscx.akamaiedge.net",
+	"www.example.com.cdn.cloudflare.net",
+	"d3ag4hukkh62yn.cloudfront.net",
+	"star-mini.c10r.facebook.com",
+	"a1234.b.akamai-staging.net.edgekey.net.globalredir.akadns.net",
+	"4.3.2.1.in-addr.arpa",
+	"b.a.9.8.7.6.5.0.4.0.0.0.3.0.0.0.2.0.0.0.1.0.0.0.0.0.0.0.1.2.3.4.ip6.arpa",
+	string(63, 'x') + ".example.org",
+	string(63, 'a') + "." + string(63, 'b') + "." + string(63, 'c') + "." + string(61, 'd'),
+};
+
+
+static void check_name_codec()
+{
+	for (const auto &n : name_corpus) {
+		string q1 = "", q2 = "", h1 = "", h2 = "";
+
+		if (host2qname(n, q1) <= 0)
+			die("host2qname failed for", n);
+		legacy::host2qname(n, q2);
+		if (q1 != q2)
+			die("host2qname differs from legacy for", n);
+
+		if (qname2host(q1, h1) != (int)q1.size())
+			die("qname2host length mismatch for", n);
+		legacy::qname2host(q1, h2);
+		if (h1 != h2)
+			die("qname2host differs from legacy for", n);
+
+		string expect = n;
+		if (expect.back() != '.')
+			expect += ".";
+		if (h1 != expect)
+			die("round trip failed for", n);
+	}
+
+	// a packet with compressed names: hdr, "www.example.com", pointer to it,
+	// and "mail" + pointer to "example.com"
+	string pkt(12, 0);
+	string q = "";
+	host2qname("www.example.com", q);
+	pkt += q;
+	pkt += string("\xc0\x0c", 2);
+	pkt += string("\x04mail\xc0\x10", 7);
+
+	string h = "";
+	if (qname2host(pkt, h, 12) != (int)q.size() || h != "www.example.com.")
+		die("decode of plain name in packet failed");
+	if (qname2host(pkt, h, 12 + q.size()) != 2 || h != "www.example.com.")
+		die("decode of pointer failed");
+	if (qname2host(pkt, h, 12 + q.size() + 2) != 7 || h != "mail.example.com.")
+		die("decode of label + pointer failed");
+
+	// hostile input must fail: self pointer, forward pointer, truncation,
+	// compression without packet context, reserved label types
+	string bad = pkt;
+	bad += '\xc0';
+	bad += (char)(bad.size() - 1);
+	if (qname2host(bad, h, bad.size() - 2) != -1)
+		die("self pointer accepted");
+	bad = pkt;
+	bad += string("\x01" "a\xc0", 3);
+	bad += (char)(bad.size() - 3);
+	if (qname2host(bad, h, bad.size() - 2) != -1)
+		die("pointer loop accepted");
+	bad = pkt + string("\xc0\xff", 2);
+	if (qname2host(bad, h, bad.size() - 2) != -1)
+		die("forward pointer accepted");
+	bad = pkt + string("\x05" "ab", 3);
+	if (qname2host(bad, h, bad.size() - 3) != -1)
+		die("truncated label accepted");
+	if (qname2host(string("\x03" "foo\xc0\x00", 6), h) != -1)
+		die("compression without packet accepted");
+	bad = pkt + string("\x41" "a", 2);
+	if (qname2host(bad, h, bad.size() - 2) != -1)
+		die("reserved label type accepted");
+	if (host2qname("foo..bar", h) != -1)
+		die("empty label accepted");
+}
+
+
+static void bench_name_codec()
+{
+	char qbuf[1024], hbuf[256];
+	size_t hlen = 0;
+	string q = "", h = "";
+
+	vector<string> qnames;
+	for (const auto &n : name_corpus) {
+		host2qname(n, q);
+		qnames.push_back(q);
+	}
+
+	size_t n = name_corpus.size();
+
+	bench("legacy::host2qname", n, [&]{
+		for (const auto &name : name_corpus) {
+			legacy::host2qname(name, q);
+			keep(q);
+		}
+	});
+	bench("host2qname (string)", n, [&]{
+		for (const auto &name : name_corpus) {
+			host2qname(name, q);
+			keep(q);
+		}
+	});
+	bench("host2qname (buffer)", n, [&]{
+		for (const auto &name : name_corpus) {
+			keep(host2qname(name.c_str(), name.size(), qbuf, sizeof(qbuf)));
+			keep(qbuf);
+		}
+	});
+
+	bench("legacy::qname2host", n, [&]{
+		for (const auto &qn : qnames) {
+			legacy::qname2host(qn, h);
+			keep(h);
+		}
+	});
+	bench("qname2host (string)", n, [&]{
+		for (const auto &qn : qnames) {
+			qname2host(qn, h);
+			keep(h);
+		}
+	});
+	bench("qname2host (buffer)", n, [&]{
+		for (const auto &qn : qnames) {
+			keep(qname2host(qn.c_str(), qn.size(), 0, hbuf, sizeof(hbuf), hlen));
+			keep(hbuf);
+		}
+	});
+}
+
+
+// Hostnames as seen in query logs: mostly 10-30 chars with a tail of long
+// CDN names and some PTR names. Some mixed case, as with 0x20 randomization.
+static vector<string> make_hostnames(size_t n)
+{
+	mt19937 rng(4711);
+	lognormal_distribution<double> name_len(3.1, 0.45);
+	uniform_int_distribution<int> label_len(1, 20), pick(0, 99);
+	const char *charset = "abcdefghijklmnopqrstuvwxyz0123456789-ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+
+	vector<string> v;
+	for (size_t i = 0; i < n; ++i) {
+		if (pick(rng) < 5) {
+			v.push_back(name_corpus[12]);
+			continue;
+		}
+		size_t l = min(max((size_t)name_len(rng), (size_t)4), (size_t)253);
+		string name = "";
+		while (name.size() < l) {
+			if (name.size())
+				name += ".";
+			int ll = label_len(rng);
+			for (int j = 0; j < ll && name.size() < l; ++j)
+				name += charset[pick(rng) < 90 ? rng() % 37 : 37 + rng() % 26];
+		}
+		v.push_back(name);
+	}
+	return v;
+}
+
+
+static void check_name_kernel(const vector<string> &names)
+{
+	char buf[256];
+
+	for (const auto &n : names) {
+		if (valid_name(n) != legacy::valid_name(n))
+			die("valid_name differs from legacy for", n);
+		if (valid_name_lc(n.c_str(), n.size(), buf) != (int)n.size() || string(buf, n.size()) != legacy::lcs(n))
+			die("valid_name_lc differs from legacy for", n);
+	}
+
+	// every single invalid char must be found, at any position of the SIMD block
+	for (int c = 0; c < 256; ++c) {
+		for (size_t pos = 0; pos < 40; ++pos) {
+			string n(40, 'a');
+			n[pos] = (char)c;
+			bool ok = valid_name_lc(n.c_str(), n.size(), buf) == (int)n.size();
+			if (ok != legacy::valid_name(n))
+				die("valid_name_lc differs from legacy for char", to_string(c));
+			if (ok && string(buf, n.size()) != legacy::lcs(n))
+				die("valid_name_lc folding differs for char", to_string(c));
+		}
+	}
+}
+
+
+static void bench_name_kernel(const vector<string> &names)
+{
+	char buf[256];
+	size_t n = names.size();
+
+	bench("legacy::valid_name + legacy::lcs", n, [&]{
+		for (const auto &name : names) {
+			keep(legacy::valid_name(name));
+			string l = legacy::lcs(name);
+			keep(l);
+		}
+	});
+	bench("valid_name", n, [&]{
+		for (const auto &name : names)
+			keep(valid_name(name));
+	});
+	bench("valid_name_lc", n, [&]{
+		for (const auto &name : names) {
+			keep(valid_name_lc(name.c_str(), name.size(), buf));
+			keep(buf);
+		}
+	});
+}
+
+
+static void check_base64()
+{
+	mt19937 rng(1234);
+	string src = "", e1 = "", e2 = "", d = "";
+
+	for (size_t l = 0; l < 200; ++l) {
+		src = "";
+		for (size_t i = 0; i < l; ++i)
+			src += (char)rng();
+		b64url_encode(src, e1);
+		legacy::b64url_encode(src, e2);
+		if (e1 != e2)
+			die("b64url_encode differs from legacy for length", to_string(l));
+		if (b64_decode(e1, d) != src)
+			die("b64_decode round trip failed for length", to_string(l));
+	}
+
+	// standard alphabet and padding, as used for SPKI pins
+	if (b64_decode(string("+/+/"), d) != string("\xfb\xff\xbf", 3))
+		die("standard alphabet not decoded");
+	if (b64_decode(string("Zm9vYg=="), d) != "foob")
+		die("padding not handled");
+	if (b64_decode(string("Zm9v!mFy"), d) != "" || b64_decode(string("Zm9vY"), d) != "")
+		die("invalid base64 accepted");
+	if (b64_decode(string("Zm9vYmE"), d) != "fooba" || b64_decode(string("Zm9vYmE="), d) != "fooba")
+		die("unpadded or padded base64 not decoded");
+
+	// only the canonical encoding
+	if (b64_decode(string("Zm9vYg==="), d) != "" || b64_decode(string("Zm9vYg="), d) != "" || b64_decode(string("="), d) != "")
+		die("wrong base64 padding accepted");
+	if (b64_decode(string("+/-_"), d) != "" || b64_decode(string("+/+/-_-_"), d) != "")
+		die("mixed base64 alphabets accepted");
+	if (b64_decode(string("Zm9vYh=="), d) != "" || b64_decode(string("Zm9vYmF"), d) != "")
+		die("base64 with trailing bits set accepted");
+}
+
+
+// The NSS module finds what harddnsd stored, however the name is spelled,
+// and a slot that a crashed harddnsd left half written is usable again
+// once the cache is taken over.
+static void check_shmcache()
+{
+	char dir[] = "/tmp/harddns-bench.XXXXXX";
+	if (!mkdtemp(dir))
+		die("mkdtemp failed");
+	string path = string(dir) + "/shared.cache", err = "", msg = "";
+	uint32_t left = 0;
+
+	if (shmcache::create(path, err) < 0)
+		die("shmcache::create failed", err);
+	shmcache::insert("www.example.com", htons(dns_type::A), "answer1", 7, 60);
+	if (!shmcache::lookup(path, "WWW.Example.com.", htons(dns_type::A), msg, left) || msg != "answer1")
+		die("shmcache name not normalized");
+
+	// as if harddnsd died in the middle of insert()
+	int fd = open(path.c_str(), O_RDWR);
+	const size_t size = sizeof(shmcache::header) + shmcache::NSLOTS*sizeof(shmcache::slot);
+	void *m = fd < 0 ? MAP_FAILED : mmap(nullptr, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (fd >= 0)
+		close(fd);
+	if (m == MAP_FAILED)
+		die("mmap of shared cache failed");
+	shmcache::slot *sl = reinterpret_cast<shmcache::slot *>(reinterpret_cast<char *>(m) + sizeof(shmcache::header));
+	for (uint32_t i = 0; i < shmcache::NSLOTS; ++i) {
+		if (sl[i].nlen == 15 && memcmp(sl[i].name, "www.example.com", 15) == 0)
+			sl[i].seq++;
+	}
+
+	if (shmcache::create(path, err) < 0)
+		die("shmcache::create takeover failed", err);
+	if (shmcache::lookup(path, "www.example.com", htons(dns_type::A), msg, left))
+		die("half written shmcache slot still valid");
+	shmcache::insert("www.example.com", htons(dns_type::A), "answer2", 7, 60);
+	if (!shmcache::lookup(path, "www.example.com", htons(dns_type::A), msg, left) || msg != "answer2")
+		die("shmcache slot locked after takeover");
+
+	munmap(m, size);
+	unlink(path.c_str());
+	rmdir(dir);
+}
+
+
+// A full NSS cache makes room by dropping what expires next.
+static void check_nss_cache()
+{
+	unsigned int old_max = config::nss_cache;
+	config::nss_cache = 3;
+
+	nss_cache cache;
+	auto answer = [](uint32_t ttl) {
+		return dnshttps::dns_reply{{0, {string("\xc0\x0c", 2), htons(dns_type::A), htons(1), htonl(ttl), string("\x0a\0\0\x01", 4)}}};
+	};
+	dnshttps::dns_reply r;
+
+	cache.insert("a.example", htons(dns_type::A), answer(100));
+	cache.insert("b.example", htons(dns_type::A), answer(50));
+	cache.insert("c.example", htons(dns_type::A), answer(200));
+	cache.insert("d.example", htons(dns_type::A), answer(300));
+	if (cache.lookup("b.example", htons(dns_type::A), r))
+		die("nss_cache kept the entry that expires first");
+	if (!cache.lookup("a.example", htons(dns_type::A), r) || !cache.lookup("c.example", htons(dns_type::A), r) ||
+	    !cache.lookup("d.example", htons(dns_type::A), r))
+		die("nss_cache evicted too much");
+
+	// replacing an entry moves it in the expiry order
+	cache.insert("d.example", htons(dns_type::A), answer(10));
+	cache.insert("e.example", htons(dns_type::A), answer(400));
+	if (cache.lookup("d.example", htons(dns_type::A), r) || !cache.lookup("a.example", htons(dns_type::A), r) ||
+	    !cache.lookup("e.example", htons(dns_type::A), r))
+		die("nss_cache expiry order not updated on replace");
+	if (ntohl(r[0].ttl) > 400 || ntohl(r[0].ttl) < 399)
+		die("nss_cache TTL not lowered");
+
+	config::nss_cache = old_max;
+}
+
+
+// A pinned upstream, connected to again on the resumed session. A resumed
+// session has no verified chain, the pin has to match anyway.
+static void check_pin_resumption()
+{
+	// as harddnsd and the NSS module do
+	signal(SIGPIPE, SIG_IGN);
+
+	// self-signed, so it is its own trust anchor
+	auto make_cert = [](const char *cn, EVP_PKEY *&pkey) {
+		pkey = nullptr;
+		free_ptr<EVP_PKEY_CTX> pctx(EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr), EVP_PKEY_CTX_free);
+		if (!pctx.get() || EVP_PKEY_keygen_init(pctx.get()) != 1 ||
+		    EVP_PKEY_CTX_set_ec_paramgen_curve_nid(pctx.get(), NID_X9_62_prime256v1) != 1 || EVP_PKEY_keygen(pctx.get(), &pkey) != 1)
+			die("pin check: no key");
+
+		X509 *x509 = X509_new();
+		X509_set_version(x509, 2);
+		ASN1_INTEGER_set(X509_get_serialNumber(x509), 1);
+		X509_gmtime_adj(X509_getm_notBefore(x509), -3600);
+		X509_gmtime_adj(X509_getm_notAfter(x509), 3600);
+		X509_set_pubkey(x509, pkey);
+		X509_NAME *name = X509_get_subject_name(x509);
+		X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, reinterpret_cast<const unsigned char *>(cn), -1, -1, 0);
+		X509_set_issuer_name(x509, name);
+		if (X509_sign(x509, pkey, EVP_sha256()) <= 0)
+			die("pin check: can't sign");
+		return x509;
+	};
+	auto spki_pin = [](X509 *x509) {
+		unsigned char *p = nullptr;
+		int len = i2d_X509_PUBKEY(X509_get_X509_PUBKEY(x509), &p);
+		string pin(SHA256_DIGEST_LENGTH, 0);
+		SHA256(p, len, reinterpret_cast<unsigned char *>(&pin[0]));
+		OPENSSL_free(p);
+		return pin;
+	};
+
+	EVP_PKEY *pkey = nullptr;
+	free_ptr<X509> x509(make_cert("pin.harddns", pkey), X509_free);
+	free_ptr<EVP_PKEY> key(pkey, EVP_PKEY_free);
+
+	unsigned char *p = nullptr;
+	int len = i2d_X509(x509.get(), &p);
+	vector<string> anchors{string(reinterpret_cast<char *>(p), len)};
+	OPENSSL_free(p);
+
+	string pin = spki_pin(x509.get());
+
+	// A cert with a pinned key that the server sends along, unrelated to
+	// its chain, as a MITM with a CA-valid cert could
+	X509 *extra = make_cert("pinned.ca", pkey);
+	EVP_PKEY_free(pkey);
+	string extra_pin = spki_pin(extra);
+
+	free_ptr<SSL_CTX> sctx(SSL_CTX_new(TLS_server_method()), SSL_CTX_free);
+	if (!sctx.get() || SSL_CTX_use_certificate(sctx.get(), x509.get()) != 1 || SSL_CTX_use_PrivateKey(sctx.get(), key.get()) != 1 ||
+	    SSL_CTX_add_extra_chain_cert(sctx.get(), extra) != 1)
+		die("pin check: no server ctx");
+	SSL_CTX_set_session_id_context(sctx.get(), reinterpret_cast<const unsigned char *>("bench"), 5);
+
+	int lfd = socket(AF_INET, SOCK_STREAM, 0);
+	sockaddr_in sin;
+	socklen_t slen = sizeof(sin);
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (lfd < 0 || ::bind(lfd, reinterpret_cast<sockaddr *>(&sin), sizeof(sin)) < 0 || listen(lfd, 8) < 0 ||
+	    getsockname(lfd, reinterpret_cast<sockaddr *>(&sin), &slen) < 0)
+		die("pin check: can't listen");
+
+	// 2 connections per mode, one with a wrong pin and 2 with only the
+	// extra cert pinned
+	const int conns = 7;
+
+	// answers a ping, so the client reads the session ticket along with it
+	thread srv([&]{
+		for (int i = 0; i < conns; ++i) {
+			int fd = accept(lfd, nullptr, nullptr);
+			if (fd < 0)
+				break;
+			SSL *ssl = SSL_new(sctx.get());
+			SSL_set_fd(ssl, fd);
+			// TLS 1.2 has the session right after the handshake
+			if (i >= conns - 2)
+				SSL_set_max_proto_version(ssl, TLS1_2_VERSION);
+			char buf[4];
+			if (SSL_accept(ssl) == 1 && SSL_read(ssl, buf, sizeof(buf)) == 4)
+				SSL_write(ssl, "pong", 4);
+			SSL_shutdown(ssl);
+			SSL_free(ssl);
+			close(fd);
+		}
+	});
+
+	map<string, config::a_ns_cfg> cfg, *old_cfg = config::ns_cfg;
+	cfg["127.0.0.1"].cn = "pin.harddns";
+	config::ns_cfg = &cfg;
+	bool old_pin_only = config::pin_only;
+
+	for (bool pin_only : {false, true}) {
+		config::pin_only = pin_only;
+		ssl_box box;
+		if (box.setup_ctx(&anchors) < 0)
+			die("pin check:", box.why());
+		box.add_pin(pin);
+
+		for (int i = 0; i < 2; ++i) {
+			string early = "", pong = "";
+			if (box.connect("127.0.0.1", ntohs(sin.sin_port), early) < 0)
+				die(i ? "pinned reconnect failed:" : "pinned connect failed:", box.why());
+			if (i == 1 && !box.resumed())
+				die("pinned reconnect did not resume", pin_only ? "(pin_only)" : "");
+			if (box.send("ping") != 4 || box.recv(pong) != 4)
+				die("pin check: no pong");
+			box.close();
+		}
+	}
+
+	{
+		config::pin_only = 0;
+		ssl_box box;
+		string early = "";
+		if (box.setup_ctx(&anchors) < 0)
+			die("pin check:", box.why());
+		box.add_pin(string(SHA256_DIGEST_LENGTH, 'x'));
+		if (box.connect("127.0.0.1", ntohs(sin.sin_port), early) == 0)
+			die("connect with a wrong pin succeeded");
+		box.close();
+	}
+
+	// The failed connect must not leave a session behind, and the cert
+	// that the peer only sent along must not count on resumption either
+	{
+		config::pin_only = 0;
+		ssl_box box;
+		if (box.setup_ctx(&anchors) < 0)
+			die("pin check:", box.why());
+		box.add_pin(extra_pin);
+		for (int i = 0; i < 2; ++i) {
+			string early = "";
+			if (box.connect("127.0.0.1", ntohs(sin.sin_port), early) == 0)
+				die(i ? "reconnect after a failed pin check succeeded" : "connect with a sent along pinned cert succeeded",
+				    box.resumed() ? "(resumed)" : "");
+			box.close();
+		}
+	}
+
+	srv.join();
+	close(lfd);
+	config::ns_cfg = old_cfg;
+	config::pin_only = old_pin_only;
+}
+
+
+// The forwarder against a loopback DNS server on UDP and TCP: "drop."
+// names lose their first query, "dead." names are never answered and
+// "big." names are truncated on UDP and 40 A records on TCP.
+static void check_forwarder()
+{
+	int usrv = socket(AF_INET, SOCK_DGRAM, 0), tsrv = socket(AF_INET, SOCK_STREAM, 0);
+	sockaddr_in sin;
+	socklen_t slen = sizeof(sin);
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (usrv < 0 || tsrv < 0 || ::bind(usrv, reinterpret_cast<sockaddr *>(&sin), sizeof(sin)) < 0 ||
+	    getsockname(usrv, reinterpret_cast<sockaddr *>(&sin), &slen) < 0 ||
+	    ::bind(tsrv, reinterpret_cast<sockaddr *>(&sin), sizeof(sin)) < 0 || listen(tsrv, 8) < 0)
+		die("forwarder check: can't set up the server");
+	const uint16_t port = ntohs(sin.sin_port);
+
+	// question only, then the answers
+	auto respond = [](const char *q, size_t qlen, bool tcp) {
+		size_t qend = sizeof(dnshdr);
+		while (qend < qlen && q[qend] != 0)
+			qend += (unsigned char)q[qend] + 1;
+		qend += 1 + 2*sizeof(uint16_t);
+		string r(q, min(qend, qlen));
+		dnshdr *hdr = reinterpret_cast<dnshdr *>(&r[0]);
+		hdr->qr = 1;
+		hdr->ra = 1;
+		hdr->ad_count = 0;
+		unsigned int n = 1;
+		if (r.find("\x03" "big") == sizeof(dnshdr)) {
+			hdr->tc = !tcp;
+			n = tcp ? 40 : 0;
+		}
+		hdr->a_count = htons(n);
+		for (unsigned int i = 0; i < n; ++i)
+			r += string("\xc0\x0c\x00\x01\x00\x01\x00\x00\x00\x3c\x00\x04\x0a\x00\x00", 15) + (char)i;
+		return r;
+	};
+
+	atomic<bool> stop{false};
+	atomic<uint16_t> seen_id{0};
+	thread srv([&]{
+		int dropped = 0;
+		char buf[0x1000];
+		while (!stop) {
+			pollfd pfds[2] = {{usrv, POLLIN, 0}, {tsrv, POLLIN, 0}};
+			if (poll(pfds, 2, 10) <= 0)
+				continue;
+			if (pfds[0].revents) {
+				sockaddr_in from;
+				socklen_t flen = sizeof(from);
+				ssize_t r = recvfrom(usrv, buf, sizeof(buf), 0, reinterpret_cast<sockaddr *>(&from), &flen);
+				if (r < (ssize_t)sizeof(dnshdr))
+					continue;
+				seen_id = reinterpret_cast<dnshdr *>(buf)->id;
+				if (string(buf + sizeof(dnshdr), 5) == "\x04" "dead" || (string(buf + sizeof(dnshdr), 5) == "\x04" "drop" && dropped++ == 0))
+					continue;
+				string a = respond(buf, r, 0);
+				sendto(usrv, a.c_str(), a.size(), 0, reinterpret_cast<sockaddr *>(&from), flen);
+			}
+			if (pfds[1].revents) {
+				int fd = accept(tsrv, nullptr, nullptr);
+				if (fd < 0)
+					continue;
+				uint16_t l = 0;
+				if (recv(fd, &l, sizeof(l), MSG_WAITALL) == sizeof(l) && recv(fd, buf, ntohs(l), MSG_WAITALL) == ntohs(l)) {
+					string a = respond(buf, ntohs(l), 1);
+					l = htons(a.size());
+					a.insert(0, reinterpret_cast<char *>(&l), sizeof(l));
+					send(fd, a.c_str(), a.size(), MSG_NOSIGNAL);
+				}
+				close(fd);
+			}
+		}
+	});
+
+	int lsock = socket(AF_INET, SOCK_DGRAM, 0), client = socket(AF_INET, SOCK_DGRAM, 0);
+	sockaddr_in csin;
+	socklen_t clen = sizeof(csin);
+	memset(&csin, 0, sizeof(csin));
+	csin.sin_family = AF_INET;
+	csin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (lsock < 0 || client < 0 || ::bind(client, reinterpret_cast<sockaddr *>(&csin), sizeof(csin)) < 0 ||
+	    getsockname(client, reinterpret_cast<sockaddr *>(&csin), &clen) < 0)
+		die("forwarder check: no client socket");
+
+	unsigned int old_timeout = config::forward_timeout_ms, old_retries = config::forward_retries;
+	config::forward_timeout_ms = 50;
+	config::forward_retries = 1;
+
+	forwarder fwd;
+	if (fwd.init(lsock, {{"fwd.test", "127.0.0.1#" + to_string(port)}}) < 0)
+		die("forwarder check:", fwd.why());
+
+	string cached = "";
+	fwd.cache_hook([&](const char *ans, size_t len) { cached.assign(ans, len); });
+
+	// sends the query for name as the client would and runs the forwarder
+	// until the client has its answer
+	auto ask = [&](const string &name, uint16_t id, uint16_t edns, string &reply) {
+		string q(sizeof(dnshdr), 0), qname = "";
+		dnshdr *hdr = reinterpret_cast<dnshdr *>(&q[0]);
+		hdr->id = id;
+		hdr->rd = 1;
+		hdr->q_count = htons(1);
+		host2qname(name, qname);
+		q += qname;
+		q += string("\x00\x01\x00\x01", 4);
+		size_t qend = q.size();
+		if (edns) {
+			reinterpret_cast<dnshdr *>(&q[0])->ad_count = htons(1);
+			q += string("\x00\x00\x29", 3);
+			q += (char)(edns>>8);
+			q += (char)edns;
+			q += string(6, 0);
+		}
+
+		bool cache = 0;
+		int tidx = fwd.target_of(name, cache);
+		if (tidx < 0 || fwd.query(tidx, reinterpret_cast<sockaddr *>(&csin), clen, q.c_str(), q.size(), qend, 0, cache) < 0)
+			die("forwarder check: query failed", fwd.why());
+
+		char buf[0x10000];
+		for (int i = 0; i < 200; ++i) {
+			vector<pollfd> pfds;
+			size_t n = fwd.pollfds(pfds);
+			pfds.push_back({client, POLLIN, 0});
+			poll(pfds.data(), pfds.size(), 10);
+			fwd.handle(pfds.data(), n);
+			fwd.expire();
+			if (pfds.back().revents) {
+				ssize_t r = recv(client, buf, sizeof(buf), 0);
+				reply.assign(buf, r > 0 ? r : 0);
+				if (reply.size() < sizeof(dnshdr))
+					die("forwarder check: short answer for", name);
+				return reinterpret_cast<const dnshdr *>(reply.c_str());
+			}
+		}
+		die("forwarder check: no answer for", name);
+		return static_cast<const dnshdr *>(nullptr);
+	};
+
+	string reply = "";
+	const dnshdr *hdr = nullptr;
+
+	// two tries, so a random ID that happens to match doesn't fail it
+	bool rewritten = 0;
+	for (uint16_t id : {0x1234, 0x4321}) {
+		hdr = ask("www.fwd.test", id, 0, reply);
+		if (hdr->id != id || hdr->rcode != 0 || ntohs(hdr->a_count) != 1)
+			die("forwarder answer not passed back with the client's ID");
+		rewritten |= (seen_id != id);
+	}
+	if (!rewritten)
+		die("forwarder did not rewrite the query ID");
+
+	hdr = ask("drop.fwd.test", 1, 0, reply);
+	if (hdr->rcode != 0 || ntohs(hdr->a_count) != 1)
+		die("forwarder did not retry a lost query");
+
+	hdr = ask("dead.fwd.test", 2, 0, reply);
+	if (hdr->id != 2 || hdr->rcode != 2 || hdr->a_count != 0)
+		die("forwarder did not answer SERVFAIL after the retries");
+
+	cached = "";
+	hdr = ask("big.fwd.test", 3, 4096, reply);
+	if (hdr->tc || ntohs(hdr->a_count) != 40)
+		die("truncated answer not fetched via TCP");
+	if (cached.size() != reply.size())
+		die("cache hook did not get the TCP answer");
+
+	cached = "";
+	hdr = ask("big.fwd.test", 4, 0, reply);
+	if (!hdr->tc || hdr->a_count != 0 || ntohs(hdr->q_count) != 1 || reply.size() > 512)
+		die("TCP answer not truncated for a 512 byte client");
+	if (ntohs(reinterpret_cast<const dnshdr *>(cached.c_str())->a_count) != 40)
+		die("cache hook got the truncated answer");
+
+	stop = true;
+	srv.join();
+	config::forward_timeout_ms = old_timeout;
+	config::forward_retries = old_retries;
+	close(client);
+	close(lsock);
+	close(usrv);
+	close(tsrv);
+}
+
+
+// A listed domain blocks its subdomains, but not its parent or names that
+// only end in the same characters. load() and unload() swap the list.
+static void check_blocklist()
+{
+	auto compile = [](const vector<string> &names, const string &path) {
+		vector<uint64_t> hashes;
+		for (const auto &n : names)
+			hashes.push_back(blocklist::hash(n.c_str(), n.size()));
+		string err = "";
+		if (blocklist::compile(hashes, path, err) < 0 || blocklist::load(path, err) < 0)
+			die("blocklist check:", err);
+		unlink(path.c_str());
+	};
+
+	const string path = "/tmp/harddns-bench-blocklist-check.bin";
+	compile({"ads.example.com", "tracker.example"}, path);
+	if (blocklist::size() != 2)
+		die("blocklist check: wrong size", to_string(blocklist::size()));
+	if (!blocklist::blocked("ads.example.com") || !blocklist::blocked("x.ads.example.com"))
+		die("listed domain or its subdomain not blocked");
+	if (!blocklist::blocked("ADS.Example.com."))
+		die("case or trailing dot defeats the blocklist");
+	if (blocklist::blocked("example.com") || blocklist::blocked("bads.example.com"))
+		die("blocklist blocks what is not listed");
+
+	// a reload replaces the list
+	compile({"other.example"}, path);
+	if (blocklist::blocked("x.ads.example.com") || !blocklist::blocked("www.other.example"))
+		die("reloaded blocklist not swapped in");
+
+	blocklist::unload();
+	if (blocklist::blocked("www.other.example") || blocklist::size() != 0)
+		die("unloaded blocklist still blocks");
+}
+
+
+static void bench_base64()
+{
+	mt19937 rng(42);
+	string q = "", e = "", d = "";
+	char ebuf[1024], dbuf[1024];
+
+	// typical rfc8484 query: hdr + ~30 byte qname + type + class
+	string query(12 + 32 + 4, 0);
+	for (auto &c : query)
+		c = (char)rng();
+	string large(768, 0);
+	for (auto &c : large)
+		c = (char)rng();
+
+	bench("legacy::b64url_encode (48 bytes)", 1, [&]{
+		legacy::b64url_encode(query, e);
+		keep(e);
+	}, query.size());
+	bench("b64url_encode (48 bytes, string)", 1, [&]{
+		b64url_encode(query, e);
+		keep(e);
+	}, query.size());
+	bench("b64url_encode (48 bytes, buffer)", 1, [&]{
+		keep(b64url_encode(query.c_str(), query.size(), ebuf));
+		keep(ebuf);
+	}, query.size());
+	bench("legacy::b64url_encode (768 bytes)", 1, [&]{
+		legacy::b64url_encode(large, e);
+		keep(e);
+	}, large.size());
+	bench("b64url_encode (768 bytes, buffer)", 1, [&]{
+		keep(b64url_encode(large.c_str(), large.size(), ebuf));
+		keep(ebuf);
+	}, large.size());
+
+	b64url_encode(large, e);
+	bench("b64_decode (1024 chars, buffer)", 1, [&]{
+		keep(b64_decode(e.c_str(), e.size(), dbuf, sizeof(dbuf)));
+		keep(dbuf);
+	}, e.size());
+}
+
+
+struct fixture {
+	string file, name;
+	uint16_t qtype;
+	bool rfc8484;
+
+	pmr::string reply;
+	string::size_type content_idx;
+	size_t cl;
+};
+
+
+// Recorded upstream replies, including the HTTP header. Find content
+// the same way dnshttps::get() does.
+static void load_fixture(const string &dir, fixture &fx)
+{
+	ifstream f(dir + "/" + fx.file, ios::binary);
+	if (!f)
+		die("Unable to open fixture", dir + "/" + fx.file);
+	ostringstream os;
+	os<<f.rdbuf();
+	fx.reply.assign(os.str().c_str(), os.str().size());
+
+	fx.content_idx = string::npos;
+	fx.cl = 0;
+	if (fx.reply.find("Transfer-Encoding: chunked\r\n") != string::npos)
+		return;
+
+	string::size_type idx = fx.reply.find("Content-Length:");
+	if (idx == string::npos)
+		die("No Content-Length in", fx.file);
+	fx.cl = strtoul(fx.reply.c_str() + idx + 15, nullptr, 10);
+	fx.content_idx = fx.reply.find("\r\n\r\n") + 4;
+}
+
+
+static vector<fixture> fixtures = {
+	{"rfc8484-amazon-A.http", "www.amazon.com", htons(dns_type::A), 1},
+	{"rfc8484-dns.google-AAAA-chunked.http", "dns.google", htons(dns_type::AAAA), 1},
+	{"json-github-A.http", "www.github.com", htons(dns_type::A), 0},
+	{"json-cloudflare-AAAA.http", "www.cloudflare.com", htons(dns_type::AAAA), 0},
+};
+
+
+static void bench_query()
+{
+	pmr::string req = "";
+
+	bench("make_query", 1, [&]{
+		req = "GET /dns-query?dns=";
+		keep(make_query("www.example.com", htons(dns_type::A), req));
+		keep(req);
+	});
+}
+
+
+static void bench_parsers(const string &dir)
+{
+	dnshttps d(nullptr);
+	dnshttps::dns_reply result;
+	string raw = "";
+
+	for (auto &fx : fixtures) {
+		load_fixture(dir, fx);
+
+		result.clear();
+		if (bench_access::parse(d, fx.rfc8484, fx.name, fx.qtype, result, raw, fx.reply, fx.content_idx, fx.cl) != 1)
+			die("Fixture does not parse:", fx.file + " " + d.why());
+
+		string what = (fx.rfc8484 ? "parse_rfc8484 " : "parse_json ") + fx.file;
+		bench(what.c_str(), 1, [&]{
+			result.clear();
+			keep(bench_access::parse(d, fx.rfc8484, fx.name, fx.qtype, result, raw, fx.reply, fx.content_idx, fx.cl));
+		});
+	}
+}
+
+
+static void bench_cache()
+{
+	doh_proxy proxy;
+	dnshttps d(nullptr);
+	dnshttps::dns_reply result;
+	string raw = "";
+
+	const fixture &fx = fixtures[0];
+	if (bench_access::parse(d, fx.rfc8484, fx.name, fx.qtype, result, raw, fx.reply, fx.content_idx, fx.cl) != 1)
+		die("Fixture does not parse:", fx.file);
+
+	vector<string> names;
+	for (int i = 0; i < 1000; ++i)
+		names.push_back("host" + to_string(i) + ".example.com");
+
+	size_t i = 0;
+	bench("doh_proxy::cache_insert (1000 names)", 1, [&]{
+		bench_access::cache_insert(proxy, names[i++ % names.size()], fx.qtype, result);
+	});
+
+	const dnshttps::dns_reply *cached = nullptr;
+	bench("doh_proxy::cache_lookup (hit)", 1, [&]{
+		keep(bench_access::cache_lookup(proxy, names[i++ % names.size()], fx.qtype, cached));
+	});
+	bench("doh_proxy::cache_lookup (miss)", 1, [&]{
+		keep(bench_access::cache_lookup(proxy, "nx.example.com", fx.qtype, cached));
+	});
+}
+
+
+// split-horizon setups with many internal_domain's
+static void bench_routing()
+{
+	forwarder fwd;
+	map<string, string> zones;
+
+	for (int i = 0; i < 5000; ++i)
+		zones["zone" + to_string(i) + ".corp.example"] = "127.0.0.1";
+	zones["corp.example"] = "127.0.0.1";
+
+	if (fwd.init(-1, zones) < 0)
+		die("Unable to set up forwarder:", fwd.why());
+
+	bool cache = 0;
+	if (fwd.target_of("www.zone4711.corp.example", cache) < 0 || fwd.target_of("ample.com", cache) >= 0)
+		die("Routing broken");
+
+	const string hit = "host.www.zone4711.corp.example", miss = "host.www.example.com";
+	bench("forwarder::target_of (5001 zones, hit)", 1, [&]{
+		keep(fwd.target_of(hit, cache));
+	});
+	bench("forwarder::target_of (5001 zones, miss)", 1, [&]{
+		keep(fwd.target_of(miss, cache));
+	});
+}
+
+
+static void bench_blocklist()
+{
+	vector<uint64_t> hashes;
+	for (int i = 0; i < 1000000; ++i) {
+		string d = "ads" + to_string(i) + ".tracker.example";
+		hashes.push_back(blocklist::hash(d.c_str(), d.size()));
+	}
+
+	string err = "", path = "/tmp/harddns-bench-blocklist.bin";
+	if (blocklist::compile(hashes, path, err) < 0 || blocklist::load(path, err) < 0)
+		die("Unable to set up blocklist:", err);
+	unlink(path.c_str());
+
+	if (!blocklist::blocked("www.ADS4711.tracker.example.") || blocklist::blocked("tracker.example"))
+		die("Blocklist broken");
+
+	const string hit = "www.ads4711.tracker.example", miss = "host.www.example.com";
+	bench("blocklist::blocked (1M names, hit)", 1, [&]{
+		keep(blocklist::blocked(hit));
+	});
+	bench("blocklist::blocked (1M names, miss)", 1, [&]{
+		keep(blocklist::blocked(miss));
+	});
+}
+
+
+int main(int argc, char **argv)
+{
+	string fixture_dir = "fixtures";
+	if (argc > 1)
+		fixture_dir = argv[1];
+
+	check_name_codec();
+
+	vector<string> hostnames = make_hostnames(1024);
+	check_name_kernel(hostnames);
+	check_base64();
+	check_pin_resumption();
+	check_shmcache();
+	check_nss_cache();
+	check_forwarder();
+	check_blocklist();
+
+	bench_name_codec();
+	bench_name_kernel(hostnames);
+	bench_base64();
+	bench_query();
+	bench_parsers(fixture_dir);
+	bench_cache();
+	bench_routing();
+	bench_blocklist();
+
+	return 0;
+}
+
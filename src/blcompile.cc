@@ -0,0 +1,194 @@
+/*
+ * This file is part of harddns.
+ *
+ * (C) 2023 by Sebastian Krahmer,
+ *             sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * harddns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * harddns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with harddns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// harddns-blocklist: compiles domain lists into the memory-mapped format
+// that harddnsd and the NSS module load via "blocklist =" in harddns.conf
+
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <fstream>
+#include <unistd.h>
+#include "blocklist.h"
+
+
+using namespace std;
+using namespace harddns;
+
+
+// Takes plain domain lists, hosts files ("0.0.0.0 ads.example.com") and
+// the "||ads.example.com^" rules of adblock lists. Returns the
+// normalized domain or "" if the token is none.
+static string normalize(string tok)
+{
+	if (tok.find("||") == 0) {
+		tok.erase(0, 2);
+		string::size_type caret = tok.find("^");
+		if (caret == string::npos || caret + 1 != tok.size())
+			return "";
+		tok.erase(caret);
+	}
+	if (tok.find("*.") == 0)
+		tok.erase(0, 2);
+	while (tok.size() && tok.back() == '.')
+		tok.pop_back();
+
+	if (tok.empty() || tok.size() > 253)
+		return "";
+
+	// hostnames, plus the '_' that shows up in the wild
+	for (auto &c : tok) {
+		c = tolower((unsigned char)c);
+		if (!isalnum((unsigned char)c) && c != '-' && c != '.' && c != '_')
+			return "";
+	}
+
+	// single labels such as "localhost" or "broadcasthost" of hosts files
+	if (tok.find(".") == string::npos || tok[0] == '.' || tok.find("..") != string::npos)
+		return "";
+	if (tok == "localhost.localdomain")
+		return "";
+
+	return tok;
+}
+
+
+static bool is_addr(const string &tok)
+{
+	return tok.find_first_not_of("0123456789.") == string::npos || tok.find(":") != string::npos;
+}
+
+
+static int read_list(istream &in, vector<uint64_t> &hashes, size_t &skipped)
+{
+	string line = "";
+
+	while (getline(in, line)) {
+		string::size_type c = line.find_first_of("#!");
+		if (c != string::npos)
+			line.erase(c);
+
+		vector<string> toks;
+		string::size_type idx = 0;
+		for (;;) {
+			idx = line.find_first_not_of(" \t\r", idx);
+			if (idx == string::npos)
+				break;
+			string::size_type end = line.find_first_of(" \t\r", idx);
+			toks.push_back(line.substr(idx, end == string::npos ? string::npos : end - idx));
+			idx = end;
+		}
+		if (toks.empty())
+			continue;
+
+		// hosts file line: address, then names
+		size_t first = (toks.size() > 1 && is_addr(toks[0])) ? 1 : 0;
+		for (size_t i = first; i < toks.size(); ++i) {
+			string name = normalize(toks[i]);
+			if (name.empty()) {
+				++skipped;
+				continue;
+			}
+			hashes.push_back(blocklist::hash(name.c_str(), name.size()));
+		}
+	}
+
+	return 0;
+}
+
+
+static void usage(const char *p)
+{
+	cout<<"\nUsage: "<<p<<" -o compiled [list ...]\n"
+	    <<"       "<<p<<" -q compiled name ...\n\n"
+	    <<"\t-o\tcompile the lists (or stdin) into that file, replacing it atomically\n"
+	    <<"\t-q\tcheck whether the names are blocked by a compiled list\n\n"
+	    <<"Lists may contain plain domains, hosts file lines or ||domain^ adblock rules.\n"
+	    <<"A listed domain also blocks all names below it.\n\n";
+}
+
+
+int main(int argc, char **argv)
+{
+	string out = "", query = "", err = "";
+	int c = 0;
+
+	while ((c = getopt(argc, argv, "o:q:h")) != -1) {
+		switch (c) {
+		case 'o':
+			out = optarg;
+			break;
+		case 'q':
+			query = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (out.empty() == query.empty()) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (query.size()) {
+		if (blocklist::load(query, err) < 0) {
+			cerr<<err<<endl;
+			return 1;
+		}
+		int r = 1;
+		for (int i = optind; i < argc; ++i) {
+			bool b = blocklist::blocked(argv[i], strlen(argv[i]));
+			cout<<argv[i]<<(b ? " blocked\n" : " not blocked\n");
+			if (b)
+				r = 0;
+		}
+		return r;
+	}
+
+	vector<uint64_t> hashes;
+	size_t skipped = 0;
+
+	if (optind == argc)
+		read_list(cin, hashes, skipped);
+
+	for (int i = optind; i < argc; ++i) {
+		ifstream in(argv[i]);
+		if (!in) {
+			cerr<<"Unable to open "<<argv[i]<<endl;
+			return 1;
+		}
+		read_list(in, hashes, skipped);
+	}
+
+	if (blocklist::compile(hashes, out, err) < 0) {
+		cerr<<err<<endl;
+		return 1;
+	}
+
+	cout<<hashes.size()<<" domains compiled into "<<out<<", "<<skipped<<" entries skipped.\n";
+	return 0;
+}
+
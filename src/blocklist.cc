@@ -0,0 +1,293 @@
+/*
+ * This file is part of harddns.
+ *
+ * (C) 2023 by Sebastian Krahmer,
+ *             sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * harddns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * harddns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with harddns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <new>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cerrno>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "blocklist.h"
+#include "misc.h"
+
+
+namespace harddns {
+
+namespace blocklist {
+
+using namespace std;
+
+
+// Bloom filter sizing: ~1% false positives, which then cost a binary search
+constexpr uint64_t BITS_PER_NAME = 12;
+constexpr uint32_t K = 7;
+
+constexpr uint64_t BLOCK_WORDS = 8, BLOCK_BITS = 64*BLOCK_WORDS;
+
+
+struct mapping {
+	void *base{nullptr};
+	size_t len{0};
+	const header *hdr{nullptr};
+	const uint64_t *blocks{nullptr}, *hashes{nullptr};
+
+	~mapping()
+	{
+		if (base)
+			munmap(base, len);
+	}
+};
+
+// swapped by load(), with the atomic shared_ptr accessors
+static shared_ptr<const mapping> active;
+
+// saves the atomic_load() if there is no list at all
+static atomic<bool> has_list{false};
+
+
+// splitmix64 finalizer
+static inline uint64_t mix(uint64_t x)
+{
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return x;
+}
+
+
+uint64_t hash(const char *name, size_t len)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < len; ++i) {
+		h ^= (unsigned char)name[i];
+		h *= 0x100000001b3ULL;
+	}
+	return mix(h);
+}
+
+
+// The block is chosen by the low bits of h, the bits inside of it by 9 bit
+// slices of a second hash.
+static inline bool bloom_test(const uint64_t *blocks, uint64_t nblocks, uint32_t k, uint64_t h)
+{
+	const uint64_t *blk = blocks + (h & (nblocks - 1))*BLOCK_WORDS;
+	uint64_t h2 = mix(h ^ 0x9e3779b97f4a7c15ULL);
+
+	for (uint32_t i = 0; i < k; ++i, h2 >>= 9) {
+		unsigned int bit = h2 & (BLOCK_BITS - 1);
+		if (!(blk[bit>>6] & (1ULL<<(bit & 63))))
+			return 0;
+	}
+	return 1;
+}
+
+
+static inline void bloom_set(uint64_t *blocks, uint64_t nblocks, uint32_t k, uint64_t h)
+{
+	uint64_t *blk = blocks + (h & (nblocks - 1))*BLOCK_WORDS;
+	uint64_t h2 = mix(h ^ 0x9e3779b97f4a7c15ULL);
+
+	for (uint32_t i = 0; i < k; ++i, h2 >>= 9) {
+		unsigned int bit = h2 & (BLOCK_BITS - 1);
+		blk[bit>>6] |= 1ULL<<(bit & 63);
+	}
+}
+
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = reinterpret_cast<const char *>(buf);
+	while (len > 0) {
+		ssize_t n = ::write(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+
+int compile(vector<uint64_t> &hashes, const string &path, string &err)
+{
+	sort(hashes.begin(), hashes.end());
+	hashes.erase(unique(hashes.begin(), hashes.end()), hashes.end());
+
+	header hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, "HDNSBL\0\0", sizeof(hdr.magic));
+	hdr.version = VERSION;
+	hdr.k = K;
+	hdr.n = hashes.size();
+	hdr.nblocks = 1;
+	while (hdr.nblocks*BLOCK_BITS < hdr.n*BITS_PER_NAME)
+		hdr.nblocks <<= 1;
+
+	vector<uint64_t> blocks(hdr.nblocks*BLOCK_WORDS, 0);
+	for (auto h : hashes)
+		bloom_set(blocks.data(), hdr.nblocks, hdr.k, h);
+
+	// rename() so that running harddns instances never see a partial file
+	string tmp = path + ".tmp";
+	int fd = open(tmp.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (fd < 0) {
+		err = "blocklist::compile::open:" + string(strerror(errno));
+		return -1;
+	}
+	if (write_all(fd, &hdr, sizeof(hdr)) < 0 ||
+	    write_all(fd, blocks.data(), blocks.size()*sizeof(uint64_t)) < 0 ||
+	    write_all(fd, hashes.data(), hashes.size()*sizeof(uint64_t)) < 0 ||
+	    fsync(fd) < 0) {
+		err = "blocklist::compile::write:" + string(strerror(errno));
+		close(fd);
+		unlink(tmp.c_str());
+		return -1;
+	}
+	close(fd);
+
+	if (rename(tmp.c_str(), path.c_str()) < 0) {
+		err = "blocklist::compile::rename:" + string(strerror(errno));
+		unlink(tmp.c_str());
+		return -1;
+	}
+	return 0;
+}
+
+
+int load(const string &path, string &err)
+{
+	int fd = open(path.c_str(), O_RDONLY|O_CLOEXEC);
+	if (fd < 0) {
+		err = "blocklist::load::open:" + string(strerror(errno));
+		return -1;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(header)) {
+		close(fd);
+		err = "blocklist::load: Invalid blocklist " + path;
+		return -1;
+	}
+
+	auto m = make_shared<mapping>();
+	m->len = st.st_size;
+	m->base = mmap(nullptr, m->len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (m->base == MAP_FAILED) {
+		m->base = nullptr;
+		err = "blocklist::load::mmap:" + string(strerror(errno));
+		return -1;
+	}
+
+	m->hdr = reinterpret_cast<const header *>(m->base);
+	const header *hdr = m->hdr;
+	if (memcmp(hdr->magic, "HDNSBL\0\0", sizeof(hdr->magic)) != 0 || hdr->version != VERSION) {
+		err = "blocklist::load: Not a blocklist or wrong version/byte order: " + path;
+		return -1;
+	}
+	if (hdr->k == 0 || hdr->k > 7 || hdr->nblocks == 0 || (hdr->nblocks & (hdr->nblocks - 1)) != 0 ||
+	    hdr->nblocks > m->len || hdr->n > m->len ||
+	    m->len != sizeof(header) + (hdr->nblocks*BLOCK_WORDS + hdr->n)*sizeof(uint64_t)) {
+		err = "blocklist::load: Corrupt blocklist " + path;
+		return -1;
+	}
+
+	m->blocks = reinterpret_cast<const uint64_t *>(reinterpret_cast<const char *>(m->base) + sizeof(header));
+	m->hashes = m->blocks + hdr->nblocks*BLOCK_WORDS;
+
+	// every lookup touches the filter, the hashes only on a hit
+	madvise(m->base, sizeof(header) + hdr->nblocks*BLOCK_WORDS*sizeof(uint64_t), MADV_WILLNEED);
+	madvise(const_cast<uint64_t *>(m->hashes), hdr->n*sizeof(uint64_t), MADV_RANDOM);
+
+	atomic_store(&active, shared_ptr<const mapping>(m));
+	has_list.store(1, memory_order_release);
+	return 0;
+}
+
+
+void unload()
+{
+	has_list.store(0, memory_order_release);
+	atomic_store(&active, shared_ptr<const mapping>());
+}
+
+
+static inline bool contains(const mapping &m, uint64_t h)
+{
+	if (!bloom_test(m.blocks, m.hdr->nblocks, m.hdr->k, h))
+		return 0;
+	return binary_search(m.hashes, m.hashes + m.hdr->n, h);
+}
+
+
+bool blocked(const char *name, size_t len)
+{
+	if (!has_list.load(memory_order_acquire))
+		return 0;
+
+	shared_ptr<const mapping> m = atomic_load(&active);
+	if (!m)
+		return 0;
+
+	char buf[256];
+	if (len > 0 && name[len - 1] == '.')
+		--len;
+	if (len == 0 || len >= sizeof(buf))
+		return 0;
+	lcs(name, len, buf);
+
+	// the name itself, then each parent domain
+	const char *p = buf;
+	for (;;) {
+		if (contains(*m, hash(p, len)))
+			return 1;
+		const char *dot = reinterpret_cast<const char *>(memchr(p, '.', len));
+		if (!dot)
+			break;
+		len -= dot + 1 - p;
+		p = dot + 1;
+	}
+
+	return 0;
+}
+
+
+uint64_t size()
+{
+	shared_ptr<const mapping> m = atomic_load(&active);
+	return m ? m->hdr->n : 0;
+}
+
+
+}
+
+}
+
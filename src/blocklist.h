@@ -0,0 +1,83 @@
+/*
+ * This file is part of harddns.
+ *
+ * (C) 2023 by Sebastian Krahmer,
+ *             sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * harddns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * harddns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with harddns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef harddns_blocklist_h
+#define harddns_blocklist_h
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+
+namespace harddns {
+
+namespace blocklist {
+
+
+// Layout of a compiled blocklist, in host byte order:
+//
+// header | nblocks * 8 uint64_t blocked Bloom filter | n sorted uint64_t name hashes
+//
+// Each block is a cache line, so the prefilter costs a single miss for the
+// names that are not listed, which are most of them.
+struct header {
+	char magic[8];		// "HDNSBL\0\0"
+	uint32_t version;	// also tells the byte order
+	uint32_t k;		// bits set per name in its block
+	uint64_t n, nblocks;
+	uint64_t reserved[4];	// so the blocks are cache line aligned
+};
+
+constexpr uint32_t VERSION = 1;
+
+
+// 64bit hash of a lowercase name without trailing dot
+uint64_t hash(const char *name, size_t len);
+
+// Writes the sorted and unique'd hashes to path, atomically replacing it
+int compile(std::vector<uint64_t> &hashes, const std::string &path, std::string &err);
+
+// Maps a compiled list and swaps it in for the current one. Lookups that
+// are underway keep the old mapping until they are done.
+int load(const std::string &path, std::string &err);
+
+// Drops the current list, once the lookups that use it are done
+void unload();
+
+// Whether name or one of its parent domains is listed. Case and a
+// trailing dot do not matter.
+bool blocked(const char *name, size_t len);
+
+inline bool blocked(const std::string &name)
+{
+	return blocked(name.c_str(), name.size());
+}
+
+// number of names in the current list
+uint64_t size();
+
+
+}
+
+}
+
+#endif
+
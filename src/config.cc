@@ -22,9 +22,12 @@
 #include <cstring>
 #include <cstdlib>
 #include <algorithm>
+#include <atomic>
 #include <string>
 #include <list>
 #include <map>
+#include <set>
+#include <vector>
 #include <stdint.h>
 #include <unistd.h>
 #include "config.h"
@@ -47,7 +50,18 @@ map<string, struct a_ns_cfg> *ns_cfg = nullptr;
 // map internal domain to internal NS IP
 map<string, string> internal_domains;
 
-bool log_requests = 0, nss_aaaa = 0, cache_PTR = 0;
+set<string> internal_nocache;
+
+string *cafile = nullptr, *stats_socket = nullptr, *qlog = nullptr, *blocklist = nullptr, *nss_socket = nullptr,
+       *shared_cache = nullptr;
+
+vector<string> pin_sha256;
+
+bool log_requests = 0, nss_aaaa = 0, cache_PTR = 0, pin_only = 0;
+
+atomic<unsigned int> slow_query_ms{0};
+
+unsigned int forward_timeout_ms = 1000, forward_retries = 2, nss_cache = 1024, nss_max_conns = 4;
 
 
 int parse_config(const string &cfgbase)
@@ -79,24 +93,75 @@ int parse_config(const string &cfgbase)
 			config::log_requests = 1;
 		else if (sline.find("nss_aaaa") == 0)
 			config::nss_aaaa = 1;
+		else if (sline.find("pin_only") == 0)
+			config::pin_only = 1;
+		else if (sline.find("cache_PTR") == 0)
+			config::cache_PTR = 1;
+		else if (sline.find("pin_sha256=") == 0)
+			config::pin_sha256.push_back(sline.substr(11));
 		else if (sline.find("internal_domain=") == 0) {
 			string::size_type comma = sline.find(",");
-			if (comma != string::npos && comma > 16)
-				config::internal_domains[sline.substr(16, comma - 16)] = sline.substr(comma + 1);
-		} else if (sline.find("rfc8484") == 0) {
-			config::ns_cfg->find(ns)->second.rfc8484 = 1;
+			if (comma != string::npos && comma > 16) {
+				string domain = sline.substr(16, comma - 16), ns = sline.substr(comma + 1);
+
+				// "company.lan, 192.168.0.1, nocache"
+				if ((comma = ns.find(",")) != string::npos) {
+					if (ns.substr(comma + 1) == "nocache")
+						config::internal_nocache.insert(domain);
+					ns.erase(comma);
+				}
+				config::internal_domains[domain] = ns;
+			}
+		} else if (sline.find("cafile=") == 0) {
+			delete cafile;
+			cafile = new (nothrow) string(sline.substr(7));
+		} else if (sline.find("stats_socket=") == 0) {
+			delete stats_socket;
+			stats_socket = new (nothrow) string(sline.substr(13));
+		} else if (sline.find("nss_socket=") == 0) {
+			delete nss_socket;
+			nss_socket = new (nothrow) string(sline.substr(11));
+		} else if (sline.find("shared_cache=") == 0) {
+			delete shared_cache;
+			shared_cache = new (nothrow) string(sline.substr(13));
+		} else if (sline.find("qlog=") == 0) {
+			delete qlog;
+			qlog = new (nothrow) string(sline.substr(5));
+		} else if (sline.find("blocklist=") == 0) {
+			delete blocklist;
+			blocklist = new (nothrow) string(sline.substr(10));
+		} else if (sline.find("nss_cache=") == 0) {
+			config::nss_cache = strtoul(sline.c_str() + 10, nullptr, 10);
+		} else if (sline.find("nss_max_conns=") == 0) {
+			config::nss_max_conns = strtoul(sline.c_str() + 14, nullptr, 10);
+			if (config::nss_max_conns == 0)
+				config::nss_max_conns = 1;
+		} else if (sline.find("slow_query_ms=") == 0) {
+			config::slow_query_ms = strtoul(sline.c_str() + 14, nullptr, 10);
+		} else if (sline.find("forward_timeout_ms=") == 0) {
+			config::forward_timeout_ms = strtoul(sline.c_str() + 19, nullptr, 10);
+		} else if (sline.find("forward_retries=") == 0) {
+			config::forward_retries = strtoul(sline.c_str() + 16, nullptr, 10);
 		} else if (sline.find("nameserver=") == 0) {
 			ns = sline.substr(11);
 			config::ns->push_back(ns);
-			config::ns_cfg->insert(make_pair(ns, a_ns_cfg{ns, "no-cn", "no-host", "no-get", 443, 0}));
-		} else if (sline.find("cn=") == 0) {
-			config::ns_cfg->find(ns)->second.cn = sline.substr(3);
-		} else if (sline.find("host=") == 0) {
-			config::ns_cfg->find(ns)->second.host = sline.substr(5);
-		} else if (sline.find("get=") == 0) {
-			config::ns_cfg->find(ns)->second.get = sline.substr(4);
-		} else if (sline.find("port=") == 0) {
-			config::ns_cfg->find(ns)->second.port = (uint16_t)strtoul(sline.c_str() + 5, nullptr, 10);
+			config::ns_cfg->insert(make_pair(ns, a_ns_cfg{ns, "no-cn", "no-host", "no-get", 443, 0, (unsigned int)config::ns_cfg->size()}));
+		} else {
+			// options of the last nameserver, if there was one yet
+			auto it = config::ns_cfg->find(ns);
+			if (it == config::ns_cfg->end())
+				continue;
+
+			if (sline.find("rfc8484") == 0)
+				it->second.rfc8484 = 1;
+			else if (sline.find("cn=") == 0)
+				it->second.cn = sline.substr(3);
+			else if (sline.find("host=") == 0)
+				it->second.host = sline.substr(5);
+			else if (sline.find("get=") == 0)
+				it->second.get = sline.substr(4);
+			else if (sline.find("port=") == 0)
+				it->second.port = (uint16_t)strtoul(sline.c_str() + 5, nullptr, 10);
 		}
 	}
 
@@ -104,6 +169,98 @@ int parse_config(const string &cfgbase)
 	return 0;
 }
 
+
+int reload(const string &cfgbase)
+{
+	list<string> *old_ns = ns;
+	map<string, struct a_ns_cfg> *old_ns_cfg = ns_cfg;
+	string *old_cafile = cafile, *old_stats_socket = stats_socket, *old_qlog = qlog, *old_blocklist = blocklist, *old_nss_socket = nss_socket;
+	string *old_shared_cache = shared_cache;
+	map<string, string> old_internal_domains = internal_domains;
+	set<string> old_internal_nocache = internal_nocache;
+	vector<string> old_pin_sha256 = pin_sha256;
+	bool old_log_requests = log_requests, old_nss_aaaa = nss_aaaa, old_pin_only = pin_only, old_cache_PTR = cache_PTR;
+	unsigned int old_slow_query_ms = slow_query_ms, old_forward_timeout_ms = forward_timeout_ms, old_forward_retries = forward_retries;
+	unsigned int old_nss_cache = nss_cache, old_nss_max_conns = nss_max_conns;
+
+	// defaults for everything that the config may set
+	ns = nullptr;
+	ns_cfg = nullptr;
+	cafile = stats_socket = qlog = blocklist = nss_socket = shared_cache = nullptr;
+	internal_domains.clear();
+	internal_nocache.clear();
+	pin_sha256.clear();
+	log_requests = nss_aaaa = pin_only = cache_PTR = 0;
+	slow_query_ms = 0;
+	forward_timeout_ms = 1000;
+	forward_retries = 2;
+	nss_cache = 1024;
+	nss_max_conns = 4;
+
+	int r = parse_config(cfgbase);
+
+	delete cafile;
+	delete stats_socket;
+	delete qlog;
+	delete nss_socket;
+	delete shared_cache;
+	cafile = old_cafile;
+	stats_socket = old_stats_socket;
+	qlog = old_qlog;
+	nss_socket = old_nss_socket;
+	shared_cache = old_shared_cache;
+	pin_sha256 = old_pin_sha256;
+	pin_only = old_pin_only;
+	cache_PTR = old_cache_PTR;
+
+	// a config without any nameserver would leave harddnsd without upstreams
+	if (r < 0 || !ns || ns->empty()) {
+		delete ns;
+		delete ns_cfg;
+		delete blocklist;
+		ns = old_ns;
+		ns_cfg = old_ns_cfg;
+		blocklist = old_blocklist;
+		internal_domains = old_internal_domains;
+		internal_nocache = old_internal_nocache;
+		log_requests = old_log_requests;
+		nss_aaaa = old_nss_aaaa;
+		slow_query_ms = old_slow_query_ms;
+		forward_timeout_ms = old_forward_timeout_ms;
+		forward_retries = old_forward_retries;
+		nss_cache = old_nss_cache;
+		nss_max_conns = old_nss_max_conns;
+		return -1;
+	}
+
+	// Keep the slots of the remaining upstreams, so their counters go on.
+	// New ones get the free slots.
+	set<unsigned int> used;
+	for (auto &n : *ns_cfg) {
+		n.second.idx = ~0U;
+		if (!old_ns_cfg)
+			continue;
+		auto it = old_ns_cfg->find(n.first);
+		if (it != old_ns_cfg->end()) {
+			n.second.idx = it->second.idx;
+			used.insert(n.second.idx);
+		}
+	}
+	unsigned int next = 0;
+	for (auto &n : *ns_cfg) {
+		if (n.second.idx != ~0U)
+			continue;
+		while (used.count(next))
+			++next;
+		n.second.idx = next++;
+	}
+
+	delete old_ns;
+	delete old_ns_cfg;
+	delete old_blocklist;
+	return 0;
+}
+
 }	// namespace
 
 }	// namespace
@@ -21,10 +21,13 @@
 #ifndef harddns_config_h
 #define harddns_config_h
 
+#include <atomic>
 #include <cstdint>
 #include <string>
 #include <map>
 #include <list>
+#include <set>
+#include <vector>
 
 extern "C" {
 #include <openssl/ssl.h>
@@ -39,12 +42,54 @@ namespace config {
 extern std::list<std::string> *ns;
 extern bool log_requests, nss_aaaa, cache_PTR;
 
+// log the stage breakdown of DoH requests that take longer, 0 = off. The
+// stats drainer thread reads it while reload() sets it.
+extern std::atomic<unsigned int> slow_query_ms;
+
+// max answers that the NSS module caches per process, 0 = off
+extern unsigned int nss_cache;
+
+// max DoH connections of the NSS module, so that lookups run in parallel
+extern unsigned int nss_max_conns;
+
 extern std::map<std::string, std::string> internal_domains;
 
+// internal domains whose answers are not cached by harddnsd
+extern std::set<std::string> internal_nocache;
+
+// per try of a forwarded query, and how often it is sent again
+extern unsigned int forward_timeout_ms, forward_retries;
+
+// additional trust anchor, e.g. for a local test upstream
+extern std::string *cafile;
+
+// base64 SHA-256 of SubjectPublicKeyInfo's, one of which the upstream
+// chain has to contain. With pin_only, the leaf key must be pinned and
+// the chain is not verified against the CAs at all.
+extern std::vector<std::string> pin_sha256;
+
+extern bool pin_only;
+
+// UNIX socket path for the harddnsd metrics exporter
+extern std::string *stats_socket;
+
+// dnstap query log of harddnsd, file name or "unix:/path"
+extern std::string *qlog;
+
+// compiled blocklist as made by harddns-blocklist
+extern std::string *blocklist;
+
+// UNIX datagram socket on which harddnsd answers the NSS modules of the host
+extern std::string *nss_socket;
+
+// host-wide answer cache that harddnsd writes and the NSS modules read
+extern std::string *shared_cache;
+
 struct a_ns_cfg {
 	std::string ip, cn, host, get;
 	uint16_t port;
 	bool rfc8484;
+	unsigned int idx;	// order of appearance, used as stats slot
 };
 
 extern std::map<std::string, struct a_ns_cfg> *ns_cfg;
@@ -52,6 +97,13 @@ extern std::map<std::string, struct a_ns_cfg> *ns_cfg;
 
 int parse_config(const std::string &cfgbase);
 
+// Parses harddns.conf again into new nameserver maps, which replace the old
+// ones. Upstreams that are still configured keep their stats slot. cafile,
+// pins, stats_socket, nss_socket, shared_cache and qlog are only used at
+// startup and keep their values.
+// Returns -1 and leaves everything as it was if the file can't be read.
+int reload(const std::string &cfgbase);
+
 
 }
 
@@ -69,6 +121,9 @@ constexpr bool WANT_TLS_0RTT = 1;
 
 enum { EARLY_DATA_ACCEPTED = SSL_EARLY_DATA_ACCEPTED };
 
+// server side, only used by the mock upstream
+enum { READ_EARLY_DATA_ERROR = SSL_READ_EARLY_DATA_ERROR, READ_EARLY_DATA_FINISH = SSL_READ_EARLY_DATA_FINISH };
+
 #else
 constexpr bool WANT_TLS_0RTT = 0;
 
@@ -81,10 +136,16 @@ int SSL_get_early_data_status(const void *);
 
 uint32_t SSL_SESSION_get_max_early_data(const void *);
 
+int SSL_read_early_data(void *, void *, size_t, size_t *);
+
+int SSL_CTX_set_max_early_data(void *, uint32_t);
+
 // will not result in actual code, so we can define any value if early data
 // is not available in the libs
 enum { EARLY_DATA_ACCEPTED = 0 };
 
+enum { READ_EARLY_DATA_ERROR = 0, READ_EARLY_DATA_FINISH = 2 };
+
 #endif
 
 }
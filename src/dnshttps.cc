@@ -19,10 +19,13 @@
  */
 
 #include <string>
+#include <cstring>
 #include <algorithm>
 #include <iostream>
 #include <sstream>
 #include <map>
+#include <mutex>
+#include <memory_resource>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -34,6 +37,7 @@
 #include "net-headers.h"
 #include "base64.h"
 #include "config.h"
+#include "stats.h"
 
 
 namespace harddns {
@@ -44,14 +48,29 @@ using namespace net_headers;
 
 dnshttps *dns = nullptr;
 
+// the NSS module may have several instances, which share the rotation
+static mutex ns_mtx;
 
-// construct a DNS query for rfc8484
-string make_query(const string &name, uint16_t qtype)
+
+// next upstream in turn, moved to the end of the list
+static string next_ns()
+{
+	lock_guard<mutex> g(ns_mtx);
+
+	string ns = config::ns->front();
+	config::ns->push_back(ns);
+	config::ns->pop_front();
+	return ns;
+}
+
+
+// construct a DNS query for rfc8484 and append it base64url encoded to req
+int make_query(const string &name, uint16_t qtype, pmr::string &req)
 {
 	timeval tv = {0, 0};
 	gettimeofday(&tv, nullptr);
 
-	string dns_query = "", qname = "", b64query = "";
+	char query[sizeof(dnshdr) + 512];
 
 	uint16_t qclass = htons(1);
 
@@ -61,17 +80,23 @@ string make_query(const string &name, uint16_t qtype)
 	qhdr.rd = 1;
 	qhdr.id = tv.tv_usec % 0xffff;
 
-	host2qname(name, qname);
-	if (!qname.size())
-		return b64query;
+	memcpy(query, &qhdr, sizeof(qhdr));
+
+	// encode qname in place, leaving room for qtype and qclass
+	int qnlen = host2qname(name.c_str(), name.size(), query + sizeof(qhdr), sizeof(query) - sizeof(qhdr) - 2*sizeof(uint16_t));
+	if (qnlen <= 0)
+		return -1;
 
-	dns_query = string(reinterpret_cast<char *>(&qhdr), sizeof(qhdr));
-	dns_query += qname;
-	dns_query += string(reinterpret_cast<char *>(&qtype), sizeof(uint16_t));
-	dns_query += string(reinterpret_cast<char *>(&qclass), sizeof(uint16_t));
+	size_t qlen = sizeof(qhdr) + qnlen;
+	memcpy(query + qlen, &qtype, sizeof(qtype));
+	qlen += sizeof(qtype);
+	memcpy(query + qlen, &qclass, sizeof(qclass));
+	qlen += sizeof(qclass);
 
-	b64url_encode(dns_query, b64query);
-	return b64query;
+	size_t off = req.size();
+	req.resize(off + b64url_encoded_len(qlen));
+	b64url_encode(query, qlen, &req[off]);
+	return 0;
 }
 
 
@@ -80,167 +105,314 @@ string make_query(const string &name, uint16_t qtype)
 // https://www.quad9.net/doh-quad9-dns-servers
 // https://tools.ietf.org/html/rfc8484
 
-int dnshttps::get(const string &name, uint16_t qtype, dns_reply &result, string &raw)
+void dnshttps::submit_timing(bool ok)
 {
-	// don't:
-	//result.clear();
-	raw = "";
+	d_inflight.qt.ok = ok;
+	d_inflight.qt.total_us = stats::now_us() - d_inflight.start;
+	stats::submit(d_inflight.qt);
+}
 
-	if (!ssl || !config::ns)
-		return build_error("Not properly initialized.", -1);
 
-	if (!valid_name(name))
-		return build_error("Invalid FQDN", -1);
+int dnshttps::send_request(const string &name, uint16_t qtype)
+{
+	// nothing from the last query lives anymore
+	arena.reset();
+	d_answered = 0;
 
-	for (unsigned int i = 0; i < config::ns->size(); ++i) {
+	pmr::string req{arena.resource()};
+	req.reserve(1024);
 
-		string ns = ssl->peer();
+	string ns = ssl->peer();
 
-		if (ns.size() == 0) {
-			ns = config::ns->front();
+	// cycle through list of DNS servers
+	if (ns.size() == 0)
+		ns = next_ns();
 
-			// cycle through list of DNS servers
-			config::ns->push_back(ns);
-			config::ns->pop_front();
+	const auto &cfg = config::ns_cfg->find(ns);
+	if (cfg == config::ns_cfg->end())
+		return 0;
+	const string &get = cfg->second.get;
+	const string &host = cfg->second.host;
+	const unsigned int up = cfg->second.idx;
+
+	stats::query_timing &qt = d_inflight.qt;
+	d_inflight.ns = ns;
+	d_inflight.up = up;
+	d_inflight.rfc8484 = cfg->second.rfc8484;
+	d_inflight.start = stats::now_us();
+	memset(&qt, 0, sizeof(qt));
+	memcpy(qt.name, name.c_str(), min(name.size(), sizeof(qt.name) - 1));
+	memcpy(qt.upstream, ns.c_str(), min(ns.size(), sizeof(qt.upstream) - 1));
+	qt.qtype = ntohs(qtype);
+
+	//printf(">>>> %s %s %s %s\n", cfg->second.ip.c_str(), cfg->second.get.c_str(), cfg->second.host.c_str(), cfg->second.cn.c_str());
+
+	req = "GET ";
+	req += get;
+
+	if (cfg->second.rfc8484) {
+		if (make_query(name, qtype, req) < 0)
+			return build_error("Failed to create rfc8484 request.", -1);
+	} else {
+		req += name;
+
+		if (qtype == htons(dns_type::A))
+			req += "&type=A";
+		else if (qtype == htons(dns_type::AAAA))
+			req += "&type=AAAA";
+		else if (qtype == htons(dns_type::NS))
+			req += "&type=NS";
+		else if (qtype == htons(dns_type::MX))
+			req += "&type=MX";
+		else if (qtype == htons(dns_type::PTR))
+			req += "&type=PTR";
+		else
+			return build_error("Can't handle query type.", -1);
+	}
+
+	req += " HTTP/1.1\r\nHost: ";
+	req += host;
+	req += "\r\nUser-Agent: harddns 0.58 github.com/stealth/harddns\r\nConnection: Keep-Alive\r\n";
+
+	if (cfg->second.rfc8484)
+		req += "Accept: application/dns-message\r\n";
+	else
+		req += "Accept: application/dns-json\r\n";
+
+
+	if (req.size() < 450) {
+		req += "X-Igno: ";
+		req.append(450 - req.size(), 'X');
+	}
+
+	req += "\r\n\r\n";
+
+	//printf(">>>> %s\n", req.c_str());
+
+	stats::inc(up, stats::UP_REQUESTS);
+
+	uint64_t t = stats::now_us();
+
+	// maybe closed due to error or not initialized in the first place
+	if (ssl->send(req.c_str(), req.size()) <= 0) {
+
+		// (re-)connect is the slow path anyway, so a copy for 0RTT doesn't matter
+		string early_data(req.c_str(), req.size());
+		t = stats::now_us();
+		qt.connected = 1;
+		int cr = ssl->connect(ns, cfg->second.port, early_data);
+		uint64_t tcp_done = ssl->tcp_connected_at();
+		if (tcp_done >= t) {
+			qt.stage_us[stats::STAGE_CONNECT] = tcp_done - t;
+			t = tcp_done;
 		}
+		qt.stage_us[stats::STAGE_TLS] = stats::now_us() - t;
 
-		const auto &cfg = config::ns_cfg->find(ns);
-		if (cfg == config::ns_cfg->end())
-			continue;
-		const string &get = cfg->second.get;
-		const string &host = cfg->second.host;
-
-		//printf(">>>> %s %s %s %s\n", cfg->second.ip.c_str(), cfg->second.get.c_str(), cfg->second.host.c_str(), cfg->second.cn.c_str());
-
-		string req = "GET " + get, reply = "", tmp = "";
-
-		if (cfg->second.rfc8484) {
-			string b64 = make_query(name, qtype);
-			if (!b64.size())
-				return build_error("Failed to create rfc8484 request.", -1);
-			req += b64;
-		} else {
-			req += name;
-
-			if (qtype == htons(dns_type::A))
-				req += "&type=A";
-			else if (qtype == htons(dns_type::AAAA))
-				req += "&type=AAAA";
-			else if (qtype == htons(dns_type::NS))
-				req += "&type=NS";
-			else if (qtype == htons(dns_type::MX))
-				req += "&type=MX";
-			else
-				return build_error("Can't handle query type.", -1);
+		if (cr < 0) {
+			ssl->close();
+			syslog(LOG_INFO, "No SSL connection to %s (%s)", ns.c_str(), ssl->why());
+			stats::inc(up, stats::UP_ERRORS);
+			submit_timing(0);
+			return 0;
 		}
+		if (early_data.empty()) {
+			req.clear();
+			stats::inc(up, stats::UP_TLS_0RTT);
+		} else
+			stats::inc(up, ssl->resumed() ? stats::UP_TLS_RESUMED : stats::UP_TLS_FULL);
+
+		t = stats::now_us();
+		if (req.size() && ssl->send(req.c_str(), req.size()) != (int)req.size()) {
+			ssl->close();
+			syslog(LOG_INFO, "Unable to complete request to %s.", ns.c_str());
+			stats::inc(up, stats::UP_ERRORS);
+			submit_timing(0);
+			return 0;
+		}
+	}
 
-		req += " HTTP/1.1\r\nHost: " + host + "\r\nUser-Agent: harddns 0.58 github.com/stealth/harddns\r\nConnection: Keep-Alive\r\n";
+	d_inflight.sent = stats::now_us();
+	qt.stage_us[stats::STAGE_SEND] = d_inflight.sent - t;
+	return 1;
+}
 
-		if (cfg->second.rfc8484)
-			req += "Accept: application/dns-message\r\n";
-		else
-			req += "Accept: application/dns-json\r\n";
 
+int dnshttps::recv_reply(const string &name, uint16_t qtype, dns_reply &result, string &raw)
+{
+	pmr::string reply{arena.resource()};
+	reply.reserve(16*1024);
 
-		if (req.size() < 450)
-			req += "X-Igno: " + string(450 - req.size(), 'X');
+	char tmp[4096];
 
-		req += "\r\n\r\n";
+	stats::query_timing &qt = d_inflight.qt;
+	const string &ns = d_inflight.ns;
+	const unsigned int up = d_inflight.up;
+	uint64_t t = 0;
 
-		//printf(">>>> %s\n", req.c_str());
+	string::size_type idx = string::npos, content_idx = string::npos;
+	size_t cl = 0;
+	const int maxtries = 3;
+	bool has_answer = 0;
 
-		// maybe closed due to error or not initialized in the first place
-		if (ssl->send(req) <= 0) {
-			if (ssl->connect(ns, cfg->second.port, req) < 0) {
-				ssl->close();
-				syslog(LOG_INFO, "No SSL connection to %s (%s)", ns.c_str(), ssl->why());
-				continue;
-			}
-			if (req.size() && ssl->send(req) != (int)req.size()) {
-				ssl->close();
-				syslog(LOG_INFO, "Unable to complete request to %s.", ns.c_str());
-				continue;
-			}
+	for (int j = 0; j < maxtries; ++j) {
+		ssize_t n = 0;
+		if ((n = ssl->recv(tmp, sizeof(tmp))) <= 0) {
+			ssl->close();
+			syslog(LOG_INFO, "Error when receiving reply from %s (%s)", ns.c_str(), ssl->why());
+			break;
 		}
+		reply.append(tmp, n);
 
-		string::size_type idx = string::npos, content_idx = string::npos;
-		size_t cl = 0;
-		const int maxtries = 3;
-		bool has_answer = 0;
+		if (j == 0) {
+			t = stats::now_us();
+			qt.stage_us[stats::STAGE_FIRST_BYTE] = t - d_inflight.sent;
+		}
 
-		for (int j = 0; j < maxtries; ++j) {
-			if (ssl->recv(tmp) <= 0) {
-				ssl->close();
-				syslog(LOG_INFO, "Error when receiving reply from %s (%s)", ns.c_str(), ssl->why());
-				break;
-			}
-			reply += tmp;
+		if (reply.find("HTTP/1.1 200 OK") == string::npos) {
+			ssl->close();
+			syslog(LOG_INFO, "Error response from %s.", ns.c_str());
+			break;
+		}
 
-			if (reply.find("HTTP/1.1 200 OK") == string::npos) {
+		if (reply.find("Transfer-Encoding: chunked\r\n") != string::npos && reply.find("\r\n0\r\n\r\n") != string::npos) {
+			has_answer = 1;
+			break;
+		}
+
+		if (cl == 0 && (idx = reply.find("Content-Length:")) != string::npos) {
+			idx += 15;
+			if (idx >= reply.size())
+				continue;
+
+			cl = strtoul(reply.c_str() + idx, nullptr, 10);
+			if (cl > 65535) {
 				ssl->close();
-				syslog(LOG_INFO, "Error response from %s.", ns.c_str());
+				syslog(LOG_INFO, "Insanely large reply from %s", ns.c_str());
 				break;
 			}
+		}
 
-			if (reply.find("Transfer-Encoding: chunked\r\n") != string::npos && reply.find("\r\n0\r\n\r\n") != string::npos) {
-				has_answer = 1;
-				break;
-			}
+		if (cl > 0 && (content_idx = reply.find("\r\n\r\n")) != string::npos) {
+			content_idx += 4;
+			if (content_idx <= reply.size() && reply.size() - content_idx < cl)
+				continue;
 
-			if (cl == 0 && (idx = reply.find("Content-Length:")) != string::npos) {
-				idx += 15;
-				if (idx >= reply.size())
-					continue;
+			has_answer = 1;
+			break;
+		}
+	}
 
-				cl = strtoul(reply.c_str() + idx, nullptr, 10);
-				if (cl > 65535) {
-					ssl->close();
-					syslog(LOG_INFO, "Insanely large reply from %s", ns.c_str());
-					break;
-				}
-			}
+	if (!has_answer) {
+		ssl->close();
+		stats::inc(up, stats::UP_ERRORS);
+		submit_timing(0);
+		return -2;
+	}
 
-			if (cl > 0 && (content_idx = reply.find("\r\n\r\n")) != string::npos) {
-				content_idx += 4;
-				if (content_idx <= reply.size() && reply.size() - content_idx < cl)
-					continue;
+	uint64_t received = stats::now_us();
+	qt.stage_us[stats::STAGE_HTTP] = received - t;
 
-				has_answer = 1;
-				break;
-			}
-		}
+	int r = 0;
+	if (d_inflight.rfc8484)
+		r = parse_rfc8484(name, qtype, result, raw, reply, content_idx, cl);
+	else
+		r = parse_json(name, qtype, result, raw, reply, content_idx, cl);
 
-		if (!has_answer)
-			ssl->close();
-		else {
-			int r = 0;
-			if (cfg->second.rfc8484)
-				r = parse_rfc8484(name, qtype, result, raw, reply, content_idx, cl);
-			else
-				r = parse_json(name, qtype, result, raw, reply, content_idx, cl);
+	qt.stage_us[stats::STAGE_PARSE] = stats::now_us() - received;
 
-			if (r >= 0)
-				return r;
+	if (r >= 0) {
+		stats::record_upstream(up, stats::now_us() - d_inflight.start);
+		submit_timing(1);
+		return r;
+	}
 
-			syslog(LOG_INFO, "Error when parsing reply from %s for %s: %s", ns.c_str(), name.c_str(), this->why());
-			ssl->close();
+	syslog(LOG_INFO, "Error when parsing reply from %s for %s: %s", ns.c_str(), name.c_str(), this->why());
+	stats::inc(up, stats::UP_ERRORS);
+	submit_timing(0);
+	ssl->close();
+	return -2;
+}
+
+
+int dnshttps::get(const string &name, uint16_t qtype, dns_reply &result, string &raw)
+{
+	// don't:
+	//result.clear();
+	raw = "";
+
+	if (!ssl || !config::ns)
+		return build_error("Not properly initialized.", -1);
+
+	if (!valid_name(name))
+		return build_error("Invalid FQDN", -1);
+
+	size_t nns = 0;
+	{
+		lock_guard<mutex> g(ns_mtx);
+		nns = config::ns->size();
+	}
+
+	for (unsigned int i = 0; i < nns; ++i) {
+		int r = send_request(name, qtype);
+		if (r < 0)
+			return r;
+		if (r == 0)
 			continue;
-		}
+		if ((r = recv_reply(name, qtype, result, raw)) != -2)
+			return r;
 	}
 
 	return 0;
 }
 
 
-int dnshttps::parse_rfc8484(const string &name, uint16_t type, dns_reply &result, string &raw, const string &reply, string::size_type content_idx, size_t cl)
+int dnshttps::begin_get(const string &name, uint16_t qtype)
 {
-	string dns_reply = "", tmp = "";
+	if (!ssl || !config::ns)
+		return build_error("Not properly initialized.", -1);
+
+	if (!valid_name(name))
+		return build_error("Invalid FQDN", -1);
+
+	return send_request(name, qtype);
+}
+
+
+int dnshttps::end_get(const string &name, uint16_t qtype, dns_reply &result, string &raw)
+{
+	raw = "";
+
+	int r = recv_reply(name, qtype, result, raw);
+	if (r != -2)
+		return r;
+	return get(name, qtype, result, raw);
+}
+
+
+int dnshttps::parse(const string &name, uint16_t qtype, const string &msg, dns_reply &result)
+{
+	string raw = "";
+
+	if (!valid_name(name))
+		return build_error("Invalid FQDN", -1);
+
+	arena.reset();
+	d_answered = 0;
+	pmr::string reply{msg, arena.resource()};
+	return parse_rfc8484(name, qtype, result, raw, reply, 0, reply.size());
+}
+
+
+int dnshttps::parse_rfc8484(const string &name, uint16_t type, dns_reply &result, string &raw, const pmr::string &reply, string::size_type content_idx, size_t cl)
+{
+	pmr::string dns_reply{arena.resource()};
+	string tmp = "";
 	string::size_type idx = string::npos, aidx = string::npos;
 	bool has_answer = 0;
 	unsigned int acnt = 0;
 
 	if (cl > 0 && content_idx != string::npos) {
-		dns_reply = reply.substr(content_idx);
+		dns_reply.assign(reply, content_idx, string::npos);
 		if (dns_reply.size() < cl)
 			return build_error("Incomplete read from rfc8484 server.", -1);
 	} else {
@@ -262,7 +434,7 @@ int dnshttps::parse_rfc8484(const string &name, uint16_t type, dns_reply &result
 			if (cl > 65535 || nl + 2 + cl + 2 > reply.size())
 				return build_error("Invalid reply (3).", -1);
 			idx = nl + 2;
-			dns_reply += reply.substr(idx, cl);
+			dns_reply.append(reply, idx, cl);
 			idx += cl + 2;
 		}
 	}
@@ -279,16 +451,23 @@ int dnshttps::parse_rfc8484(const string &name, uint16_t type, dns_reply &result
 	if (dhdr->qr != 1)
 		return build_error("Invalid DNS header. Not a reply.", -1);
 
+	// NXDOMAIN is an answer too
+	d_answered = (dhdr->rcode == 0 || dhdr->rcode == 3);
 	if (dhdr->rcode != 0)
 		return build_error("DNS error response from server.", 0);
 
-	string aname = "", cname = "", fqdn = "";
+	string aname = "", laname = "", cname = "", fqdn = "";
 	idx = sizeof(dnshdr);
 	int qnlen = qname2host(dns_reply, tmp, idx);
 	if (qnlen <= 0 || idx + qnlen + 2*sizeof(uint16_t) >= dns_reply.size())
 		return build_error("Invalid reply (5).", -1);
-	fqdn = lcs(tmp);
-	if (lcs(string(name + ".")) != fqdn)
+	lcs(tmp.c_str(), tmp.size(), &tmp[0]);
+	fqdn = tmp;
+
+	// get() made sure name is valid and not larger than 254
+	char lname[256];
+	lcs(name.c_str(), name.size(), lname);
+	if (fqdn.size() != name.size() + 1 || memcmp(fqdn.c_str(), lname, name.size()) != 0)
 		return build_error("Wrong name in awnser.", -1);
 
 	idx += qnlen + 2*sizeof(uint16_t);
@@ -307,7 +486,8 @@ int dnshttps::parse_rfc8484(const string &name, uint16_t type, dns_reply &result
 		// also handles compressed labels
 		if ((qnlen = qname2host(dns_reply, tmp, idx)) <= 0)
 			return build_error("Invalid reply (6).", -1);
-		aname = lcs(tmp);
+		lcs(tmp.c_str(), tmp.size(), &tmp[0]);
+		aname = tmp;
 
 		// 10 -> qtype, qclass, ttl, rdlen
 		if (idx + qnlen + 10 >= dns_reply.size())
@@ -328,7 +508,8 @@ int dnshttps::parse_rfc8484(const string &name, uint16_t type, dns_reply &result
 		if (qtype == htons(dns_type::CNAME)) {
 			if (qname2host(dns_reply, tmp, idx) <= 0)
 				return build_error("Invalid reply (9).", -1);
-			cname = lcs(tmp);
+			lcs(tmp.c_str(), tmp.size(), &tmp[0]);
+			cname = tmp;
 
 			if (fqdns.count(aname) > 0) {
 				fqdns[cname] = 1;
@@ -373,19 +554,23 @@ int dnshttps::parse_rfc8484(const string &name, uint16_t type, dns_reply &result
 		if (host2qname(aname, qname) <= 0)
 			return build_error("Invalid reply (13).", -1);
 
-		answer_t dns_ans{qname, qtype, qclass, ttl};
+		answer_t dns_ans{move(qname), qtype, qclass, ttl};
 
-		if (qtype == htons(dns_type::A) && fqdns.count(lcs(aname)) > 0) {
+		laname = aname;
+		lcs(laname.c_str(), laname.size(), &laname[0]);
+		bool is_fqdn = fqdns.count(laname) > 0;
+
+		if (qtype == htons(dns_type::A) && is_fqdn) {
 			if (rdlen != 4)
 				return build_error("Invalid reply.", -1);
-			dns_ans.rdata = dns_reply.substr(idx, 4);
-			result[acnt++] = dns_ans;
+			dns_ans.rdata.assign(dns_reply.c_str() + idx, 4);
+			result[acnt++] = move(dns_ans);
 			has_answer = 1;
-		} else if (qtype == htons(dns_type::AAAA) && fqdns.count(lcs(aname)) > 0) {
+		} else if (qtype == htons(dns_type::AAAA) && is_fqdn) {
 			if (rdlen != 16)
 				return build_error("Invalid reply (14).", -1);
-			dns_ans.rdata = dns_reply.substr(idx, 16);
-			result[acnt++] = dns_ans;
+			dns_ans.rdata.assign(dns_reply.c_str() + idx, 16);
+			result[acnt++] = move(dns_ans);
 			has_answer = 1;
 		} else if (qtype == htons(dns_type::CNAME)) {
 			string qcname = "";
@@ -394,16 +579,26 @@ int dnshttps::parse_rfc8484(const string &name, uint16_t type, dns_reply &result
 				return build_error("Invalid reply (15).", -1);
 			if (host2qname(cname, qcname) <= 0)
 				return build_error("Invalid reply (16).", -1);
-			dns_ans.rdata = qcname;
-			result[acnt++] = dns_ans;
+			dns_ans.rdata = move(qcname);
+			result[acnt++] = move(dns_ans);
+		} else if (qtype == htons(dns_type::PTR) && qtype == type && is_fqdn) {
+			string ptr = "", qptr = "";
+			// uncompress PTR answer
+			if (qname2host(dns_reply, ptr, idx) <= 0)
+				return build_error("Invalid reply (17).", -1);
+			if (host2qname(ptr, qptr) <= 0)
+				return build_error("Invalid reply (18).", -1);
+			dns_ans.rdata = move(qptr);
+			result[acnt++] = move(dns_ans);
+			has_answer = 1;
 		} else if (qtype == htons(dns_type::NS) && qtype == type) {
 			//XXX: handle decompression
-			dns_ans.rdata = dns_reply.substr(idx, rdlen);
-			result[acnt++] = dns_ans;
+			dns_ans.rdata.assign(dns_reply.c_str() + idx, rdlen);
+			result[acnt++] = move(dns_ans);
 			has_answer = 1;
 		} else if (qtype == htons(dns_type::MX) && qtype == type) {
-			dns_ans.rdata = dns_reply.substr(idx, rdlen);
-			result[acnt++] = dns_ans;
+			dns_ans.rdata.assign(dns_reply.c_str() + idx, rdlen);
+			result[acnt++] = move(dns_ans);
 			has_answer = 1;
 		}
 
@@ -414,16 +609,17 @@ int dnshttps::parse_rfc8484(const string &name, uint16_t type, dns_reply &result
 }
 
 
-int dnshttps::parse_json(const string &name, uint16_t type, dns_reply &result, string &raw, const string &reply, string::size_type content_idx, size_t cl)
+int dnshttps::parse_json(const string &name, uint16_t type, dns_reply &result, string &raw, const pmr::string &reply, string::size_type content_idx, size_t cl)
 {
 	bool has_answer = 0;
 
 	string::size_type idx = string::npos, idx2 = string::npos, aidx = string::npos;
-	string json = "", tmp = "";
+	pmr::string json{arena.resource()}, inner_json{arena.resource()}, cname{arena.resource()}, ans{arena.resource()};
+	string tmp = "";
 	unsigned int acnt = 0;
 
 	if (cl > 0 && content_idx != string::npos) {
-		json = reply.substr(content_idx);
+		json.assign(reply, content_idx, string::npos);
 		if (json.size() < cl)
 			return build_error("Incomplete read from json server.", -1);
 	} else {
@@ -445,13 +641,13 @@ int dnshttps::parse_json(const string &name, uint16_t type, dns_reply &result, s
 			if (cl > 65535 || nl + 2 + cl + 2 > reply.size())
 				return build_error("Invalid reply.", -1);
 			idx = nl + 2;
-			json += reply.substr(idx, cl);
+			json.append(reply, idx, cl);
 			idx += cl + 2;
 		}
 	}
 
-	raw = json;
-	json = lcs(raw);
+	raw.assign(json.c_str(), json.size());
+	lcs(json.c_str(), json.size(), &json[0]);
 
 	//printf(">>>> %s @ %s\n", name.c_str(), raw.c_str());
 
@@ -459,8 +655,11 @@ int dnshttps::parse_json(const string &name, uint16_t type, dns_reply &result, s
 	// Turns out, C++ data structures were not really made for JSON. Maybe CORBA...
 	json.erase(remove(json.begin(), json.end(), ' '), json.end());
 
-	if (json.find("\"status\":0") == string::npos)
+	if (json.find("\"status\":0") == string::npos) {
+		d_answered = (json.find("\"status\":3") != string::npos);
 		return 0;
+	}
+	d_answered = 1;
 	if ((idx = json.find("\"answer\":[")) == string::npos)
 		return 0;
 	idx += 10;
@@ -480,12 +679,14 @@ int dnshttps::parse_json(const string &name, uint16_t type, dns_reply &result, s
 		// and some add it -.-
 		// So check for both versions of the answer FQDN (looking for cname answers)
 
-		string cname = "\"name\":\"" + s;
+		cname = "\"name\":\"";
+		cname += s;
 		if (s[s.size() - 1] != '.')
 			cname += ".";
 		cname += "\",\"type\":5";
 		if ((idx = json.find(cname, aidx)) == string::npos) {
-			cname = "\"name\":\"" + s;
+			cname = "\"name\":\"";
+			cname += s;
 			if (cname[cname.size() - 1] == '.')
 				cname.erase(cname.size() - 1, 1);
 			cname += "\",\"type\":5";
@@ -501,7 +702,7 @@ int dnshttps::parse_json(const string &name, uint16_t type, dns_reply &result, s
 
 		// guaranteed that { comes before }
 
-		string inner_json = json.substr(brace_open, brace_close - brace_open + 1);
+		inner_json.assign(json, brace_open, brace_close - brace_open + 1);
 
 		uint32_t ttl = 0;
 		if ((idx = inner_json.find("\"ttl\":")) == string::npos)
@@ -514,7 +715,7 @@ int dnshttps::parse_json(const string &name, uint16_t type, dns_reply &result, s
 		idx += 8;
 		if ((idx2 = inner_json.find("\"", idx)) == string::npos)
 			break;
-		tmp = inner_json.substr(idx, idx2 - idx);
+		tmp.assign(inner_json.c_str() + idx, idx2 - idx);
 		if (!valid_name(tmp))
 			return build_error("Invalid DNS name.", -1);
 
@@ -527,7 +728,7 @@ int dnshttps::parse_json(const string &name, uint16_t type, dns_reply &result, s
 		if (host2qname(tmp, cqname) <= 0)
 			break;
 
-		result[acnt++] = {qname, htons(dns_type::CNAME), htons(1), htonl(ttl), cqname};
+		result[acnt++] = {move(qname), htons(dns_type::CNAME), htons(1), htonl(ttl), move(cqname)};
 
 		// for NSS module, to have fqdn alias w/o decoding avail
 		result[acnt++] = {"NSS CNAME", 0, 0, ttl, tmp};
@@ -556,13 +757,15 @@ int dnshttps::parse_json(const string &name, uint16_t type, dns_reply &result, s
 			// and some add it -.-
 			// So check for both versions of the answer FQDN
 
-			string ans = "\"name\":\"" + it->first;
+			ans = "\"name\":\"";
+			ans += it->first;
 			if ((it->first)[it->first.size() - 1] != '.')
 				ans += ".";
 			ans += "\",\"type\":";
 			if ((idx = json.find(ans, aidx)) == string::npos) {
 
-				ans = "\"name\":\"" + it->first;
+				ans = "\"name\":\"";
+				ans += it->first;
 				if (ans[ans.size() - 1] == '.')
 					ans.erase(ans.size() - 1, 1);
 				ans += "\",\"type\":";
@@ -582,7 +785,7 @@ int dnshttps::parse_json(const string &name, uint16_t type, dns_reply &result, s
 
 			// guaranteed that { comes before }
 
-			string inner_json = json.substr(brace_open, brace_close - brace_open + 1);
+			inner_json.assign(json, brace_open, brace_close - brace_open + 1);
 
 			uint32_t ttl = 0;
 			if ((idx = inner_json.find("\"ttl\":")) == string::npos)
@@ -595,24 +798,24 @@ int dnshttps::parse_json(const string &name, uint16_t type, dns_reply &result, s
 			idx += 8;
 			if ((idx2 = inner_json.find("\"", idx)) == string::npos)
 				break;
-			tmp = inner_json.substr(idx, idx2 - idx);
+			tmp.assign(inner_json.c_str() + idx, idx2 - idx);
 
 			string qname = "";
 			if (host2qname(it->first, qname) <= 0)
 				break;
 
-			answer_t dns_ans{qname, htons(atype), htons(1), htonl(ttl)};
+			answer_t dns_ans{move(qname), htons(atype), htons(1), htonl(ttl)};
 
 			if (atype == dns_type::A) {
 				if (inet_pton(AF_INET, tmp.c_str(), data) == 1) {
-					dns_ans.rdata = string(data, 4);
-					result[acnt++] = dns_ans;
+					dns_ans.rdata.assign(data, 4);
+					result[acnt++] = move(dns_ans);
 					has_answer = 1;
 				}
 			} else if (atype == dns_type::AAAA) {
 				if (inet_pton(AF_INET6, tmp.c_str(), data) == 1) {
-					dns_ans.rdata = string(data, 16);
-					result[acnt++] = dns_ans;
+					dns_ans.rdata.assign(data, 16);
+					result[acnt++] = move(dns_ans);
 					has_answer = 1;
 				}
 			} else if (atype == dns_type::NS) {
@@ -624,8 +827,20 @@ int dnshttps::parse_json(const string &name, uint16_t type, dns_reply &result, s
 
 				if (host2qname(tmp, qname) <= 0)
 					break;
-				dns_ans.rdata = qname;
-				result[acnt++] = dns_ans;
+				dns_ans.rdata = move(qname);
+				result[acnt++] = move(dns_ans);
+				has_answer = 1;
+			} else if (atype == dns_type::PTR) {
+				if (!valid_name(tmp))
+					return build_error("Invalid DNS name.", -1);
+
+				if (tmp[tmp.size() - 1] == '.')
+					tmp.erase(tmp.size() - 1, 1);
+
+				if (host2qname(tmp, qname) <= 0)
+					break;
+				dns_ans.rdata = move(qname);
+				result[acnt++] = move(dns_ans);
 				has_answer = 1;
 			} else if (type == dns_type::MX) {
 			}
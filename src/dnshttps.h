@@ -24,7 +24,10 @@
 #include <stdint.h>
 #include <string>
 #include <map>
+#include <memory_resource>
 #include "ssl.h"
+#include "arena.h"
+#include "stats.h"
 
 
 namespace harddns {
@@ -35,6 +38,18 @@ class dnshttps {
 
 	ssl_box *ssl;
 
+	// holds all temporary strings of a single get()
+	query_arena<64*1024> arena;
+
+	// the request that send_request() sent, until recv_reply()
+	struct inflight {
+		std::string ns{""};
+		unsigned int up{0};
+		bool rfc8484{0};
+		uint64_t start{0}, sent{0};
+		stats::query_timing qt;
+	} d_inflight;
+
 	template<class T>
 	T build_error(const std::string &msg, T r)
 	{
@@ -68,9 +83,25 @@ public:
 
 private:
 
-	int parse_rfc8484(const std::string &, uint16_t, dns_reply &, std::string &, const std::string &, std::string::size_type, size_t);
+	int parse_rfc8484(const std::string &, uint16_t, dns_reply &, std::string &, const std::pmr::string &, std::string::size_type, size_t);
+
+	int parse_json(const std::string &, uint16_t, dns_reply &, std::string &, const std::pmr::string &, std::string::size_type, size_t);
+
+	// Sends the question to the upstream of the connection, or to the
+	// next one. 1 if it was sent, 0 if that upstream failed, -1 if no
+	// upstream would do.
+	int send_request(const std::string &, uint16_t);
+
+	// The reply to what send_request() sent, as get() returns it, or -2
+	// if that upstream failed
+	int recv_reply(const std::string &, uint16_t, dns_reply &, std::string &);
+
+	void submit_timing(bool ok);
+
+	bool d_answered{0};
 
-	int parse_json(const std::string &, uint16_t, dns_reply &, std::string &, const std::string &, std::string::size_type, size_t);
+	// for the microbenchmarks
+	friend class bench_access;
 
 
 
@@ -93,6 +124,27 @@ public:
 
 	int get(const std::string &, uint16_t, dns_reply &, std::string &);
 
+	// Whether the last get() or parse() had an answer or NXDOMAIN from a
+	// server. get() returns 0 as well if all upstreams failed or one sent
+	// an error such as SERVFAIL, which must not be cached as "no such name".
+	bool answered()
+	{
+		return d_answered;
+	}
+
+	// get() in two halves, so that a single thread has requests to several
+	// connections in flight at the same time. begin_get() returns 1 if the
+	// question was sent, and end_get() has to follow then before anything
+	// else is asked. end_get() goes on with the other upstreams if that one
+	// fails, as get() does.
+	int begin_get(const std::string &, uint16_t);
+
+	int end_get(const std::string &, uint16_t, dns_reply &, std::string &);
+
+	// parses a DNS answer to a question for name like get() does, e.g. one
+	// that harddnsd sent to the NSS module
+	int parse(const std::string &, uint16_t, const std::string &, dns_reply &);
+
 };
 
 
@@ -0,0 +1,594 @@
+/*
+ * This file is part of harddns.
+ *
+ * (C) 2023 by Sebastian Krahmer,
+ *             sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * harddns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * harddns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with harddns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <cctype>
+#include <cstdlib>
+#include <syslog.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include "forward.h"
+#include "config.h"
+#include "stats.h"
+#include "qlog.h"
+#include "misc.h"
+#include "net-headers.h"
+
+extern "C" {
+#include <openssl/rand.h>
+}
+
+
+namespace harddns {
+
+using namespace std;
+using namespace net_headers;
+
+
+// query IDs and source ports must not be guessable by spoofers
+static uint16_t rand16()
+{
+	static uint16_t pool[256];
+	static unsigned int idx = sizeof(pool)/sizeof(pool[0]);
+
+	if (idx == sizeof(pool)/sizeof(pool[0])) {
+		if (RAND_bytes(reinterpret_cast<unsigned char *>(pool), sizeof(pool)) != 1) {
+			for (auto &r : pool)
+				r = random();
+		}
+		idx = 0;
+	}
+	return pool[idx++];
+}
+
+
+uint64_t forwarder::now_tick()
+{
+	return stats::now_us()/(1000*TICK_MS);
+}
+
+
+forwarder::~forwarder()
+{
+	for (auto &s : d_socks) {
+		if (s.fd >= 0)
+			::close(s.fd);
+	}
+	for (auto &t : d_tcp)
+		::close(t.first);
+}
+
+
+int forwarder::init(int lsock, const map<string, string> &domains, int nss_sock)
+{
+	d_lsock = lsock;
+	d_usock = nss_sock;
+	d_timeout_ticks = config::forward_timeout_ms/TICK_MS;
+	if (d_timeout_ticks == 0)
+		d_timeout_ticks = 1;
+	d_retries = config::forward_retries;
+
+	map<string, unsigned int> by_ns;
+
+	for (const auto &d : domains) {
+		bool cache = config::internal_nocache.count(d.first) == 0;
+
+		// "Company.LAN." and ".company.lan" are the zone "company.lan"
+		string name = lcs(d.first);
+		while (name.size() && name.back() == '.')
+			name.pop_back();
+		while (name.size() && name[0] == '.')
+			name.erase(0, 1);
+		if (name.empty() || d_zone_names.count(name) > 0)
+			continue;
+		string_view zname = *d_zone_names.insert(name).first;
+
+		auto it = by_ns.find(d.second);
+		if (it != by_ns.end()) {
+			d_zones[zname] = {it->second, cache};
+			continue;
+		}
+
+		// "192.168.0.1" or "192.168.0.1#5353"
+		string host = d.second, port = "53";
+		string::size_type hash = host.find("#");
+		if (hash != string::npos) {
+			port = host.substr(hash + 1);
+			host.erase(hash);
+		}
+
+		addrinfo *tai = nullptr, hints;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_socktype = SOCK_DGRAM;
+		hints.ai_flags = AI_NUMERICHOST|AI_NUMERICSERV;
+		if (getaddrinfo(host.c_str(), port.c_str(), &hints, &tai) != 0)
+			return build_error("init: Unable to resolve forwarding address " + d.second, -1);
+		free_ptr<addrinfo> ai(tai, freeaddrinfo);
+
+		target t;
+		t.ns = d.second;
+		memset(&t.addr, 0, sizeof(t.addr));
+		memcpy(&t.addr, ai->ai_addr, ai->ai_addrlen);
+		t.alen = ai->ai_addrlen;
+
+		unsigned int tidx = d_targets.size();
+		d_targets.push_back(t);
+		by_ns[d.second] = tidx;
+		d_zones[zname] = {tidx, cache};
+
+		for (unsigned int i = 0; i < SOCKS_PER_TARGET; ++i) {
+			d_socks.push_back(usock());
+			d_socks.back().target = tidx;
+			if (open_sock(d_socks.size() - 1) < 0)
+				return -1;
+		}
+	}
+
+	d_tick = now_tick();
+	return 0;
+}
+
+
+// (Re)opens a UDP socket to the target, bound to a random port
+int forwarder::open_sock(unsigned int idx)
+{
+	usock &s = d_socks[idx];
+	const target &t = d_targets[s.target];
+
+	if (s.fd >= 0)
+		::close(s.fd);
+	s.fd = -1;
+	s.uses = 0;
+
+	int fd = socket(t.addr.ss_family, SOCK_DGRAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return build_error("open_sock::socket:", -1);
+
+	sockaddr_storage local;
+	memset(&local, 0, sizeof(local));
+	local.ss_family = t.addr.ss_family;
+
+	// if all tries hit a used port, connect() binds an ephemeral one
+	for (int i = 0; i < 16; ++i) {
+		uint16_t port = htons(1024 + rand16() % (0x10000 - 1024));
+		if (local.ss_family == AF_INET)
+			reinterpret_cast<sockaddr_in *>(&local)->sin_port = port;
+		else
+			reinterpret_cast<sockaddr_in6 *>(&local)->sin6_port = port;
+		if (::bind(fd, reinterpret_cast<sockaddr *>(&local), t.alen) == 0)
+			break;
+	}
+
+	// connected, so the kernel drops datagrams from anyone else
+	if (::connect(fd, reinterpret_cast<const sockaddr *>(&t.addr), t.alen) < 0) {
+		::close(fd);
+		return build_error("open_sock::connect:", -1);
+	}
+
+	s.fd = fd;
+	return 0;
+}
+
+
+// One hash lookup per label, starting with the full name, so the longest
+// zone wins and "ample.com" does not match "example.com".
+int forwarder::target_of(const string &fqdn, bool &cache)
+{
+	string_view name = fqdn;
+
+	for (;;) {
+		auto it = d_zones.find(name);
+		if (it != d_zones.end()) {
+			cache = it->second.cache;
+			return it->second.target;
+		}
+
+		string_view::size_type dot = name.find('.');
+		if (dot == string_view::npos)
+			break;
+		name.remove_prefix(dot + 1);
+	}
+
+	return -1;
+}
+
+
+void forwarder::arm(uint32_t key, pending &p)
+{
+	p.gen = ++d_gen;
+	p.deadline = now_tick() + d_timeout_ticks;
+	d_wheel[p.deadline % WHEEL_SLOTS].push_back({key, p.gen});
+}
+
+
+// The UDP payload size from the OPT record of a query, 512 without one
+static uint16_t edns_size(const char *buf, size_t len, size_t qend)
+{
+	const dnshdr *hdr = reinterpret_cast<const dnshdr *>(buf);
+	unsigned int nrr = ntohs(hdr->a_count) + ntohs(hdr->rra_count) + ntohs(hdr->ad_count);
+	size_t idx = qend;
+
+	for (unsigned int i = 0; i < nrr; ++i) {
+		// skip the owner name, which may end in a compression pointer
+		while (idx < len && buf[idx] != 0 && (buf[idx] & 0xc0) != 0xc0)
+			idx += (unsigned char)buf[idx] + 1;
+		idx += (idx < len && buf[idx] != 0) ? 2 : 1;
+		if (idx + 10 > len)
+			break;
+
+		uint16_t type = 0, cls = 0, rdlen = 0;
+		memcpy(&type, buf + idx, sizeof(type));
+		memcpy(&cls, buf + idx + 2, sizeof(cls));
+		memcpy(&rdlen, buf + idx + 8, sizeof(rdlen));
+		if (ntohs(type) == 41)
+			return max<uint16_t>(512, ntohs(cls));
+		idx += 10 + ntohs(rdlen);
+	}
+
+	return 512;
+}
+
+
+int forwarder::query(unsigned int tidx, const sockaddr *client, socklen_t clen, const char *buf, size_t len, size_t qend, uint64_t qtime_ns, bool cache)
+{
+	if (tidx >= d_targets.size())
+		return build_error("query: Invalid target.", -1);
+	if (len < sizeof(dnshdr) || qend > len || clen > sizeof(sockaddr_storage))
+		return build_error("query: Invalid query.", -1);
+	if (d_pending.size() >= MAX_PENDING)
+		return build_error("query: Too many pending queries to " + d_targets[tidx].ns, -1);
+
+	unsigned int idx = tidx*SOCKS_PER_TARGET + rand16() % SOCKS_PER_TARGET;
+	usock &s = d_socks[idx];
+	if (s.fd < 0 && open_sock(idx) < 0)
+		return -1;
+
+	uint16_t id = 0;
+	uint32_t key = 0;
+	do {
+		id = rand16();
+		key = idx<<16|id;
+	} while (d_pending.count(key) > 0);
+
+	pending &p = d_pending[key];
+	memcpy(&p.client, client, clen);
+	p.clen = clen;
+	p.orig_id = reinterpret_cast<const dnshdr *>(buf)->id;
+	p.query.assign(buf, len);
+	memcpy(&p.query[0], &id, sizeof(id));
+	p.qend = qend;
+	p.udp_size = edns_size(buf, len, qend);
+	p.qtime_ns = qtime_ns;
+	p.start_us = stats::now_us();
+	p.tries = 1;
+	p.cache = cache;
+
+	++s.uses;
+	++s.pending;
+
+	// a failed send is handled like a lost answer, by the retries
+	::send(s.fd, p.query.c_str(), p.query.size(), 0);
+
+	arm(key, p);
+	return 0;
+}
+
+
+// same question as sent, qname case insensitive
+static bool same_question(const string &query, size_t qend, const char *buf, size_t len)
+{
+	if (len < qend)
+		return 0;
+	for (size_t i = sizeof(dnshdr); i < qend - 2*sizeof(uint16_t); ++i) {
+		if (tolower((unsigned char)buf[i]) != tolower((unsigned char)query[i]))
+			return 0;
+	}
+	return memcmp(buf + qend - 2*sizeof(uint16_t), query.c_str() + qend - 2*sizeof(uint16_t), 2*sizeof(uint16_t)) == 0;
+}
+
+
+void forwarder::release(uint32_t key, pending &p)
+{
+	if (p.tcp_fd >= 0) {
+		d_tcp.erase(p.tcp_fd);
+		::close(p.tcp_fd);
+	}
+
+	unsigned int idx = key>>16;
+	d_pending.erase(key);
+
+	// new random port once the old one was used for a while
+	usock &s = d_socks[idx];
+	if (--s.pending == 0 && s.uses >= ROTATE_AFTER && open_sock(idx) < 0)
+		syslog(LOG_INFO, "%s", why());
+}
+
+
+// sends the answer to the client and finishes p
+void forwarder::answer(uint32_t key, pending &p, char *buf, size_t len)
+{
+	dnshdr *hdr = reinterpret_cast<dnshdr *>(buf);
+	hdr->id = p.orig_id;
+
+	int sock = p.client.ss_family == AF_UNIX ? d_usock : d_lsock;
+
+	// An answer that was fetched via TCP may be larger than the UDP client
+	// takes. It gets the question with TC set then, to ask via TCP itself.
+	// The NSS modules on nss_socket take any size.
+	string tc = "";
+	const char *out = buf;
+	size_t olen = len;
+	if (len > p.udp_size && p.client.ss_family != AF_UNIX) {
+		tc.assign(buf, sizeof(dnshdr));
+		tc.append(p.query, sizeof(dnshdr), p.qend - sizeof(dnshdr));
+		dnshdr *thdr = reinterpret_cast<dnshdr *>(&tc[0]);
+		thdr->tc = 1;
+		thdr->q_count = htons(1);
+		thdr->a_count = thdr->rra_count = thdr->ad_count = 0;
+		out = tc.c_str();
+		olen = tc.size();
+	}
+	::sendto(sock, out, olen, 0, reinterpret_cast<const sockaddr *>(&p.client), p.clen);
+
+	stats::inc_rcode(hdr->rcode);
+	stats::record(stats::SRC_FORWARD, stats::now_us() - p.start_us);
+
+	if (qlog::enabled()) {
+		memcpy(&p.query[0], &p.orig_id, sizeof(p.orig_id));
+		qlog::log(qlog::CLIENT_RESPONSE, reinterpret_cast<const sockaddr *>(&p.client), p.qtime_ns,
+		          p.query.c_str(), p.query.size(), out, olen, "forward");
+	}
+
+	// The hook gets the full answer, not the TC stub a small UDP client
+	// may have gotten. It skips SERVFAILs and truncated answers itself.
+	if (p.cache && d_cache_hook)
+		d_cache_hook(buf, len);
+
+	release(key, p);
+}
+
+
+void forwarder::servfail(uint32_t key, pending &p)
+{
+	string reply = p.query.substr(0, p.qend);
+	dnshdr *hdr = reinterpret_cast<dnshdr *>(&reply[0]);
+	hdr->qr = 1;
+	hdr->ra = 1;
+	hdr->tc = 0;
+	hdr->rcode = 2;
+	hdr->q_count = htons(1);
+	hdr->a_count = hdr->rra_count = hdr->ad_count = 0;
+
+	answer(key, p, &reply[0], reply.size());
+}
+
+
+void forwarder::timeout(uint32_t key, pending &p)
+{
+	if (p.tcp_fd < 0 && p.tries <= d_retries) {
+		++p.tries;
+		::send(d_socks[key>>16].fd, p.query.c_str(), p.query.size(), 0);
+		stats::inc(stats::FWD_RETRIES);
+		arm(key, p);
+		return;
+	}
+
+	stats::inc(stats::FWD_TIMEOUTS);
+	servfail(key, p);
+}
+
+
+int forwarder::start_tcp(uint32_t key, pending &p)
+{
+	const target &t = d_targets[d_socks[key>>16].target];
+
+	int fd = socket(t.addr.ss_family, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	if (::connect(fd, reinterpret_cast<const sockaddr *>(&t.addr), t.alen) < 0 && errno != EINPROGRESS) {
+		::close(fd);
+		return -1;
+	}
+
+	uint16_t l = htons(p.query.size());
+	p.tcp_buf.assign(reinterpret_cast<char *>(&l), sizeof(l));
+	p.tcp_buf += p.query;
+	p.tcp_off = 0;
+	p.tcp_fd = fd;
+	d_tcp[fd] = key;
+
+	// the TCP round trip gets a full timeout of its own
+	arm(key, p);
+	return 0;
+}
+
+
+void forwarder::handle_udp(unsigned int idx)
+{
+	char buf[0x10000];
+
+	for (;;) {
+		ssize_t r = ::recv(d_socks[idx].fd, buf, sizeof(buf), 0);
+
+		// EAGAIN, or ECONNREFUSED from an ICMP error, which is left to the retries
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if ((size_t)r < sizeof(dnshdr))
+			continue;
+
+		const dnshdr *hdr = reinterpret_cast<const dnshdr *>(buf);
+		if (hdr->qr != 1)
+			continue;
+
+		uint32_t key = idx<<16|hdr->id;
+		auto it = d_pending.find(key);
+		if (it == d_pending.end())
+			continue;
+		pending &p = it->second;
+
+		// late UDP answer while TCP is already underway, or spoofed
+		if (p.tcp_fd >= 0 || !same_question(p.query, p.qend, buf, r))
+			continue;
+
+		if (hdr->tc) {
+			if (start_tcp(key, p) == 0) {
+				stats::inc(stats::FWD_TCP);
+				continue;
+			}
+			// else pass on the truncated answer, as before
+		}
+
+		answer(key, p, buf, r);
+	}
+}
+
+
+void forwarder::handle_tcp(int fd, short revents)
+{
+	auto it = d_tcp.find(fd);
+	if (it == d_tcp.end())
+		return;
+	uint32_t key = it->second;
+	auto pit = d_pending.find(key);
+	if (pit == d_pending.end())
+		return;
+	pending &p = pit->second;
+
+	// still sending the length prefixed query?
+	if (p.tcp_off < p.tcp_buf.size()) {
+		ssize_t n = ::send(fd, p.tcp_buf.c_str() + p.tcp_off, p.tcp_buf.size() - p.tcp_off, MSG_NOSIGNAL);
+		if (n < 0 && (errno == EAGAIN || errno == EINTR || errno == EINPROGRESS))
+			return;
+		if (n <= 0)
+			return servfail(key, p);
+		p.tcp_off += n;
+		if (p.tcp_off == p.tcp_buf.size()) {
+			p.tcp_buf.clear();
+			p.tcp_off = ~(size_t)0;
+		}
+		return;
+	}
+
+	char buf[0x4000];
+	ssize_t n = ::recv(fd, buf, sizeof(buf), 0);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (n <= 0)
+		return servfail(key, p);
+
+	p.tcp_buf.append(buf, n);
+	if (p.tcp_buf.size() < sizeof(uint16_t))
+		return;
+	size_t len = ntohs(*reinterpret_cast<const uint16_t *>(p.tcp_buf.c_str()));
+	if (p.tcp_buf.size() < len + sizeof(uint16_t))
+		return;
+
+	string ans = p.tcp_buf.substr(sizeof(uint16_t), len);
+	const dnshdr *hdr = reinterpret_cast<const dnshdr *>(ans.c_str());
+	if (len < sizeof(dnshdr) || hdr->qr != 1 || hdr->id != (key & 0xffff) || !same_question(p.query, p.qend, ans.c_str(), len))
+		return servfail(key, p);
+
+	answer(key, p, &ans[0], len);
+}
+
+
+size_t forwarder::pollfds(vector<pollfd> &pfds)
+{
+	size_t n = pfds.size();
+
+	// all UDP sockets in order, so the index tells the socket
+	for (const auto &s : d_socks)
+		pfds.push_back({s.fd, POLLIN, 0});
+
+	for (const auto &t : d_tcp) {
+		const pending &p = d_pending.at(t.second);
+		pfds.push_back({t.first, static_cast<short>(p.tcp_off < p.tcp_buf.size() ? POLLOUT : POLLIN), 0});
+	}
+
+	return pfds.size() - n;
+}
+
+
+void forwarder::handle(const pollfd *pfds, size_t n)
+{
+	for (size_t i = 0; i < n; ++i) {
+		if (pfds[i].revents == 0)
+			continue;
+		if (i < d_socks.size())
+			handle_udp(i);
+		else
+			handle_tcp(pfds[i].fd, pfds[i].revents);
+	}
+}
+
+
+void forwarder::expire()
+{
+	uint64_t now = now_tick();
+
+	// after a long blocking DoH request every slot is due once
+	if (now > d_tick + WHEEL_SLOTS)
+		d_tick = now - WHEEL_SLOTS;
+
+	vector<wheel_entry> due;
+	for (; d_tick <= now; ++d_tick) {
+		auto &slot = d_wheel[d_tick % WHEEL_SLOTS];
+		if (slot.empty())
+			continue;
+		due.swap(slot);
+		for (const auto &e : due) {
+			auto it = d_pending.find(e.key);
+
+			// answered or re-armed meanwhile
+			if (it == d_pending.end() || it->second.gen != e.gen)
+				continue;
+
+			// timeouts beyond the wheel size take more than one round
+			if (it->second.deadline > d_tick) {
+				slot.push_back(e);
+				continue;
+			}
+			timeout(e.key, it->second);
+		}
+		due.clear();
+	}
+}
+
+
+int forwarder::poll_timeout()
+{
+	return d_pending.empty() ? -1 : TICK_MS;
+}
+
+
+}
+
@@ -0,0 +1,209 @@
+/*
+ * This file is part of harddns.
+ *
+ * (C) 2023 by Sebastian Krahmer,
+ *             sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * harddns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * harddns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with harddns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef harddns_forward_h
+#define harddns_forward_h
+
+#include <map>
+#include <set>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cerrno>
+#include <cstring>
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+#include <poll.h>
+#include <sys/socket.h>
+
+
+namespace harddns {
+
+
+// Forwards the queries of internal_domain's to plain DNS servers. Each target
+// has a few UDP sockets of its own, connected to it and bound to random ports.
+// The query ID is rewritten to a random one, so answers are matched by
+// socket, ID and question, and lost answers are retried and finally
+// answered with SERVFAIL by a timer wheel. Truncated answers are fetched
+// again via TCP.
+class forwarder {
+
+	enum {
+		SOCKS_PER_TARGET = 4,
+		ROTATE_AFTER = 1024,	// queries before a socket gets a new port
+		MAX_PENDING = 16384,
+		WHEEL_SLOTS = 512,
+		TICK_MS = 10
+	};
+
+	struct target {
+		std::string ns;			// as configured
+		sockaddr_storage addr;
+		socklen_t alen{0};
+	};
+
+	struct usock {
+		int fd{-1};
+		unsigned int target{0}, uses{0}, pending{0};
+	};
+
+	struct pending {
+		sockaddr_storage client;
+		socklen_t clen{0};
+		uint16_t orig_id{0};
+		std::string query;		// with the rewritten ID
+		size_t qend{0};			// end of the question section
+		uint16_t udp_size{512};		// the client takes, per its EDNS0 OPT
+		uint64_t qtime_ns{0}, start_us{0}, deadline{0};
+		uint32_t gen{0};
+		unsigned int tries{0};
+		int tcp_fd{-1};
+		bool cache{0};
+		std::string tcp_buf;		// length prefixed query, then the answer
+		size_t tcp_off{0};		// sent of the query, ~0 when reading
+	};
+
+	// listening sockets of the proxy, answers go out there. d_usock
+	// is the nss_socket, for clients with an AF_UNIX address.
+	int d_lsock{-1}, d_usock{-1};
+
+	struct zone {
+		unsigned int target;
+		bool cache;
+	};
+
+	// lowercased zone name -> target and whether its answers may be cached.
+	// The keys point into d_zone_names.
+	std::unordered_map<std::string_view, zone> d_zones;
+
+	std::set<std::string> d_zone_names;
+
+	std::vector<target> d_targets;
+
+	std::vector<usock> d_socks;
+
+	// (socket index << 16 | rewritten ID) -> pending query
+	std::unordered_map<uint32_t, pending> d_pending;
+
+	// TCP fd -> key of d_pending
+	std::unordered_map<int, uint32_t> d_tcp;
+
+	struct wheel_entry {
+		uint32_t key, gen;
+	};
+
+	std::vector<wheel_entry> d_wheel[WHEEL_SLOTS];
+
+	uint64_t d_tick{0};
+
+	uint32_t d_gen{0};
+
+	unsigned int d_timeout_ticks{100}, d_retries{2};
+
+	// gets the answers of cacheable zones, as sent to the client
+	std::function<void(const char *, size_t)> d_cache_hook;
+
+	std::string d_err{""};
+
+	template<class T>
+	T build_error(const std::string &msg, T r)
+	{
+		d_err = "forwarder::";
+		d_err += msg;
+		if (errno) {
+			d_err += ":";
+			d_err += strerror(errno);
+		}
+		return r;
+	}
+
+	int open_sock(unsigned int idx);
+
+	void arm(uint32_t key, pending &p);
+
+	void answer(uint32_t key, pending &p, char *buf, size_t len);
+
+	void servfail(uint32_t key, pending &p);
+
+	void release(uint32_t key, pending &p);
+
+	int start_tcp(uint32_t key, pending &p);
+
+	void handle_udp(unsigned int idx);
+
+	void handle_tcp(int fd, short revents);
+
+	void timeout(uint32_t key, pending &p);
+
+	static uint64_t now_tick();
+
+public:
+
+	forwarder()
+	{
+	}
+
+	virtual ~forwarder();
+
+	int init(int lsock, const std::map<std::string, std::string> &domains, int nss_sock = -1);
+
+	void cache_hook(const std::function<void(const char *, size_t)> &f)
+	{
+		d_cache_hook = f;
+	}
+
+	bool active()
+	{
+		return !d_targets.empty();
+	}
+
+	// target index of the longest zone that fqdn is in or below,
+	// or -1 if it's not an internal domain. fqdn must be lowercase.
+	int target_of(const std::string &fqdn, bool &cache);
+
+	int query(unsigned int target, const sockaddr *client, socklen_t clen, const char *buf, size_t len, size_t qend, uint64_t qtime_ns, bool cache);
+
+	// whether answers are still outstanding
+	bool idle()
+	{
+		return d_pending.empty();
+	}
+
+	// appends the fds to poll for, returns how many
+	size_t pollfds(std::vector<pollfd> &);
+
+	// handles the ready fds of the pollfds() part of the set
+	void handle(const pollfd *pfds, size_t n);
+
+	// runs the timer wheel up to now
+	void expire();
+
+	// poll() timeout until the next tick, -1 if nothing is pending
+	int poll_timeout();
+
+	const char *why() { return d_err.c_str(); }
+};
+
+
+}
+
+#endif
+
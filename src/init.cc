@@ -25,6 +25,9 @@
 #include "config.h"
 #include "ssl.h"
 #include "dnshttps.h"
+#include "blocklist.h"
+#include "snapshot.h"
+#include "stats.h"
 
 extern "C" {
 #include <openssl/evp.h>
@@ -66,10 +69,14 @@ static int load_certificates()
 }
 
 
-void harddns_init(const string &cfg_base)
+void harddns_init(const string &cfg_base, bool use_snapshot)
 {
+	harddns::snapshot::trust trust;
+	string err = "";
 
-	harddns::config::parse_config(cfg_base);
+	bool snap = use_snapshot && harddns::snapshot::load(cfg_base + "/harddns.snap", cfg_base, trust, err) == 0;
+	if (!snap)
+		harddns::config::parse_config(cfg_base);
 
 	SSL_library_init();
 	SSL_load_error_strings();
@@ -80,13 +87,24 @@ void harddns_init(const string &cfg_base)
 	if (!(harddns::ssl_conn = new (nothrow) harddns::ssl_box))
 		return;
 
-	harddns::ssl_conn->setup_ctx();
-
-	load_certificates();
+	if (snap) {
+		harddns::ssl_conn->setup_ctx(trust.default_store ? nullptr : &trust.anchors);
+		for (const auto &sha256 : trust.pins)
+			harddns::ssl_conn->add_pin(sha256);
+	} else {
+		harddns::ssl_conn->setup_ctx();
+		load_certificates();
+	}
 
 	harddns::dns = new (nothrow) harddns::dnshttps(harddns::ssl_conn);
 
 	openlog("harddns", LOG_NDELAY|LOG_PID, LOG_DAEMON);
+
+	if (harddns::config::blocklist) {
+		if (harddns::blocklist::load(*harddns::config::blocklist, err) < 0)
+			syslog(LOG_INFO, "%s", err.c_str());
+		harddns::stats::set(harddns::stats::BLOCKLIST_ENTRIES, harddns::blocklist::size());
+	}
 }
 
 
@@ -97,6 +115,12 @@ void harddns_fini()
 
 	delete harddns::config::ns;
 	delete harddns::config::ns_cfg;
+	delete harddns::config::cafile;
+	delete harddns::config::stats_socket;
+	delete harddns::config::qlog;
+	delete harddns::config::blocklist;
+	delete harddns::config::nss_socket;
+	delete harddns::config::shared_cache;
 
 	closelog();
 }
@@ -3,10 +3,15 @@
 
 #include <string>
 
-extern void harddns_init(const std::string &);
+// With use_snapshot, the config and trust anchors are taken from
+// harddns.snap if it is up to date
+extern void harddns_init(const std::string &, bool use_snapshot = false);
 
 extern void harddns_fini();
 
+// harddns_init() for the NSS module, once on its first lookup
+extern void harddns_nss_init();
+
 #endif
 
 
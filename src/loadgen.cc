@@ -0,0 +1,405 @@
+/*
+ * This file is part of harddns.
+ *
+ * (C) 2023 by Sebastian Krahmer,
+ *             sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * harddns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * harddns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with harddns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// harddns-bench: UDP load generator to measure harddnsd throughput and latency
+
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cstdint>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <deque>
+#include <random>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "misc.h"
+#include "net-headers.h"
+
+
+using namespace std;
+using namespace harddns;
+using namespace net_headers;
+
+
+static uint64_t now_ns()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+
+struct query_t {
+	string pkt;	// complete DNS query, ID is patched in when sending
+};
+
+
+static int make_query(const string &name, uint16_t qtype, query_t &q)
+{
+	char buf[sizeof(dnshdr) + 512];
+	dnshdr hdr;
+	hdr.q_count = htons(1);
+	hdr.rd = 1;
+
+	memcpy(buf, &hdr, sizeof(hdr));
+	int qnlen = host2qname(name.c_str(), name.size(), buf + sizeof(hdr), sizeof(buf) - sizeof(hdr) - 4);
+	if (qnlen <= 0)
+		return -1;
+
+	uint16_t qclass = htons(1);
+	size_t len = sizeof(hdr) + qnlen;
+	memcpy(buf + len, &qtype, sizeof(qtype));
+	len += sizeof(qtype);
+	memcpy(buf + len, &qclass, sizeof(qclass));
+	len += sizeof(qclass);
+
+	q.pkt = string(buf, len);
+	return 0;
+}
+
+
+static uint16_t qtype_of(const string &s)
+{
+	if (s == "A")
+		return htons(dns_type::A);
+	if (s == "AAAA")
+		return htons(dns_type::AAAA);
+	if (s == "PTR")
+		return htons(dns_type::PTR);
+	if (s == "NS")
+		return htons(dns_type::NS);
+	if (s == "MX")
+		return htons(dns_type::MX);
+	if (s == "TXT")
+		return htons(dns_type::TXT);
+	if (s == "SRV")
+		return htons(dns_type::SRV);
+	return 0;
+}
+
+
+// dnsperf style query file: "name [type]" per line, '#' comments
+static int load_queries(const string &path, vector<query_t> &queries)
+{
+	ifstream f(path);
+	if (!f)
+		return -1;
+
+	string line = "";
+	while (getline(f, line)) {
+		if (line.empty() || line[0] == '#')
+			continue;
+		string name = line, type = "A";
+		auto sp = line.find_first_of(" \t");
+		if (sp != string::npos) {
+			name = line.substr(0, sp);
+			auto tp = line.find_first_not_of(" \t", sp);
+			if (tp != string::npos)
+				type = line.substr(tp, line.find_first_of(" \t", tp) - tp);
+		}
+		query_t q;
+		uint16_t qtype = qtype_of(type);
+		if (!qtype || make_query(name, qtype, q) < 0) {
+			cerr<<"Skipping invalid query '"<<line<<"'\n";
+			continue;
+		}
+		queries.push_back(q);
+	}
+	return 0;
+}
+
+
+// Picks ranks 0..n-1 with probability proportional to 1/(rank + 1)^s
+class zipf {
+
+	vector<double> d_cdf;
+
+public:
+
+	zipf(size_t n, double s)
+	{
+		double sum = 0;
+		d_cdf.reserve(n);
+		for (size_t k = 1; k <= n; ++k) {
+			sum += 1.0/pow((double)k, s);
+			d_cdf.push_back(sum);
+		}
+		for (auto &c : d_cdf)
+			c /= sum;
+	}
+
+	template<class R> size_t operator()(R &rng)
+	{
+		double u = uniform_real_distribution<double>(0, 1)(rng);
+		size_t r = lower_bound(d_cdf.begin(), d_cdf.end(), u) - d_cdf.begin();
+		return r < d_cdf.size() ? r : d_cdf.size() - 1;
+	}
+};
+
+
+struct pending_t {
+	uint64_t sent{0};
+	uint64_t seq{0};
+	bool in_use{0};
+};
+
+
+static void usage(const char *p)
+{
+	cout<<"\nUsage: "<<p<<" [-s server] [-p port] [-f queryfile | -z names [-Z exponent] [-D domain] [-T type]]\n"
+	    <<"\t[-q qps | -c outstanding] [-d seconds] [-t timeout ms]\n\n"
+	    <<"\t-f\tdnsperf style query file, 'name [type]' per line\n"
+	    <<"\t-z\tsynthetic workload of that many names, Zipf distributed (default 10000)\n"
+	    <<"\t-q\topen loop: send at that rate, regardless of answers\n"
+	    <<"\t-c\tclosed loop: keep that many queries outstanding (default 10)\n\n";
+}
+
+
+int main(int argc, char **argv)
+{
+	string server = "127.0.0.1", port = "53", qfile = "", domain = "bench.example", type = "A";
+	size_t n_names = 10000, outstanding = 10;
+	double zipf_s = 1.0, qps = 0, duration = 10, timeout_ms = 2000;
+	int c = 0;
+
+	while ((c = getopt(argc, argv, "s:p:f:z:Z:D:T:q:c:d:t:h")) != -1) {
+		switch (c) {
+		case 's':
+			server = optarg;
+			break;
+		case 'p':
+			port = optarg;
+			break;
+		case 'f':
+			qfile = optarg;
+			break;
+		case 'z':
+			n_names = strtoul(optarg, nullptr, 10);
+			break;
+		case 'Z':
+			zipf_s = strtod(optarg, nullptr);
+			break;
+		case 'D':
+			domain = optarg;
+			break;
+		case 'T':
+			type = optarg;
+			break;
+		case 'q':
+			qps = strtod(optarg, nullptr);
+			break;
+		case 'c':
+			outstanding = strtoul(optarg, nullptr, 10);
+			break;
+		case 'd':
+			duration = strtod(optarg, nullptr);
+			break;
+		case 't':
+			timeout_ms = strtod(optarg, nullptr);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (outstanding == 0 || outstanding > 60000 || n_names == 0 || duration <= 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	vector<query_t> queries;
+	if (qfile.size()) {
+		if (load_queries(qfile, queries) < 0 || queries.empty()) {
+			cerr<<"Unable to load queries from "<<qfile<<endl;
+			return 1;
+		}
+	} else {
+		uint16_t qtype = qtype_of(type);
+		if (!qtype) {
+			cerr<<"Unknown type "<<type<<endl;
+			return 1;
+		}
+		queries.resize(n_names);
+		for (size_t i = 0; i < n_names; ++i) {
+			if (make_query("host" + to_string(i) + "." + domain, qtype, queries[i]) < 0) {
+				cerr<<"Invalid domain "<<domain<<endl;
+				return 1;
+			}
+		}
+	}
+
+	addrinfo hints, *tai = nullptr;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_DGRAM;
+	if (getaddrinfo(server.c_str(), port.c_str(), &hints, &tai) != 0) {
+		cerr<<"Unable to resolve "<<server<<endl;
+		return 1;
+	}
+	free_ptr<addrinfo> ai(tai, freeaddrinfo);
+
+	int sock = socket(ai->ai_family, SOCK_DGRAM, 0);
+	if (sock < 0 || connect(sock, ai->ai_addr, ai->ai_addrlen) < 0) {
+		perror("socket/connect");
+		return 1;
+	}
+	fcntl(sock, F_SETFL, O_RDWR|O_NONBLOCK);
+	int rcvbuf = 4*1024*1024;
+	setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+	mt19937_64 rng(now_ns());
+	zipf pick(queries.size(), zipf_s);
+	bool synthetic = qfile.empty();
+	size_t next_q = 0;
+
+	vector<pending_t> pending(0x10000);
+	deque<pair<uint16_t, uint64_t>> in_flight;	// (id, seq) in send order, for timeouts
+	size_t n_pending = 0;
+	uint16_t next_id = 0;
+	uint64_t seq = 0, sent = 0, received = 0, timeouts = 0, errors = 0;
+	uint64_t rcodes[16] = {0};
+	vector<uint32_t> latencies;	// in us
+	latencies.reserve(1<<20);
+
+	const uint64_t timeout = (uint64_t)(timeout_ms*1000000), start = now_ns(), end = start + (uint64_t)(duration*1e9);
+	const uint64_t interval = qps > 0 ? (uint64_t)(1e9/qps) : 0;
+	uint64_t next_send = start;
+	char buf[4096];
+
+	cout<<"Sending to "<<server<<":"<<port<<" for "<<duration<<"s, "
+	    <<(qps > 0 ? to_string((uint64_t)qps) + " qps open loop" : to_string(outstanding) + " outstanding, closed loop")
+	    <<", "<<queries.size()<<(synthetic ? " synthetic Zipf names" : " queries from file")<<endl;
+
+	for (uint64_t now = now_ns(); now < end || n_pending > 0; now = now_ns()) {
+
+		// send as many as are due
+		while (now < end && n_pending < 0xffff) {
+			if (interval) {
+				if (now < next_send)
+					break;
+				next_send += interval;
+			} else if (n_pending >= outstanding)
+				break;
+
+			// find a free ID
+			while (pending[next_id].in_use)
+				++next_id;
+
+			query_t &q = queries[synthetic ? pick(rng) : next_q++ % queries.size()];
+			uint16_t id = htons(next_id);
+			memcpy(&q.pkt[0], &id, sizeof(id));
+			if (send(sock, q.pkt.c_str(), q.pkt.size(), 0) != (ssize_t)q.pkt.size()) {
+				++errors;
+				break;
+			}
+
+			pending[next_id] = {now, ++seq, 1};
+			in_flight.push_back({next_id, seq});
+			++n_pending;
+			++sent;
+			++next_id;
+		}
+
+		// expire
+		while (!in_flight.empty()) {
+			auto &f = in_flight.front();
+			pending_t &p = pending[f.first];
+			if (!p.in_use || p.seq != f.second) {
+				in_flight.pop_front();
+				continue;
+			}
+			if (now - p.sent < timeout)
+				break;
+			p.in_use = 0;
+			--n_pending;
+			++timeouts;
+			in_flight.pop_front();
+		}
+
+		if (now >= end && n_pending == 0)
+			break;
+
+		int to = 10;
+		if (interval && now < next_send && next_send - now < 10000000)
+			to = (int)((next_send - now)/1000000);
+		pollfd pfd{sock, POLLIN, 0};
+		if (poll(&pfd, 1, to) <= 0)
+			continue;
+
+		for (;;) {
+			ssize_t r = recv(sock, buf, sizeof(buf), 0);
+			if (r < 0)
+				break;
+			if ((size_t)r < sizeof(dnshdr))
+				continue;
+
+			const dnshdr *hdr = reinterpret_cast<const dnshdr *>(buf);
+			pending_t &p = pending[ntohs(hdr->id)];
+			if (!p.in_use || hdr->qr != 1)
+				continue;
+
+			p.in_use = 0;
+			--n_pending;
+			++received;
+			++rcodes[hdr->rcode];
+			latencies.push_back((uint32_t)((now_ns() - p.sent)/1000));
+		}
+	}
+
+	double elapsed = (now_ns() - start)/1e9;
+
+	cout<<"\nsent:     "<<sent<<"\nreceived: "<<received<<"\ntimeouts: "<<timeouts<<"\nerrors:   "<<errors<<endl;
+	printf("qps:      %.1f\n", received/elapsed);
+
+	if (latencies.size()) {
+		sort(latencies.begin(), latencies.end());
+		auto pct = [&](double p) { return latencies[min((size_t)(p*latencies.size()), latencies.size() - 1)]; };
+		uint64_t sum = 0;
+		for (auto l : latencies)
+			sum += l;
+		printf("latency:  min %uus avg %luus p50 %uus p99 %uus p999 %uus max %uus\n", latencies.front(),
+		       (unsigned long)(sum/latencies.size()), pct(0.5), pct(0.99), pct(0.999), latencies.back());
+	}
+
+	const char *rcode_names[16] = {"NOERROR", "FORMERR", "SERVFAIL", "NXDOMAIN", "NOTIMP", "REFUSED"};
+	cout<<"rcodes:  ";
+	for (int i = 0; i < 16; ++i) {
+		if (!rcodes[i])
+			continue;
+		cout<<" "<<(rcode_names[i] ? rcode_names[i] : to_string(i).c_str())<<"="<<rcodes[i];
+	}
+	cout<<endl;
+
+	close(sock);
+	return 0;
+}
+
@@ -35,6 +35,9 @@
 #include "config.h"
 #include "proxy.h"
 #include "init.h"
+#include "stats.h"
+#include "qlog.h"
+#include "shmcache.h"
 
 
 using namespace std;
@@ -97,6 +100,12 @@ void check_lan(const string &ip)
 }
 
 
+static void sighup(int)
+{
+	doh_proxy::request_reload();
+}
+
+
 int main(int argc, char **argv)
 {
 	string banner = "\nharddns -- DoH proxy server v0.58\n\n"
@@ -152,14 +161,39 @@ int main(int argc, char **argv)
 
 	harddns_init(cfg_base);
 
+	stats::name_upstreams();
+
 	doh_proxy doh;
 
-	if (doh.init(laddr, lport) < 0) {
+	if (doh.init(laddr, lport, cfg_base) < 0) {
 		syslog(LOG_INFO, "%s", doh.why());
 		harddns_fini();
 		return -1;
 	}
 
+	stats::start_drainer();
+
+	// Must happen before chroot(), the socket path is outside of it
+	if (config::stats_socket) {
+		string err = "";
+		if (stats::start_exporter(*config::stats_socket, err) < 0)
+			syslog(LOG_INFO, "%s", err.c_str());
+	}
+
+	// Must happen before chroot(), written to as the user later on
+	if (config::shared_cache) {
+		string err = "";
+		if (shmcache::create(*config::shared_cache, err) < 0)
+			syslog(LOG_INFO, "%s", err.c_str());
+	}
+
+	// replaces the log_requests syslog() calls of the proxy
+	if (config::qlog) {
+		string err = "";
+		if (qlog::start(*config::qlog, err) < 0)
+			syslog(LOG_INFO, "%s", err.c_str());
+	}
+
 	// Must happen before chroot()
 	if (initgroups(user.c_str(), user_gid) < 0) {
 		syslog(LOG_INFO, "initgroups: %s", strerror(errno));
@@ -183,7 +217,17 @@ int main(int argc, char **argv)
 	memset(&sa, 0, sizeof(sa));
 	sa.sa_flags = SA_RESTART;
 	sa.sa_handler = SIG_IGN;
-	if (sigaction(SIGHUP, &sa, nullptr) < 0 || sigaction(SIGPIPE, &sa, nullptr) < 0) {
+	if (sigaction(SIGPIPE, &sa, nullptr) < 0) {
+		syslog(LOG_INFO, "Failed to setup signal handlers: %s", strerror(errno));
+		harddns_fini();
+		return -1;
+	}
+
+	// no SA_RESTART, so that a recvfrom() waiting for queries returns
+	// and the loop reloads right away
+	sa.sa_flags = 0;
+	sa.sa_handler = sighup;
+	if (sigaction(SIGHUP, &sa, nullptr) < 0) {
 		syslog(LOG_INFO, "Failed to setup signal handlers: %s", strerror(errno));
 		harddns_fini();
 		return -1;
@@ -18,11 +18,16 @@
  */
 
 #include <string>
+#include <string_view>
 #include <cstring>
 #include <cctype>
 #include <algorithm>
 #include <cstdint>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 namespace harddns {
 
 using namespace std;
@@ -32,121 +37,227 @@ const uint8_t dns_max_label = 63;
 /* "foo.bar" -> "\003foo\003bar\000"
  * "foo.bar." -> "\003foo\003bar\000"
  * automatically splits labels larger than 63 byte into
- * sub-domains
+ * sub-domains. Encodes straight into dst, returns length of
+ * the qname including the trailing \0 or -1 if it doesn't fit
+ * or contains empty labels.
  */
-int host2qname(const string &host, string &result)
+int host2qname(const char *host, size_t hlen, char *dst, size_t dlen)
 {
-	string split_host = "";
-	string::size_type pos1 = 0, pos2 = 0;
-
-	result = "";
-
-	for (;pos1 < host.size();) {
-		pos2 = host.find(".", pos1);
-		if (pos2 == string::npos) {
-			split_host += host.substr(pos1);
-			break;
-		}
+	const char *p = host, *end = host + hlen;
+	size_t o = 0;
+
+	// trailing "." is optional
+	if (hlen > 0 && host[hlen - 1] == '.')
+		--end;
+
+	while (p < end) {
+		// memchr() is vectorized by the libc
+		const char *dot = reinterpret_cast<const char *>(memchr(p, '.', end - p));
+		if (!dot)
+			dot = end;
+		size_t l = dot - p;
+		if (l == 0)
+			return -1;
 
-		if (pos2 - pos1 > dns_max_label) {
-			split_host += host.substr(pos1, dns_max_label);
-			pos1 += dns_max_label;
-		} else {
-			split_host += host.substr(pos1, pos2 - pos1);
-			pos1 = pos2 + 1;
+		while (l > 0) {
+			size_t n = l > dns_max_label ? dns_max_label : l;
+			if (o + 1 + n + 1 > dlen)
+				return -1;
+			dst[o++] = (char)n;
+			memcpy(dst + o, p, n);
+			o += n;
+			p += n;
+			l -= n;
 		}
-
-		split_host += ".";
+		p = dot + 1;
 	}
 
-	if (split_host.size() >= 2048)
+	if (o + 1 > dlen)
 		return -1;
+	dst[o++] = 0;
 
-	char buf[4096] = {0};
-	memcpy(buf + 1, split_host.c_str(), split_host.size());
+	return (int)o;
+}
 
-	// now, substitute dots by cnt
-	string::size_type last_dot = 0;
-	for (; last_dot < split_host.size();) {
-		uint8_t i = 0;
-		while (buf[last_dot + i] != '.' && buf[last_dot + i] != 0)
-			++i;
-		buf[last_dot] = i - 1;
-		last_dot += i;
 
-		// end of string without trailing "." ?
-		if (buf[last_dot] == 0)
-			break;
-		// end with trailing "." ?
-		if (buf[last_dot + 1] == 0) {
-			buf[last_dot] = 0;
-			break;
-		}
-	}
+int host2qname(const string &host, string &result)
+{
+	// labels > 63 are split, so allow for more than 255
+	char buf[2048 + 64];
+
+	result = "";
 
-	result = string(buf, last_dot + 1);
-	return last_dot + 1;
+	int r = host2qname(host.c_str(), host.size(), buf, sizeof(buf));
+	if (r <= 0)
+		return -1;
+
+	result.assign(buf, r);
+	return r;
 }
 
 
 /*  "\003foo\003bar\000" -> foo.bar.
+ * Decodes the name at msg + idx into dst (\0 terminated) and returns
+ * the number of bytes the name occupies at idx. An idx of 0 means we just have
+ * a qname, not an entire DNS packet, so compression is rejected. Compression
+ * pointers must point backwards and inside msg.
  */
-int qname2host(const string &msg, string &result, string::size_type start_idx)
+int qname2host(const char *msg, size_t mlen, size_t idx, char *dst, size_t dlen, size_t &hlen)
 {
-	string::size_type i = start_idx, r = 0;
+	size_t i = idx, o = 0, r = 0;
 	uint8_t len = 0, compress_depth = 0;
 
-	result = "";
-	string s = "";
-	try {
-		s.reserve(msg.length());
-	} catch (...) {
+	hlen = 0;
+	if (dlen == 0)
 		return -1;
-	}
 
-	while ((len = msg[i]) != 0) {
+	for (;;) {
+		if (i >= mlen)
+			return -1;
+		if ((len = msg[i]) == 0)
+			break;
+
 		if (len > dns_max_label) {
-			// start_idx of 0 means we just have a qname string, not an entire DNS packet,
-			// so we cant uncompress compressed labels
-			if (start_idx == 0 || ++compress_depth > 10)
+			if ((len & 0xc0) != 0xc0 || idx == 0 || ++compress_depth > 10 || i + 1 >= mlen)
 				return -1;
-			// compressed?
-			if (len & 0xc0) {
-				if (i + 1 >= msg.size())
-					return -1;
-				i = msg[i + 1] & 0xff;
-				if (i < 0 || i >= msg.size())
-					return -1;
-				// actually += 2, but the return will add 1
-				// only for the first compression
-				if (compress_depth <= 1)
-					r += 1;
-				continue;
-			} else
+			size_t ptr = ((len & 0x3f) << 8)|(msg[i + 1] & 0xff);
+			if (ptr >= i)
 				return -1;
+			// only the first pointer counts for the length at idx
+			if (compress_depth == 1)
+				r = i + 2 - idx;
+			i = ptr;
+			continue;
 		}
-		if (len + i + 1 > msg.size())
+
+		if (i + 1 + len > mlen || o + len + 1 >= dlen)
 			return -1;
-		s += msg.substr(i + 1, len);
-		s += ".";
+		memcpy(dst + o, msg + i + 1, len);
+		o += len;
+		dst[o++] = '.';
 
 		i += len + 1;
-
-		if (compress_depth == 0)
-			r += len + 1;
 	}
 
-	result = s;
-	if (result.size() == 0)
-		return 0;
+	if (compress_depth == 0)
+		r = i + 1 - idx;
+
+	dst[o] = 0;
 
 	// RFC1035
-	if (result.size() > 255) {
-		result = "";
+	if (o > 255)
 		return -1;
+
+	hlen = o;
+	if (o == 0)
+		return 0;
+
+	return (int)r;
+}
+
+
+int qname2host(string_view msg, string &result, string::size_type start_idx)
+{
+	char buf[256 + 64];
+	size_t hlen = 0;
+
+	result = "";
+
+	int r = qname2host(msg.data(), msg.size(), start_idx, buf, sizeof(buf), hlen);
+	if (r <= 0)
+		return r;
+
+	result.assign(buf, hlen);
+	return r;
+}
+
+
+// Table driven charset check and case folding. For each byte, holds the lowercased
+// char if it may appear in a hostname, 0 otherwise.
+struct name_table {
+	char fold[256];
+
+	constexpr name_table() : fold{0}
+	{
+		for (int c = '0'; c <= '9'; ++c)
+			fold[c] = c;
+		for (int c = 'a'; c <= 'z'; ++c)
+			fold[c] = c;
+		for (int c = 'A'; c <= 'Z'; ++c)
+			fold[c] = c - 'A' + 'a';
+		fold['-'] = '-';
+		fold['.'] = '.';
+	}
+};
+
+static constexpr name_table name_chars;
+
+
+#ifdef __SSE2__
+
+// lanes of x in [lo, hi] are 0xff. SSE2 only has signed compares,
+// so shift the range to start at -128.
+static inline __m128i in_range(__m128i x, char lo, char hi)
+{
+	__m128i t = _mm_add_epi8(x, _mm_set1_epi8((char)(0x80 - lo)));
+	return _mm_cmplt_epi8(t, _mm_set1_epi8((char)(-128 + (hi - lo + 1))));
+}
+
+#endif
+
+
+/* Checks the hostname charset of src and writes the lowercased
+ * form to dst (which may equal src) in one pass. Returns len or -1 if an invalid
+ * char was found, in which case dst content is undefined.
+ */
+int valid_name_lc(const char *src, size_t len, char *dst)
+{
+	size_t i = 0;
+
+#ifdef __SSE2__
+	const __m128i x20 = _mm_set1_epi8(0x20);
+	for (; i + 16 <= len; i += 16) {
+		__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+		__m128i upper = in_range(x, 'A', 'Z');
+		__m128i ok = _mm_or_si128(upper, in_range(x, 'a', 'z'));
+		ok = _mm_or_si128(ok, in_range(x, '0', '9'));
+		ok = _mm_or_si128(ok, _mm_cmpeq_epi8(x, _mm_set1_epi8('-')));
+		ok = _mm_or_si128(ok, _mm_cmpeq_epi8(x, _mm_set1_epi8('.')));
+		if (_mm_movemask_epi8(ok) != 0xffff)
+			return -1;
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm_or_si128(x, _mm_and_si128(upper, x20)));
 	}
+#endif
 
-	return r + 1;
+	for (; i < len; ++i) {
+		char c = name_chars.fold[(unsigned char)src[i]];
+		if (!c)
+			return -1;
+		dst[i] = c;
+	}
+
+	return (int)len;
+}
+
+
+// ASCII lowercase of arbitrary data, dst may equal src
+void lcs(const char *src, size_t len, char *dst)
+{
+	size_t i = 0;
+
+#ifdef __SSE2__
+	const __m128i x20 = _mm_set1_epi8(0x20);
+	for (; i + 16 <= len; i += 16) {
+		__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+		__m128i upper = in_range(x, 'A', 'Z');
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm_or_si128(x, _mm_and_si128(upper, x20)));
+	}
+#endif
+
+	for (; i < len; ++i) {
+		char c = src[i];
+		dst[i] = (c >= 'A' && c <= 'Z') ? c + 0x20 : c;
+	}
 }
 
 
@@ -157,20 +268,8 @@ bool valid_name(const string &name)
 	if (l > 254 || l < 2)
 		return 0;
 
-	for (size_t i = 0; i < l; ++i) {
-		if (name[i] >= '0' && name[i] <= '9')
-			continue;
-		if (name[i] >= 'a' && name[i] <= 'z')
-			continue;
-		if (name[i] >= 'A' && name[i] <= 'Z')
-			continue;
-		if (name[i] == '-' || name[i] == '.')
-			continue;
-
-		return 0;
-	}
-
-	return 1;
+	char buf[256];
+	return valid_name_lc(name.c_str(), l, buf) == (int)l;
 }
 
 
@@ -208,8 +307,8 @@ string AAAA2PTR_fqdn(const string &rdata_AAAA)
 
 string lcs(const string &s)
 {
-	string rs = s;
-	transform(rs.begin(), rs.end(), rs.begin(), [](unsigned char c){ return tolower(c); });
+	string rs(s.size(), 0);
+	lcs(s.c_str(), s.size(), &rs[0]);
 	return rs;
 }
 
@@ -21,23 +21,34 @@
 #define harddns_misc_h
 
 #include <memory>
+#include <cstddef>
+#include <cstdint>
 #include <string>
+#include <string_view>
 #include <cctype>
 
 namespace harddns {
 
 int host2qname(const std::string &, std::string &);
 
-int qname2host(const std::string &, std::string &, std::string::size_type idx = 0);
+int host2qname(const char *, size_t, char *, size_t);
+
+int qname2host(std::string_view, std::string &, std::string::size_type idx = 0);
+
+int qname2host(const char *, size_t, size_t, char *, size_t, size_t &);
 
 bool valid_name(const std::string &);
 
+int valid_name_lc(const char *, size_t, char *);
+
 std::string A2PTR_fqdn(const std::string &);
 
 std::string AAAA2PTR_fqdn(const std::string &);
 
 std::string lcs(const std::string &);
 
+void lcs(const char *, size_t, char *);
+
 uint16_t ua_uint16(const void *);
 
 template<typename T> using free_ptr = std::unique_ptr<T, void (*)(T *)>;
@@ -0,0 +1,608 @@
+/*
+ * This file is part of harddns.
+ *
+ * (C) 2023 by Sebastian Krahmer,
+ *             sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * harddns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * harddns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with harddns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// harddns-mockdoh: local DoH upstream with deterministic answers, so that
+// dnshttps, ssl_box and the proxy can be measured without any network access
+
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <random>
+#include <iostream>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "misc.h"
+#include "base64.h"
+#include "config.h"
+#include "net-headers.h"
+
+extern "C" {
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/err.h>
+}
+
+
+using namespace std;
+using namespace harddns;
+using namespace net_headers;
+
+
+struct mock_cfg {
+	unsigned int latency_ms{0}, jitter_ms{0}, answers{1}, close_after{0};
+	double error_rate{0};
+	uint32_t ttl{300};
+	bool chunked{0}, zero_rtt{0};
+};
+
+static mock_cfg cfg;
+
+static atomic<uint64_t> n_conns{0}, n_resumed{0}, n_early{0}, n_requests{0}, n_errors{0};
+
+static volatile sig_atomic_t stop = 0;
+
+
+static void sig_stop(int)
+{
+	stop = 1;
+}
+
+
+static mt19937_64 &rng()
+{
+	thread_local mt19937_64 r{random_device{}()};
+	return r;
+}
+
+
+// FNV-1a of the lowercased name, so that a name always gets the same addresses
+static uint32_t name_hash(const string &name)
+{
+	uint32_t h = 2166136261;
+	for (auto c : name) {
+		h ^= (uint8_t)((c >= 'A' && c <= 'Z') ? c + 0x20 : c);
+		h *= 16777619;
+	}
+	return h;
+}
+
+
+// name of PTR answers, by the hash of the question
+static string ptr_of(uint32_t h)
+{
+	char host[32];
+	snprintf(host, sizeof(host), "h%08x.mock.harddns", h);
+	return host;
+}
+
+
+static string rdata_of(uint16_t qtype, uint32_t h, unsigned int i)
+{
+	if (qtype == dns_type::PTR) {
+		string qname = "";
+		host2qname(ptr_of(h), qname);
+		return qname;
+	}
+
+	if (qtype == dns_type::A) {
+		uint32_t a = htonl(0x0a000000|((h + i) & 0x00ffffff));
+		return string(reinterpret_cast<char *>(&a), sizeof(a));
+	}
+
+	// fd00::/8 ULA, name hash and record index in the low bits
+	char a6[16] = {(char)0xfd};
+	uint32_t hi = htonl(h), lo = htonl(i);
+	memcpy(a6 + 8, &hi, sizeof(hi));
+	memcpy(a6 + 12, &lo, sizeof(lo));
+	return string(a6, sizeof(a6));
+}
+
+
+static int answer_count(uint16_t qtype)
+{
+	if (qtype == dns_type::PTR)
+		return 1;
+	return (qtype == dns_type::A || qtype == dns_type::AAAA) ? cfg.answers : 0;
+}
+
+
+// complete the rfc8484 query in pkt to an answer
+static int rfc8484_reply(const string &pkt, string &body)
+{
+	char host[256];
+	size_t hlen = 0;
+
+	if (pkt.size() < sizeof(dnshdr) + 5)
+		return -1;
+
+	int qnlen = qname2host(pkt.c_str(), pkt.size(), sizeof(dnshdr), host, sizeof(host), hlen);
+	if (qnlen <= 0 || sizeof(dnshdr) + qnlen + 4 > pkt.size())
+		return -1;
+
+	size_t qend = sizeof(dnshdr) + qnlen + 4;
+	uint16_t qtype = ntohs(ua_uint16(pkt.c_str() + sizeof(dnshdr) + qnlen));
+	uint32_t h = name_hash(string(host, hlen));
+	int n = answer_count(qtype);
+
+	body.assign(pkt, 0, qend);
+
+	dnshdr *hdr = reinterpret_cast<dnshdr *>(&body[0]);
+	hdr->qr = 1;
+	hdr->ra = 1;
+	hdr->rcode = 0;
+	hdr->a_count = htons(n);
+	hdr->rra_count = 0;
+	hdr->ad_count = 0;
+
+	uint16_t type = htons(qtype), qclass = htons(1);
+	uint32_t ttl = htonl(cfg.ttl);
+
+	for (int i = 0; i < n; ++i) {
+		string rdata = rdata_of(qtype, h, i);
+		uint16_t rdlen = htons(rdata.size());
+
+		body += "\xc0\x0c";	// compressed pointer to the qname
+		body.append(reinterpret_cast<char *>(&type), sizeof(type));
+		body.append(reinterpret_cast<char *>(&qclass), sizeof(qclass));
+		body.append(reinterpret_cast<char *>(&ttl), sizeof(ttl));
+		body.append(reinterpret_cast<char *>(&rdlen), sizeof(rdlen));
+		body += rdata;
+	}
+
+	return 0;
+}
+
+
+static int json_reply(const string &name, uint16_t qtype, string &body)
+{
+	if (!valid_name(name))
+		return -1;
+
+	string fqdn = name;
+	if (fqdn.back() != '.')
+		fqdn += ".";
+
+	uint32_t h = name_hash(fqdn);
+	char addr[INET6_ADDRSTRLEN];
+
+	body = "{\"Status\":0,\"TC\":false,\"RD\":true,\"RA\":true,\"AD\":false,\"CD\":false,\"Question\":[{\"name\":\"";
+	body += fqdn;
+	body += "\",\"type\":" + to_string(qtype) + "}],\"Answer\":[";
+
+	int n = answer_count(qtype);
+	for (int i = 0; i < n; ++i) {
+		string rdata = rdata_of(qtype, h, i);
+		if (qtype == dns_type::PTR)
+			snprintf(addr, sizeof(addr), "%s.", ptr_of(h).c_str());
+		else
+			inet_ntop(qtype == dns_type::A ? AF_INET : AF_INET6, rdata.c_str(), addr, sizeof(addr));
+		if (i > 0)
+			body += ",";
+		body += "{\"name\":\"" + fqdn + "\",\"type\":" + to_string(qtype) + ",\"TTL\":" + to_string(cfg.ttl);
+		body += ",\"data\":\"";
+		body += addr;
+		body += "\"}";
+	}
+
+	body += "],\"Comment\":\"harddns-mockdoh\"}";
+	return 0;
+}
+
+
+// value of param in the request target, up to the next '&'
+static string query_param(const string &target, const string &param)
+{
+	string::size_type idx = target.find("?" + param + "=");
+	if (idx == string::npos && (idx = target.find("&" + param + "=")) == string::npos)
+		return "";
+	idx += param.size() + 2;
+	return target.substr(idx, target.find("&", idx) - idx);
+}
+
+
+static uint16_t qtype_of(const string &type)
+{
+	if (type == "" || type == "A" || type == "a")
+		return dns_type::A;
+	if (type == "AAAA" || type == "aaaa")
+		return dns_type::AAAA;
+	if (type == "NS" || type == "ns")
+		return dns_type::NS;
+	if (type == "MX" || type == "mx")
+		return dns_type::MX;
+	if (type == "PTR" || type == "ptr")
+		return dns_type::PTR;
+	return (uint16_t)strtoul(type.c_str(), nullptr, 10);
+}
+
+
+// builds the complete HTTP response for the request head in req
+static void http_reply(const string &req, bool last, string &reply)
+{
+	string body = "", ctype = "";
+	const char *status = "200 OK";
+
+	// "GET <target> HTTP/1.1"
+	string::size_type sp1 = req.find(" "), sp2 = string::npos;
+	if (req.compare(0, 4, "GET ") != 0 || (sp2 = req.find(" ", sp1 + 1)) == string::npos)
+		status = "400 Bad Request";
+	else if (uniform_real_distribution<double>(0, 100)(rng()) < cfg.error_rate) {
+		status = "503 Service Unavailable";
+		++n_errors;
+	} else {
+		string target = req.substr(sp1 + 1, sp2 - sp1 - 1), dns = "", pkt = "";
+		if ((dns = query_param(target, "dns")).size() > 0) {
+			ctype = "application/dns-message";
+			if (b64_decode(dns, pkt).empty() || rfc8484_reply(pkt, body) < 0)
+				status = "400 Bad Request";
+		} else {
+			ctype = "application/dns-json";
+			if (json_reply(query_param(target, "name"), qtype_of(query_param(target, "type")), body) < 0)
+				status = "400 Bad Request";
+		}
+	}
+
+	if (strcmp(status, "200 OK") != 0)
+		body = "";
+
+	reply = "HTTP/1.1 ";
+	reply += status;
+	reply += "\r\nServer: harddns-mockdoh\r\n";
+	if (ctype.size() && body.size())
+		reply += "Content-Type: " + ctype + "\r\nCache-Control: max-age=" + to_string(cfg.ttl) + "\r\n";
+	if (last)
+		reply += "Connection: close\r\n";
+
+	if (!cfg.chunked || body.empty()) {
+		reply += "Content-Length: " + to_string(body.size()) + "\r\n\r\n";
+		reply += body;
+		return;
+	}
+
+	reply += "Transfer-Encoding: chunked\r\n\r\n";
+
+	// several chunks, to exercise the chunk reassembly of the client
+	char hex[32];
+	for (string::size_type idx = 0; idx < body.size(); idx += 256) {
+		size_t n = min(body.size() - idx, (size_t)256);
+		snprintf(hex, sizeof(hex), "%zx\r\n", n);
+		reply += hex;
+		reply.append(body, idx, n);
+		reply += "\r\n";
+	}
+	reply += "0\r\n\r\n";
+}
+
+
+static int ssl_write_all(SSL *ssl, const string &s)
+{
+	for (size_t written = 0; written < s.size();) {
+		int r = SSL_write(ssl, s.c_str() + written, s.size() - written);
+		if (r <= 0)
+			return -1;
+		written += r;
+	}
+	return 0;
+}
+
+
+static void serve(SSL_CTX *ctx, int fd)
+{
+	free_ptr<SSL> ssl(SSL_new(ctx), SSL_free);
+	char buf[4096];
+	string in = "", reply = "";
+
+	if (!ssl.get()) {
+		close(fd);
+		return;
+	}
+
+	SSL_set_fd(ssl.get(), fd);
+	++n_conns;
+
+	if constexpr (WANT_TLS_0RTT) {
+	if (cfg.zero_rtt) {
+		for (;;) {
+			size_t n = 0;
+			int r = SSL_read_early_data(ssl.get(), buf, sizeof(buf), &n);
+			if (r == READ_EARLY_DATA_ERROR) {
+				close(fd);
+				return;
+			}
+			in.append(buf, n);
+			if (r == READ_EARLY_DATA_FINISH)
+				break;
+		}
+		if (in.size())
+			++n_early;
+	}}
+
+	if (SSL_accept(ssl.get()) != 1) {
+		close(fd);
+		return;
+	}
+
+	if (SSL_session_reused(ssl.get()))
+		++n_resumed;
+
+	for (unsigned int served = 1; !stop; ++served) {
+		string::size_type eoh = string::npos;
+		while ((eoh = in.find("\r\n\r\n")) == string::npos) {
+			int r = SSL_read(ssl.get(), buf, sizeof(buf));
+			if (r <= 0 || in.size() > 0x10000)
+				break;
+			in.append(buf, r);
+		}
+		if (eoh == string::npos)
+			break;
+
+		++n_requests;
+
+		bool last = cfg.close_after > 0 && served >= cfg.close_after;
+		http_reply(in.substr(0, eoh + 4), last, reply);
+		in.erase(0, eoh + 4);
+
+		unsigned int delay = cfg.latency_ms;
+		if (cfg.jitter_ms > 0)
+			delay += uniform_int_distribution<unsigned int>(0, cfg.jitter_ms)(rng());
+		if (delay > 0) {
+			timespec ts = {(time_t)delay/1000, (long)(delay % 1000)*1000000};
+			nanosleep(&ts, nullptr);
+		}
+
+		if (ssl_write_all(ssl.get(), reply) < 0 || last)
+			break;
+	}
+
+	SSL_shutdown(ssl.get());
+	close(fd);
+}
+
+
+static EVP_PKEY *make_key()
+{
+	EVP_PKEY *pkey = nullptr;
+	free_ptr<EVP_PKEY_CTX> pctx(EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr), EVP_PKEY_CTX_free);
+
+	if (!pctx.get() || EVP_PKEY_keygen_init(pctx.get()) != 1)
+		return nullptr;
+	if (EVP_PKEY_CTX_set_ec_paramgen_curve_nid(pctx.get(), NID_X9_62_prime256v1) != 1)
+		return nullptr;
+	if (EVP_PKEY_keygen(pctx.get(), &pkey) != 1)
+		return nullptr;
+	return pkey;
+}
+
+
+// self-signed, so the cert itself is the trust anchor for the cafile= config
+static X509 *make_cert(EVP_PKEY *pkey, const string &cn)
+{
+	free_ptr<X509> x509(X509_new(), X509_free);
+	if (!x509.get())
+		return nullptr;
+
+	X509_set_version(x509.get(), 2);
+	ASN1_INTEGER_set(X509_get_serialNumber(x509.get()), (long)time(nullptr));
+	X509_gmtime_adj(X509_getm_notBefore(x509.get()), -3600);
+	X509_gmtime_adj(X509_getm_notAfter(x509.get()), 365*24*3600);
+	X509_set_pubkey(x509.get(), pkey);
+
+	X509_NAME *name = X509_get_subject_name(x509.get());
+	X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, reinterpret_cast<const unsigned char *>(cn.c_str()), -1, -1, 0);
+	X509_set_issuer_name(x509.get(), name);
+
+	X509V3_CTX v3;
+	X509V3_set_ctx_nodb(&v3);
+	X509V3_set_ctx(&v3, x509.get(), x509.get(), nullptr, nullptr, 0);
+	string san = "DNS:" + cn;
+	if (X509_EXTENSION *ext = X509V3_EXT_conf_nid(nullptr, &v3, NID_subject_alt_name, &san[0])) {
+		X509_add_ext(x509.get(), ext, -1);
+		X509_EXTENSION_free(ext);
+	}
+
+	if (X509_sign(x509.get(), pkey, EVP_sha256()) <= 0)
+		return nullptr;
+
+	return x509.release();
+}
+
+
+static SSL_CTX *setup_ctx(const string &cn, const string &pem)
+{
+	free_ptr<EVP_PKEY> pkey(make_key(), EVP_PKEY_free);
+	if (!pkey.get())
+		return nullptr;
+	free_ptr<X509> x509(make_cert(pkey.get(), cn), X509_free);
+	if (!x509.get())
+		return nullptr;
+
+	FILE *f = fopen(pem.c_str(), "w");
+	if (!f)
+		return nullptr;
+	PEM_write_X509(f, x509.get());
+	fclose(f);
+
+	SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+	if (!ctx)
+		return nullptr;
+
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+	if (SSL_CTX_use_certificate(ctx, x509.get()) != 1 || SSL_CTX_use_PrivateKey(ctx, pkey.get()) != 1) {
+		SSL_CTX_free(ctx);
+		return nullptr;
+	}
+
+	const char *sid = "harddns-mockdoh";
+	SSL_CTX_set_session_id_context(ctx, reinterpret_cast<const unsigned char *>(sid), strlen(sid));
+
+	if constexpr (WANT_TLS_0RTT) {
+	if (cfg.zero_rtt)
+		SSL_CTX_set_max_early_data(ctx, 16*1024);
+	}
+
+	return ctx;
+}
+
+
+static void usage(const char *p)
+{
+	cout<<"\nUsage: "<<p<<" [-l addr] [-p port] [-n cn] [-o pem] [-L ms] [-J ms] [-e percent]\n"
+	    <<"\t[-k requests] [-a answers] [-T ttl] [-C] [-0]\n\n"
+	    <<"\t-n\tCN and SAN of the generated self-signed cert (default mock.harddns)\n"
+	    <<"\t-o\twhere to store the cert, for use as cafile= in harddns.conf (default mockdoh.pem)\n"
+	    <<"\t-L\tadded latency per response\n"
+	    <<"\t-J\tadditional uniform random latency of up to that many ms\n"
+	    <<"\t-e\tpercentage of requests answered with 503\n"
+	    <<"\t-k\tclose connection after that many requests (default 0, keep-alive)\n"
+	    <<"\t-a\tnumber of A/AAAA records per answer (default 1)\n"
+	    <<"\t-C\tuse chunked transfer encoding\n"
+	    <<"\t-0\taccept TLS 1.3 early data\n\n";
+}
+
+
+int main(int argc, char **argv)
+{
+	string laddr = "127.0.0.1", lport = "8443", cn = "mock.harddns", pem = "mockdoh.pem";
+	int c = 0;
+
+	while ((c = getopt(argc, argv, "l:p:n:o:L:J:e:k:a:T:C0h")) != -1) {
+		switch (c) {
+		case 'l':
+			laddr = optarg;
+			break;
+		case 'p':
+			lport = optarg;
+			break;
+		case 'n':
+			cn = optarg;
+			break;
+		case 'o':
+			pem = optarg;
+			break;
+		case 'L':
+			cfg.latency_ms = strtoul(optarg, nullptr, 10);
+			break;
+		case 'J':
+			cfg.jitter_ms = strtoul(optarg, nullptr, 10);
+			break;
+		case 'e':
+			cfg.error_rate = strtod(optarg, nullptr);
+			break;
+		case 'k':
+			cfg.close_after = strtoul(optarg, nullptr, 10);
+			break;
+		case 'a':
+			cfg.answers = strtoul(optarg, nullptr, 10);
+			break;
+		case 'T':
+			cfg.ttl = strtoul(optarg, nullptr, 10);
+			break;
+		case 'C':
+			cfg.chunked = 1;
+			break;
+		case '0':
+			cfg.zero_rtt = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (cfg.answers > 4096) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	SSL_CTX *ctx = setup_ctx(cn, pem);
+	if (!ctx) {
+		cerr<<"Failed to set up TLS context: "<<ERR_error_string(ERR_get_error(), nullptr)<<endl;
+		return 1;
+	}
+
+	addrinfo hint, *ai = nullptr;
+	memset(&hint, 0, sizeof(hint));
+	hint.ai_socktype = SOCK_STREAM;
+	hint.ai_flags = AI_PASSIVE|AI_NUMERICHOST;
+	if (getaddrinfo(laddr.c_str(), lport.c_str(), &hint, &ai) != 0) {
+		cerr<<"Invalid address "<<laddr<<":"<<lport<<endl;
+		return 1;
+	}
+	free_ptr<addrinfo> ai_free(ai, freeaddrinfo);
+
+	int sock = -1, one = 1;
+	if ((sock = socket(ai->ai_family, SOCK_STREAM, 0)) < 0) {
+		perror("socket");
+		return 1;
+	}
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(sock, ai->ai_addr, ai->ai_addrlen) < 0 || listen(sock, 1024) < 0) {
+		perror("bind");
+		return 1;
+	}
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, nullptr);
+	sa.sa_handler = sig_stop;
+	sigaction(SIGINT, &sa, nullptr);
+	sigaction(SIGTERM, &sa, nullptr);
+
+	cout<<"Mock DoH upstream at "<<laddr<<":"<<lport<<", cert for '"<<cn<<"' written to "<<pem<<"\n\n"
+	    <<"harddns.conf:\n\n"
+	    <<"cafile = "<<pem<<"\n"
+	    <<"nameserver = "<<laddr<<"\nport = "<<lport<<"\ncn = "<<cn<<"\nhost = "<<cn<<"\n"
+	    <<"get = /dns-query?dns=\nrfc8484\n\n";
+
+	while (!stop) {
+		int fd = accept(sock, nullptr, nullptr);
+		if (fd < 0)
+			continue;
+
+		// don't keep idle clients forever
+		timeval tv = {30, 0};
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+		thread(serve, ctx, fd).detach();
+	}
+
+	cout<<"connections: "<<n_conns<<" (resumed "<<n_resumed<<", early data "<<n_early<<")\n"
+	    <<"requests:    "<<n_requests<<"\n"
+	    <<"errors:      "<<n_errors<<" injected\n";
+
+	return 0;
+}
@@ -0,0 +1,117 @@
+/*
+ * This file is part of harddns.
+ *
+ * (C) 2023 by Sebastian Krahmer,
+ *             sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * harddns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * harddns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with harddns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <cstdint>
+#include <ctime>
+#include <shared_mutex>
+#include <arpa/inet.h>
+#include "nss-cache.h"
+#include "net-headers.h"
+#include "config.h"
+#include "misc.h"
+
+
+namespace harddns {
+
+using namespace std;
+using namespace net_headers;
+
+
+bool nss_cache::lookup(const string &name, uint16_t qtype, dnshttps::dns_reply &result)
+{
+	if (config::nss_cache == 0)
+		return 0;
+
+	time_t now = time(nullptr);
+
+	shared_lock<shared_mutex> g(d_mtx);
+
+	auto idx = d_cache.find({lcs(name), qtype});
+	if (idx == d_cache.end() || idx->second.valid_until <= now)
+		return 0;
+
+	result = idx->second.answer;
+
+	// the answers have network order TTLs, the "NSS CNAME" entries host order
+	uint32_t left = idx->second.valid_until - now;
+	for (auto &i : result)
+		i.second.ttl = i.second.name.find("NSS ") == 0 ? left : htonl(left);
+
+	return 1;
+}
+
+
+void nss_cache::insert(const string &name, uint16_t qtype, const dnshttps::dns_reply &reply)
+{
+	if (config::nss_cache == 0)
+		return;
+
+	uint32_t min_ttl = 0xffffffff;
+	bool has_addr = 0;
+	for (const auto &i : reply) {
+		uint32_t ttl = i.second.name.find("NSS ") == 0 ? i.second.ttl : ntohl(i.second.ttl);
+		if (min_ttl > ttl)
+			min_ttl = ttl;
+		if (i.second.qtype == htons(dns_type::A) || i.second.qtype == htons(dns_type::AAAA) || i.second.qtype == htons(dns_type::PTR))
+			has_addr = 1;
+	}
+
+	if (!has_addr && min_ttl > NEGATIVE_TTL)
+		min_ttl = NEGATIVE_TTL;
+	if (min_ttl == 0)
+		return;
+
+	time_t now = time(nullptr);
+	auto key = make_pair(lcs(name), qtype);
+
+	unique_lock<shared_mutex> g(d_mtx);
+
+	auto idx = d_cache.find(key);
+	if (idx != d_cache.end()) {
+		d_expiry.erase(idx->second.expiry);
+		idx->second.answer = reply;
+	} else {
+		evict(now, config::nss_cache);
+		idx = d_cache.emplace(move(key), cache_elem_t{reply, 0, d_expiry.end()}).first;
+	}
+
+	idx->second.valid_until = now + min_ttl;
+	idx->second.expiry = d_expiry.emplace(idx->second.valid_until, &idx->first);
+}
+
+
+// Called with d_mtx held. Drops the expired entries, and if that's not
+// enough, the ones that would expire next, until there is room for one more.
+void nss_cache::evict(time_t now, size_t max)
+{
+	while (!d_expiry.empty() && (d_cache.size() >= max || d_expiry.begin()->first <= now)) {
+		auto next = d_expiry.begin();
+		d_cache.erase(d_cache.find(*next->second));
+		d_expiry.erase(next);
+	}
+}
+
+
+}
+
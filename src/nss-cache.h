@@ -0,0 +1,85 @@
+/*
+ * This file is part of harddns.
+ *
+ * (C) 2023 by Sebastian Krahmer,
+ *             sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * harddns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * harddns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with harddns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef harddns_nss_cache_h
+#define harddns_nss_cache_h
+
+#include <map>
+#include <string>
+#include <utility>
+#include <cstdint>
+#include <ctime>
+#include <shared_mutex>
+#include "dnshttps.h"
+
+
+namespace harddns {
+
+// Answers of the NSS module, per process. Lookups of different threads
+// only share a read lock, so cached names don't wait for a DoH connection or for
+// each other. Keys are the lowercased name and the qtype, or 0 for the
+// A+AAAA lookups of gethostbyname4. Results without addresses or PTR
+// names are kept for NEGATIVE_TTL at most.
+class nss_cache {
+
+	enum {
+		NEGATIVE_TTL = 30
+	};
+
+	using key_t = std::pair<std::string, uint16_t>;
+
+	// valid_until -> key in d_cache, so the entry that expires next is
+	// the first one
+	using expiry_t = std::multimap<time_t, const key_t *>;
+
+	struct cache_elem_t {
+		dnshttps::dns_reply answer;
+		time_t valid_until;
+		expiry_t::iterator expiry;
+	};
+
+	std::map<key_t, cache_elem_t> d_cache;
+
+	expiry_t d_expiry;
+
+	std::shared_mutex d_mtx;
+
+	void evict(time_t now, size_t max);
+
+public:
+
+	nss_cache()
+	{
+	}
+
+	virtual ~nss_cache()
+	{
+	}
+
+	// result as stored, with the TTLs lowered to what is left of them
+	bool lookup(const std::string &, uint16_t, dnshttps::dns_reply &);
+
+	void insert(const std::string &, uint16_t, const dnshttps::dns_reply &);
+};
+
+}
+
+#endif
+
@@ -0,0 +1,153 @@
+/*
+ * This file is part of harddns.
+ *
+ * (C) 2023 by Sebastian Krahmer,
+ *             sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * harddns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * harddns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with harddns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <atomic>
+#include <string>
+#include <cerrno>
+#include <cstring>
+#include <cstdint>
+#include <ctime>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include "nss-client.h"
+#include "net-headers.h"
+#include "misc.h"
+#include "stats.h"
+
+
+namespace harddns {
+
+namespace nss_client {
+
+using namespace std;
+using namespace net_headers;
+
+
+enum {
+	// longer than a forwarded query with all of its retries may take
+	TIMEOUT_MS = 5000,
+
+	// how long a harddnsd that timed out is left alone
+	BACKOFF_S = 10
+};
+
+static atomic<time_t> skip_until{0};
+
+
+int query(const string &path, const string &name, uint16_t qtype, string &reply, string &err)
+{
+	if (time(nullptr) < skip_until) {
+		err = "nss_client::query: harddnsd timed out recently.";
+		return -1;
+	}
+
+	sockaddr_un sun;
+	memset(&sun, 0, sizeof(sun));
+	if (path.size() >= sizeof(sun.sun_path)) {
+		err = "nss_client::query: Path too long.";
+		return -1;
+	}
+	sun.sun_family = AF_UNIX;
+	memcpy(sun.sun_path, path.c_str(), path.size());
+
+	char buf[4096];
+	timeval tv = {0, 0};
+	gettimeofday(&tv, nullptr);
+
+	dnshdr qhdr;
+	qhdr.q_count = htons(1);
+	qhdr.rd = 1;
+	qhdr.id = (tv.tv_usec ^ getpid()) % 0xffff;
+	memcpy(buf, &qhdr, sizeof(qhdr));
+
+	uint16_t qclass = htons(1);
+	int qnlen = host2qname(name.c_str(), name.size(), buf + sizeof(qhdr), 512);
+	if (qnlen <= 0) {
+		err = "nss_client::query: Invalid FQDN";
+		return -1;
+	}
+	size_t qlen = sizeof(qhdr) + qnlen;
+	memcpy(buf + qlen, &qtype, sizeof(qtype));
+	qlen += sizeof(qtype);
+	memcpy(buf + qlen, &qclass, sizeof(qclass));
+	qlen += sizeof(qclass);
+
+	int fd = socket(AF_UNIX, SOCK_DGRAM|SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		err = string("nss_client::query::socket:") + strerror(errno);
+		return -1;
+	}
+
+	// Autobind to an abstract address that harddnsd can answer to. The connect()
+	// fails right away if no harddnsd is listening.
+	sockaddr_un local;
+	memset(&local, 0, sizeof(local));
+	local.sun_family = AF_UNIX;
+	if (::bind(fd, reinterpret_cast<sockaddr *>(&local), sizeof(sa_family_t)) < 0 ||
+	    connect(fd, reinterpret_cast<sockaddr *>(&sun), sizeof(sun)) < 0 ||
+	    send(fd, buf, qlen, 0) != (ssize_t)qlen) {
+		err = string("nss_client::query::connect:") + strerror(errno);
+		close(fd);
+		return -1;
+	}
+
+	const uint64_t deadline = stats::now_us() + TIMEOUT_MS*1000;
+	for (;;) {
+		uint64_t now = stats::now_us();
+		pollfd pfd{fd, POLLIN, 0};
+		if (now >= deadline || poll(&pfd, 1, (deadline - now)/1000 + 1) == 0) {
+			skip_until = time(nullptr) + BACKOFF_S;
+			err = "nss_client::query: Timeout waiting for harddnsd.";
+			close(fd);
+			return -1;
+		}
+
+		// poll() may also have been interrupted
+		ssize_t r = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (r < 0 && (errno == EINTR || errno == EAGAIN))
+			continue;
+		if (r < 0) {
+			err = string("nss_client::query::recv:") + strerror(errno);
+			close(fd);
+			return -1;
+		}
+
+		const dnshdr *ahdr = reinterpret_cast<const dnshdr *>(buf);
+		if ((size_t)r < sizeof(dnshdr) || ahdr->id != qhdr.id || ahdr->qr != 1)
+			continue;
+
+		reply.assign(buf, r);
+		break;
+	}
+
+	close(fd);
+	return 0;
+}
+
+
+}
+
+}
+
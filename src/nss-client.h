@@ -0,0 +1,48 @@
+/*
+ * This file is part of harddns.
+ *
+ * (C) 2023 by Sebastian Krahmer,
+ *             sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * harddns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * harddns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with harddns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef harddns_nss_client_h
+#define harddns_nss_client_h
+
+#include <string>
+#include <cstdint>
+
+
+namespace harddns {
+
+namespace nss_client {
+
+
+// Asks the harddnsd listening on the nss_socket at path, so that all
+// processes of a host share its cache and upstream connections. The
+// question and answer are plain DNS messages, one per datagram.
+//
+// Returns 0 with the DNS answer in reply, or -1 if harddnsd is not there
+// or didn't answer in time, in which case the caller resolves by itself.
+// After a timeout, the daemon is not asked again for a while.
+int query(const std::string &path, const std::string &name, uint16_t qtype, std::string &reply, std::string &err);
+
+
+}
+
+}
+
+#endif
+
@@ -1,19 +1,29 @@
+// glue code to make harddns inited for the NSS module
 
-// glue code to make harddns inited for the NSS DSO load
-
+#include <mutex>
 #include "init.h"
 
 
-extern "C" void harddns_nss_init() __attribute__((constructor));
-extern "C" void harddns_nss_init()
+static std::once_flag init_once;
+
+static bool inited = 0;
+
+
+// Not a constructor, as most processes that load the module never
+// resolve a name and should not pay for config parsing and OpenSSL setup
+void harddns_nss_init()
 {
-	harddns_init("/etc/harddns");
+	std::call_once(init_once, [] {
+		harddns_init("/etc/harddns", true);
+		inited = 1;
+	});
 }
 
 
 extern "C" void harddns_nss_fini() __attribute__((destructor));
 extern "C" void harddns_nss_fini()
 {
-	harddns_fini();
+	if (inited)
+		harddns_fini();
 }
 
@@ -0,0 +1,100 @@
+/*
+ * This file is part of harddns.
+ *
+ * (C) 2023 by Sebastian Krahmer,
+ *             sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * harddns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * harddns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with harddns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <new>
+#include <mutex>
+#include <vector>
+#include <syslog.h>
+#include <condition_variable>
+#include "nss-pool.h"
+#include "config.h"
+
+
+namespace harddns {
+
+using namespace std;
+
+
+nss_pool::~nss_pool()
+{
+	// the first one is the global dns/ssl_conn
+	for (size_t i = 1; i < d_conns.size(); ++i) {
+		delete d_conns[i].dns;
+		delete d_conns[i].ssl;
+	}
+}
+
+
+dnshttps *nss_pool::acquire(bool wait)
+{
+	unique_lock<mutex> g(d_mtx);
+
+	if (!dns || !ssl_conn)
+		return nullptr;
+	if (d_conns.empty())
+		d_conns.push_back({ssl_conn, dns, 0});
+
+	for (;;) {
+		// a connected one if there is, so its connection is reused
+		conn *idle = nullptr;
+		for (auto &c : d_conns) {
+			if (!c.busy && (!idle || (idle->ssl->peer().empty() && !c.ssl->peer().empty())))
+				idle = &c;
+		}
+		if (idle) {
+			idle->busy = 1;
+			return idle->dns;
+		}
+
+		if (d_conns.size() < config::nss_max_conns) {
+			ssl_box *ssl = new (nothrow) ssl_box;
+			dnshttps *d = ssl ? new (nothrow) dnshttps(ssl) : nullptr;
+			if (d && ssl->setup_ctx(*ssl_conn) == 0) {
+				d_conns.push_back({ssl, d, 1});
+				return d;
+			}
+			if (ssl)
+				syslog(LOG_INFO, "%s", ssl->why());
+			delete d;
+			delete ssl;
+		}
+
+		if (!wait)
+			return nullptr;
+		d_cv.wait(g);
+	}
+}
+
+
+void nss_pool::release(dnshttps *d)
+{
+	{
+		lock_guard<mutex> g(d_mtx);
+		for (auto &c : d_conns) {
+			if (c.dns == d)
+				c.busy = 0;
+		}
+	}
+	d_cv.notify_one();
+}
+
+
+}
+
@@ -0,0 +1,99 @@
+/*
+ * This file is part of harddns.
+ *
+ * (C) 2023 by Sebastian Krahmer,
+ *             sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * harddns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * harddns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with harddns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef harddns_nss_pool_h
+#define harddns_nss_pool_h
+
+#include <mutex>
+#include <vector>
+#include <condition_variable>
+#include "dnshttps.h"
+#include "ssl.h"
+
+
+namespace harddns {
+
+// DoH connections of the NSS module. A lookup has one for itself, so the
+// lookups of different threads run in parallel, up to nss_max_conns of
+// them. Further lookups wait for the next one that is done. The first
+// connection is the global dns/ssl_conn, the others are siblings of
+// ssl_conn and share its SSL_CTX and session tickets, so they resume.
+class nss_pool {
+
+	struct conn {
+		ssl_box *ssl{nullptr};
+		dnshttps *dns{nullptr};
+		bool busy{0};
+	};
+
+	std::vector<conn> d_conns;
+
+	std::mutex d_mtx;
+
+	std::condition_variable d_cv;
+
+public:
+
+	nss_pool()
+	{
+	}
+
+	virtual ~nss_pool();
+
+	// nullptr if harddns is not initialized, or without wait if all
+	// connections are busy
+	dnshttps *acquire(bool wait = true);
+
+	void release(dnshttps *);
+
+	class lease {
+
+		nss_pool &d_pool;
+
+		dnshttps *d_dns{nullptr};
+
+	public:
+
+		explicit lease(nss_pool &p)
+			: d_pool(p), d_dns(p.acquire())
+		{
+		}
+
+		~lease()
+		{
+			if (d_dns)
+				d_pool.release(d_dns);
+		}
+
+		lease(const lease &) = delete;
+
+		lease &operator=(const lease &) = delete;
+
+		dnshttps *get()
+		{
+			return d_dns;
+		}
+	};
+};
+
+}
+
+#endif
+
@@ -25,12 +25,13 @@
 #include <cstring>
 #include <string>
 #include <cstdlib>
+#include <ctime>
 #include <stdint.h>
 #include <syslog.h>
 #include <netdb.h>
 #include <signal.h>
 #include <map>
-#include <mutex>
+#include <vector>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
@@ -39,6 +40,14 @@
 #include "dnshttps.h"
 #include "config.h"
 #include "ssl.h"
+#include "stats.h"
+#include "blocklist.h"
+#include "nss-client.h"
+#include "nss-cache.h"
+#include "nss-pool.h"
+#include "shmcache.h"
+#include "misc.h"
+#include "init.h"
 
 
 #define ALIGN(x) (((x) + __SIZEOF_POINTER__ - 1) & ~(__SIZEOF_POINTER__ - 1))
@@ -76,8 +85,156 @@ int main(int argc, char **argv)
 }
 #endif
 
-// Not more than 1 thread to ask for a question at the same time
-mutex ssl_mtx;
+static nss_cache cache;
+
+static nss_pool pool;
+
+enum {
+	// how long a reply waits for the retry with a larger buffer
+	MEMO_S = 5
+};
+
+// Reply of the last lookup of this thread that did not fit the buffer of the
+// caller. glibc asks again with a larger one right away, which then takes
+// it from here, even with nss_cache = 0.
+struct memo_t {
+	string name{""};
+	int af{AF_UNSPEC};
+	time_t until{0};
+	dnshttps::dns_reply res;
+};
+
+static thread_local memo_t memo;
+
+
+static void remember(const char *name, int af, dnshttps::dns_reply &res)
+{
+	memo.name = name;
+	memo.af = af;
+	memo.until = time(nullptr) + MEMO_S;
+	memo.res = move(res);
+}
+
+
+static bool recall(const char *name, int af, dnshttps::dns_reply &res)
+{
+	if (memo.until == 0 || memo.af != af || memo.name != name)
+		return 0;
+	memo.name.clear();
+	bool r = time(nullptr) < memo.until;
+	memo.until = 0;
+	if (r)
+		res = move(memo.res);
+	memo.res.clear();
+	return r;
+}
+
+
+// whether name or one of the CNAMEs it resolved to is on the blocklist
+static bool blocked(const char *name, const dnshttps::dns_reply &res)
+{
+	bool b = blocklist::blocked(name, strlen(name));
+	for (auto it = res.begin(); !b && it != res.end(); ++it) {
+		if (it->second.name == "NSS CNAME")
+			b = blocklist::blocked(it->second.rdata);
+	}
+	if (b)
+		stats::inc(stats::BLOCKED);
+	return b;
+}
+
+// Takes the answer from the shared_cache of harddnsd if it has it there, and
+// sets r like get() does.
+static bool shared(dnshttps *d, const string &name, uint16_t qtype, dnshttps::dns_reply &res, string &raw, string &err, int &r)
+{
+	uint32_t left = 0;
+
+	if (!config::shared_cache || !shmcache::lookup(*config::shared_cache, name, qtype, raw, left))
+		return 0;
+
+	// the question in there is without the trailing dot, as harddnsd got it
+	string qname = name;
+	if (qname.size() > 1 && qname[qname.size() - 1] == '.')
+		qname.pop_back();
+
+	if ((r = d->parse(qname, qtype, raw, res)) < 0) {
+		err = d->why();
+		return 1;
+	}
+	// the TTLs are as of when harddnsd stored the answer
+	for (auto &i : res) {
+		if (i.second.name.find("NSS ") == 0)
+			i.second.ttl = min(i.second.ttl, left);
+		else if (ntohl(i.second.ttl) > left)
+			i.second.ttl = htonl(left);
+	}
+	raw = "(shared cache)";
+	return 1;
+}
+
+// From the shared_cache of harddnsd if it has the answer, via harddnsd if it
+// listens on nss_socket, so that all processes share its cache and connections,
+// and via the DoH connection d of the lookup if it's not running. answered
+// tells whether a server answered or said NXDOMAIN, so that an empty res may
+// be cached.
+static int get(dnshttps *d, const string &name, uint16_t qtype, dnshttps::dns_reply &res, string &raw, string &err, bool &answered)
+{
+	int r = 0;
+
+	answered = 0;
+	if (shared(d, name, qtype, res, raw, err, r)) {
+		answered = (r >= 0);
+		return r;
+	}
+
+	if (config::nss_socket && nss_client::query(*config::nss_socket, name, qtype, raw, err) == 0) {
+		uint8_t rcode = reinterpret_cast<const dnshdr *>(raw.c_str())->rcode;
+
+		// upstreams failed for harddnsd, they would fail for us too
+		if (rcode == 2) {
+			err = "nss: SERVFAIL from harddnsd for " + name;
+			return -1;
+		}
+
+		// harddnsd only answers the PTR names of internal domains and
+		// those it synthesized itself, so NXDOMAIN means ask upstream
+		if (qtype != htons(dns_type::PTR) || rcode != 3) {
+			if ((r = d->parse(name, qtype, raw, res)) < 0)
+				err = d->why();
+			answered = d->answered();
+			raw = "(harddnsd)";
+			return r;
+		}
+	}
+
+	if ((r = d->get(name, qtype, res, raw)) < 0)
+		err = d->why();
+	answered = d->answered();
+	return r;
+}
+
+
+// With cache_PTR, the addresses that name resolved to map back to it for as
+// long as the forward answer is valid, like harddnsd -P does. Reverse lookups
+// usually follow for the peers that were just resolved.
+static void seed_PTR(const char *name, const dnshttps::dns_reply &res)
+{
+	string qname = "";
+	if (!config::cache_PTR || host2qname(name, qname) <= 0)
+		return;
+
+	for (auto &a : res) {
+		string ptr = "", ptr_qname = "";
+		if (a.second.qtype == htons(dns_type::A))
+			ptr = A2PTR_fqdn(a.second.rdata);
+		else if (a.second.qtype == htons(dns_type::AAAA))
+			ptr = AAAA2PTR_fqdn(a.second.rdata);
+		if (ptr.empty() || host2qname(ptr, ptr_qname) <= 0)
+			continue;
+		cache.insert(ptr, htons(dns_type::PTR), {{0, {ptr_qname, htons(dns_type::PTR), htons(1), a.second.ttl, qname}}});
+	}
+}
+
 
 /* Most of the alloc/idx code was taken from libvirt and systemd-resolv nss modules. Interestingly
  * they are almost equal, including their comments and asserts.
@@ -95,6 +252,8 @@ do_nss_harddns_gethostbyname3_r(const char *name, int af, struct hostent *result
 	size_t nameLen = 0, need = 0, idx = 0, cname_len = 0;
 	int alen = 4, r = 0;
 
+	harddns_nss_init();
+
 	if (af != AF_INET6 && af != AF_INET)
 		return NSS_STATUS_TRYAGAIN;
 
@@ -104,22 +263,30 @@ do_nss_harddns_gethostbyname3_r(const char *name, int af, struct hostent *result
 	}
 
 	dnshttps::dns_reply res;
-	string raw = "";
+	string raw = "", err = "";
 
-	{
-		lock_guard<mutex> g(ssl_mtx);
+	if (blocked(name, res)) {
+		*errnop = ENOENT;
+		*herrnop = HOST_NOT_FOUND;
+		return NSS_STATUS_NOTFOUND;
+	}
+
+	if (!recall(name, af, res) && !cache.lookup(name, qtype, res)) {
+		nss_pool::lease l(pool);
+		dnshttps *d = l.get();
 
-		if (!dns)
+		if (!d)
 			return NSS_STATUS_TRYAGAIN;
 
 		// up to 5 levels of DNS recursion for CNAMEs
+		bool answered = 0;
 		string s = name;
 		for (i = 0; s.size() > 0 && i < 5; ++i) {
-			r = dns->get(s, qtype, res, raw);
+			r = get(d, s, qtype, res, raw, err, answered);
 			if (config::log_requests)
 				syslog(LOG_INFO, "nss %s %s? -> %s", s.c_str(), af == AF_INET ? "A" : "AAAA", raw.c_str());
 			if (r < 0) {
-				syslog(LOG_INFO, "%s", dns->why());
+				syslog(LOG_INFO, "%s", err.c_str());
 				return NSS_STATUS_TRYAGAIN;
 			} else if (r == 1)	// found something
 				break;
@@ -131,6 +298,19 @@ do_nss_harddns_gethostbyname3_r(const char *name, int af, struct hostent *result
 				}
 			}
 		}
+
+		// an outage is not NXDOMAIN
+		if (answered) {
+			cache.insert(name, qtype, res);
+			seed_PTR(name, res);
+		}
+	}
+
+	// CNAMEs into blocked domains
+	if (blocked(name, res)) {
+		*errnop = ENOENT;
+		*herrnop = HOST_NOT_FOUND;
+		return NSS_STATUS_NOTFOUND;
 	}
 
 	naddr = 0;
@@ -159,9 +339,11 @@ do_nss_harddns_gethostbyname3_r(const char *name, int af, struct hostent *result
 	 * d) nullptr stem */
 	need = ALIGN(nameLen + 1) + cname_len + (cnames + 1) * sizeof(char *) + naddr * ALIGN(alen) + (naddr + 2) * sizeof(char *);
 
+	// glibc retries with a larger buffer on ERANGE
 	if (buflen < need) {
-		*errnop = ENOMEM;
-		*herrnop = TRY_AGAIN;
+		remember(name, af, res);
+		*errnop = ERANGE;
+		*herrnop = NETDB_INTERNAL;
 		return NSS_STATUS_TRYAGAIN;
 	}
 
@@ -263,38 +445,84 @@ do_nss_harddns_gethostbyname4_r(const char *name, struct gaih_addrtuple **pat,
 	char *r_name = nullptr;
 	int r = 0;
 
+	harddns_nss_init();
+
+	// A+AAAA answers are cached under qtype 0
+	bool aaaa = (_res.options & RES_USE_INET6) || config::nss_aaaa;
+	uint16_t ckey = aaaa ? 0 : htons(dns_type::A);
+
 	dnshttps::dns_reply res;
-	string raw = "";
+	string raw = "", err = "";
 
-	{
-		lock_guard<mutex> g(ssl_mtx);
+	if (blocked(name, res)) {
+		*errnop = ENOENT;
+		*herrnop = HOST_NOT_FOUND;
+		return NSS_STATUS_NOTFOUND;
+	}
 
-		if (!dns)
+	if (!recall(name, aaaa ? AF_UNSPEC : AF_INET, res) && !cache.lookup(name, ckey, res)) {
+		nss_pool::lease l(pool);
+		dnshttps *d = l.get();
+
+		if (!d)
 			return NSS_STATUS_TRYAGAIN;
 
+		// The AAAA answers go to res6 and are merged afterwards, as both
+		// replies are numbered from 0
+		dnshttps::dns_reply res6;
+		string raw6 = "", err6 = "";
+		int r6 = 0;
+		bool answered = 0, answered6 = 1;
+
 		// up to 5 levels of DNS CNAME recursion
 		string s = name;
 		for (int i = 0; s.size() > 0 && i < 5; ++i) {
 
+			// AAAA goes out on a second connection before this one asks
+			// for A, so both replies are on their way and reading them in
+			// turn costs one round trip. Sequential if there is none free
+			// or harddnsd answers, or has it in the shared cache anyway.
+			bool have6 = !aaaa || shared(d, s, htons(dns_type::AAAA), res6, raw6, err6, r6);
+			answered6 = 1;
+			dnshttps *d6 = (have6 || config::nss_socket) ? nullptr : pool.acquire(0);
+			bool sent6 = 0;
+			if (d6) {
+				int b = d6->begin_get(s, htons(dns_type::AAAA));
+				if (b < 0) {
+					r6 = b;
+					err6 = d6->why();
+					have6 = 1;
+				} else
+					sent6 = (b == 1);
+			}
+
 			// A
-			r = dns->get(s, htons(dns_type::A), res, raw);
+			r = get(d, s, htons(dns_type::A), res, raw, err, answered);
+
+			if (sent6) {
+				if ((r6 = d6->end_get(s, htons(dns_type::AAAA), res6, raw6)) < 0)
+					err6 = d6->why();
+				answered6 = d6->answered();
+			} else if (!have6)
+				r6 = get(d, s, htons(dns_type::AAAA), res6, raw6, err6, answered6);
+			if (d6)
+				pool.release(d6);
+
 			if (config::log_requests)
 				syslog(LOG_INFO, "nss %s A? -> %s", s.c_str(), raw.c_str());
 			if (r < 0) {
-				syslog(LOG_INFO, "%s", dns->why());
+				syslog(LOG_INFO, "%s", err.c_str());
 				return NSS_STATUS_TRYAGAIN;
 			} else if (r == 1)
 				naddr = 1;
 
-			if ((_res.options & RES_USE_INET6) || config::nss_aaaa) {
-				// AAAA
-				r = dns->get(s, htons(dns_type::AAAA), res, raw);
-				if (raw.size() && config::log_requests)
-					syslog(LOG_INFO, "nss %s AAAA? -> %s", s.c_str(), raw.c_str());
-				if (r < 0) {
-					syslog(LOG_INFO, "%s", dns->why());
+			if (aaaa) {
+				if (raw6.size() && config::log_requests)
+					syslog(LOG_INFO, "nss %s AAAA? -> %s", s.c_str(), raw6.c_str());
+				if (r6 < 0) {
+					syslog(LOG_INFO, "%s", err6.c_str());
 					return NSS_STATUS_TRYAGAIN;
-				} else if (r == 1) {
+				} else if (r6 == 1) {
 					naddr = 1;
 				}
 			}
@@ -310,6 +538,26 @@ do_nss_harddns_gethostbyname4_r(const char *name, struct gaih_addrtuple **pat,
 				}
 			}
 		}
+
+		// the CNAMEs are in res already
+		unsigned int next = res.empty() ? 0 : res.rbegin()->first + 1;
+		for (auto &a : res6) {
+			if (a.second.qtype == htons(dns_type::AAAA))
+				res[next++] = a.second;
+		}
+
+		// an outage is not NXDOMAIN
+		if (naddr || (answered && answered6)) {
+			cache.insert(name, ckey, res);
+			seed_PTR(name, res);
+		}
+	}
+
+	// CNAMEs into blocked domains
+	if (blocked(name, res)) {
+		*errnop = ENOENT;
+		*herrnop = HOST_NOT_FOUND;
+		return NSS_STATUS_NOTFOUND;
 	}
 
 	naddr = 0;
@@ -330,9 +578,11 @@ do_nss_harddns_gethostbyname4_r(const char *name, struct gaih_addrtuple **pat,
 	 * b) addresses */
 	need = ALIGN(nameLen + 1) + naddr * ALIGN(sizeof(struct gaih_addrtuple));
 
+	// glibc retries with a larger buffer on ERANGE
 	if (buflen < need) {
-		*errnop = ENOMEM;
-		*herrnop = TRY_AGAIN;
+		remember(name, aaaa ? AF_UNSPEC : AF_INET, res);
+		*errnop = ERANGE;
+		*herrnop = NETDB_INTERNAL;
 		return NSS_STATUS_TRYAGAIN;
 	}
 
@@ -347,8 +597,8 @@ do_nss_harddns_gethostbyname4_r(const char *name, struct gaih_addrtuple **pat,
 	for (auto it = res.begin(); it != res.end(); ++it) {
 		if (it->second.qtype != htons(dns_type::A) && it->second.qtype != htons(dns_type::AAAA))
 			continue;
-		if (ttl > it->second.ttl)
-			ttl = it->second.ttl;
+		if (ttl > ntohl(it->second.ttl))
+			ttl = ntohl(it->second.ttl);
 		r_tuple = reinterpret_cast<struct gaih_addrtuple *>(buffer + idx);
 		if (++i == naddr)
 			r_tuple->next = nullptr;
@@ -418,3 +668,154 @@ _nss_harddns_gethostbyname2_r(const char *name, int af, struct hostent *result,
 }
 
 
+static enum nss_status
+do_nss_harddns_gethostbyaddr2_r(const void *addr, socklen_t len, int af, struct hostent *result,
+                              char *buffer, size_t buflen, int *errnop,
+                              int *herrnop, int32_t *ttlp)
+{
+	uint32_t ttl = 60*60;
+	char *r_name = nullptr, **r_aliases = nullptr, *r_addr = nullptr, **r_addr_list = nullptr;
+	size_t need = 0, idx = 0, i = 0;
+	string ptr = "";
+
+	harddns_nss_init();
+
+	if (af == AF_INET && len == 4)
+		ptr = A2PTR_fqdn(string(reinterpret_cast<const char *>(addr), len));
+	else if (af == AF_INET6 && len == 16)
+		ptr = AAAA2PTR_fqdn(string(reinterpret_cast<const char *>(addr), len));
+	else {
+		*errnop = EAFNOSUPPORT;
+		*herrnop = NO_DATA;
+		return NSS_STATUS_UNAVAIL;
+	}
+
+	dnshttps::dns_reply res;
+	string raw = "", err = "";
+
+	if (!recall(ptr.c_str(), af, res) && !cache.lookup(ptr, htons(dns_type::PTR), res)) {
+		nss_pool::lease l(pool);
+		dnshttps *d = l.get();
+
+		if (!d)
+			return NSS_STATUS_TRYAGAIN;
+
+		bool answered = 0;
+		int r = get(d, ptr, htons(dns_type::PTR), res, raw, err, answered);
+		if (config::log_requests)
+			syslog(LOG_INFO, "nss %s PTR? -> %s", ptr.c_str(), raw.c_str());
+		if (r < 0) {
+			syslog(LOG_INFO, "%s", err.c_str());
+			return NSS_STATUS_TRYAGAIN;
+		}
+
+		// an outage is not NXDOMAIN
+		if (answered)
+			cache.insert(ptr, htons(dns_type::PTR), res);
+	}
+
+	// the first name is h_name, the others are aliases
+	vector<string> names;
+	for (auto it = res.begin(); it != res.end(); ++it) {
+		string host = "";
+		if (it->second.qtype != htons(dns_type::PTR) || qname2host(it->second.rdata, host) <= 0)
+			continue;
+		if (host.size() > 1 && host[host.size() - 1] == '.')
+			host.erase(host.size() - 1, 1);
+		if (ttl > ntohl(it->second.ttl))
+			ttl = ntohl(it->second.ttl);
+		names.push_back(host);
+	}
+	if (names.empty()) {
+		*errnop = ENOENT;
+		*herrnop = HOST_NOT_FOUND;
+		return NSS_STATUS_NOTFOUND;
+	}
+
+	/* We need space for:
+	 * a) names
+	 * b) aliases array
+	 * c) address
+	 * d) address array */
+	for (auto &n : names)
+		need += ALIGN(n.size() + 1);
+	need += names.size() * sizeof(char *) + ALIGN(len) + 2 * sizeof(char *);
+
+	// glibc retries with a larger buffer on ERANGE
+	if (buflen < need) {
+		remember(ptr.c_str(), af, res);
+		*errnop = ERANGE;
+		*herrnop = NETDB_INTERNAL;
+		return NSS_STATUS_TRYAGAIN;
+	}
+
+	/* First, append names */
+	for (auto &n : names) {
+		memcpy(buffer + idx, n.c_str(), n.size() + 1);
+		idx += ALIGN(n.size() + 1);
+	}
+
+	/* Second, aliases array, all names but the first */
+	r_name = buffer;
+	r_aliases = reinterpret_cast<char **>(buffer + idx);
+	char *alias = buffer + ALIGN(names[0].size() + 1);
+	for (i = 1; i < names.size(); ++i) {
+		r_aliases[i - 1] = alias;
+		alias += ALIGN(names[i].size() + 1);
+	}
+	r_aliases[i - 1] = nullptr;
+	idx += names.size() * sizeof(char *);
+
+	/* Third, the address and its array */
+	r_addr = buffer + idx;
+	memcpy(r_addr, addr, len);
+	idx += ALIGN(len);
+	r_addr_list = reinterpret_cast<char **>(buffer + idx);
+	r_addr_list[0] = r_addr;
+	r_addr_list[1] = nullptr;
+
+	result->h_name = r_name;
+	result->h_aliases = r_aliases;
+	result->h_addrtype = af;
+	result->h_length = len;
+	result->h_addr_list = r_addr_list;
+
+	if (ttlp)
+		*ttlp = (int32_t)ttl;
+
+	/* Explicitly reset all error variables */
+	*errnop = 0;
+	*herrnop = NETDB_SUCCESS;
+	h_errno = 0;
+
+	return NSS_STATUS_SUCCESS;
+}
+
+
+extern "C" enum nss_status
+_nss_harddns_gethostbyaddr2_r(const void *addr, socklen_t len, int af, struct hostent *result,
+                              char *buffer, size_t buflen, int *errnop,
+                              int *herrnop, int32_t *ttlp)
+{
+	struct sigaction new_sig, old_sig;
+	memset(&new_sig, 0, sizeof(new_sig));
+	new_sig.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &new_sig, &old_sig);
+
+	enum nss_status r = do_nss_harddns_gethostbyaddr2_r(addr, len, af, result, buffer, buflen, errnop, herrnop, ttlp);
+
+	sigaction(SIGPIPE, &old_sig, nullptr);
+	return r;
+}
+
+
+extern "C" enum nss_status
+_nss_harddns_gethostbyaddr_r(const void *addr, socklen_t len, int af, struct hostent *result,
+                             char *buffer, size_t buflen, int *errnop,
+                             int *herrnop)
+{
+	return _nss_harddns_gethostbyaddr2_r(addr, len, af, result, buffer, buflen,
+	                                     errnop, herrnop, nullptr);
+}
+
+
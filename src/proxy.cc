@@ -19,19 +19,33 @@
  */
 
 #include <map>
+#include <set>
+#include <memory>
 #include <string>
+#include <string_view>
+#include <algorithm>
+#include <memory_resource>
 #include <cstring>
 #include <utility>
+#include <vector>
 #include <stdint.h>
 #include <syslog.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include "misc.h"
 #include "proxy.h"
 #include "config.h"
+#include "stats.h"
+#include "qlog.h"
+#include "blocklist.h"
+#include "shmcache.h"
 #include "net-headers.h"
 
 namespace harddns {
@@ -40,10 +54,15 @@ using namespace std;
 using namespace net_headers;
 
 
-int doh_proxy::init(const string &laddr, const string &lport)
+volatile sig_atomic_t doh_proxy::d_reload = 0;
+
+
+int doh_proxy::init(const string &laddr, const string &lport, const string &cfg_base)
 {
 	addrinfo *tai = nullptr;
 
+	d_cfg_base = cfg_base;
+
 	if (getaddrinfo(laddr.c_str(), lport.c_str(), nullptr, &tai) != 0)
 		return build_error("init: Unable to resolve local bind addr.", -1);
 	free_ptr<addrinfo> ai(tai, freeaddrinfo);
@@ -55,6 +74,31 @@ int doh_proxy::init(const string &laddr, const string &lport)
 	if (::bind(d_sock, ai->ai_addr, ai->ai_addrlen) < 0)
 		return build_error("init::bind:", -1);
 
+	// Everyone may ask, as on the UDP port. Non-blocking, so that a client
+	// with a full receive queue can't stall the proxy.
+	if (config::nss_socket) {
+		sockaddr_un sun;
+		memset(&sun, 0, sizeof(sun));
+		if (config::nss_socket->size() >= sizeof(sun.sun_path))
+			return build_error("init: nss_socket path too long.", -1);
+		sun.sun_family = AF_UNIX;
+		memcpy(sun.sun_path, config::nss_socket->c_str(), config::nss_socket->size());
+
+		if ((d_usock = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0)
+			return build_error("init::socket:", -1);
+		unlink(sun.sun_path);
+		if (::bind(d_usock, reinterpret_cast<sockaddr *>(&sun), sizeof(sun)) < 0)
+			return build_error("init::bind:", -1);
+		chmod(sun.sun_path, 0666);
+		fcntl(d_usock, F_SETFL, fcntl(d_usock, F_GETFL) | O_NONBLOCK);
+	}
+
+	if (d_fwd->init(d_sock, config::internal_domains, d_usock) < 0) {
+		errno = 0;
+		return build_error(string("init::") + d_fwd->why(), -1);
+	}
+	d_fwd->cache_hook([this](const char *ans, size_t len) { cache_forwarded(ans, len); });
+
 	// No need to create a dnshttp object, it was globally created
 
 	return 0;
@@ -72,6 +116,9 @@ void doh_proxy::cache_insert(const string &fqdn, uint16_t qtype, const dnshttps:
 		string dname = "";
 		host2qname(fqdn, dname);
 		for (auto i = reply.begin(); i != reply.end(); ++i) {
+			// not the CNAMEs of the chain
+			if (i->second.qtype != qtype)
+				continue;
 			string ptr_name = "", ptr_qname = "";
 			if (qtype == htons(dns_type::A))
 				ptr_name = A2PTR_fqdn(i->second.rdata);
@@ -86,10 +133,6 @@ void doh_proxy::cache_insert(const string &fqdn, uint16_t qtype, const dnshttps:
 		}
 	}
 
-	auto idx = d_rr_cache.find({fqdn, qtype});
-	if (idx != d_rr_cache.end())
-		d_rr_cache.erase(idx);
-
 	uint32_t min_ttl = 0xffffffff;
 	for (auto i = reply.begin(); i != reply.end(); ++i) {
 		if (i->second.name.find("NSS ") == 0)
@@ -98,128 +141,324 @@ void doh_proxy::cache_insert(const string &fqdn, uint16_t qtype, const dnshttps:
 			min_ttl = ntohl(i->second.ttl);
 	}
 
-	cache_elem_t elem{reply, tv.tv_sec + min_ttl};
-	d_rr_cache[{fqdn, qtype}] = elem;
+	d_rr_cache[{fqdn, qtype}] = {reply, tv.tv_sec + min_ttl};
+
+	stats::set(stats::CACHE_ENTRIES, d_rr_cache.size());
 }
 
 
-bool doh_proxy::cache_lookup(const string &fqdn, uint16_t qtype, dnshttps::dns_reply &result)
+bool doh_proxy::cache_lookup(const string &fqdn, uint16_t qtype, const dnshttps::dns_reply *&result, uint32_t &ttl, uint8_t *rcode,
+                             bool *negative)
 {
 	timeval tv;
 	gettimeofday(&tv, nullptr);
 
-	if (d_rr_cache.size() == 0)
-		return 0;
-
-	auto idx = d_rr_cache.find({fqdn, qtype});
+	auto idx = d_rr_cache.find(make_pair(string_view(fqdn), qtype));
 
-	if (idx == d_rr_cache.end())
+	if (idx == d_rr_cache.end()) {
+		stats::inc(stats::CACHE_MISSES);
 		return 0;
+	}
 
-	// no TTL checks for cached PTR lookups
-	if (qtype == htons(dns_type::PTR)) {
-		result = idx->second.answer;
+	// no TTL checks for synthesized PTR records
+	if (qtype == htons(dns_type::PTR) && !idx->second.forwarded) {
+		result = &idx->second.answer;
+		ttl = 0;
+		stats::inc(stats::CACHE_HITS);
 		return 1;
 	}
 
 	if (idx->second.valid_until <= tv.tv_sec) {
 		d_rr_cache.erase(idx);
+		stats::inc(stats::CACHE_EXPIRED);
+		stats::inc(stats::CACHE_MISSES);
+		stats::set(stats::CACHE_ENTRIES, d_rr_cache.size());
 		return 0;
 	}
 
-	auto elem = idx->second.answer;
+	stats::inc(stats::CACHE_HITS);
 
-	for (auto i = elem.begin(); i != elem.end(); ++i)
-		i->second.ttl = htonl(idx->second.valid_until - tv.tv_sec);	// TTL in result map goes as network order
+	if (rcode)
+		*rcode = idx->second.rcode;
+	if (negative)
+		*negative = idx->second.negative;
 
-	result = elem;
+	// no copy, the TTLs are replaced when the reply is built
+	result = &idx->second.answer;
+	ttl = idx->second.valid_until - tv.tv_sec;
 	return 1;
 }
 
 
-int doh_proxy::forward_query(const string &ns, const string &src, const string &fqdn, uint16_t id, const char *buf, size_t blen)
+// appends the uncompressed form of the name at msg + idx to out
+static int append_name(string_view msg, size_t &idx, string &out)
 {
-	addrinfo *tai{nullptr}, hints;
-
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = d_af;
-	hints.ai_socktype = SOCK_DGRAM;
-	hints.ai_protocol = IPPROTO_UDP;
-	hints.ai_flags = AI_NUMERICHOST;
-
-	int r = 0;
-	// local DNS server
-	if ((r = getaddrinfo(ns.c_str(), "53", &hints, &tai)) != 0)
-		return build_error("forward_query: Unable to resolve transparent forwarding address.", -1);
+	string host = "", qname = "";
+	int r = qname2host(msg, host, idx);
+	if (r <= 0 || host2qname(host, qname) <= 0)
+		return -1;
+	idx += r;
+	out += qname;
+	return 0;
+}
 
-	free_ptr<addrinfo> ai(tai, freeaddrinfo);
 
-	if (sendto(d_sock, buf, blen, 0, tai->ai_addr, tai->ai_addrlen) != (int)blen)
-		return build_error("forward_query: sendto() error.", -1);
+// Takes the answer of an internal DNS server into the cache, so the next lookups
+// are served from the fast path. Names inside the RDATA of the RR types that may
+// use compression (RFC3597) are decompressed, as the answers are assembled from
+// the records later. Negative answers are kept along with their SOA for the SOA
+// minimum (RFC2308).
+void doh_proxy::cache_forwarded(const char *buf, size_t len)
+{
+	const dnshdr *hdr = reinterpret_cast<const dnshdr *>(buf);
+
+	if (len < sizeof(dnshdr) + 5 || hdr->qr != 1 || hdr->tc || hdr->q_count != htons(1))
+		return;
+	if (hdr->rcode != 0 && hdr->rcode != 3)
+		return;
+
+	string_view msg(buf, len);
+	string fqdn = "";
+	size_t idx = sizeof(dnshdr);
+	int r = qname2host(msg, fqdn, idx);
+	if (r <= 0 || idx + r + 2*sizeof(uint16_t) > len)
+		return;
+	fqdn.pop_back();
+	lcs(fqdn.c_str(), fqdn.size(), &fqdn[0]);
+	idx += r;
+
+	uint16_t qtype = ua_uint16(buf + idx), qclass = ua_uint16(buf + idx + sizeof(uint16_t));
+	idx += 2*sizeof(uint16_t);
+	if (qclass != htons(1))
+		return;
+
+	dnshttps::dns_reply result, soa;
+	unsigned int an = ntohs(hdr->a_count), ns = ntohs(hdr->rra_count), n = 0;
+	uint32_t neg_ttl = 0;
+
+	for (unsigned int i = 0; i < an + ns; ++i) {
+		dnshttps::answer_t ans;
+		if (append_name(msg, idx, ans.name) < 0 || idx + 10 > len)
+			return;
+
+		ans.qtype = ua_uint16(buf + idx);
+		ans.qclass = ua_uint16(buf + idx + 2);
+		memcpy(&ans.ttl, buf + idx + 4, sizeof(ans.ttl));
+		size_t rdlen = ntohs(ua_uint16(buf + idx + 8));
+		idx += 10;
+		if (idx + rdlen > len)
+			return;
+		size_t end = idx + rdlen;
+
+		// authority section, only the SOA matters
+		if (i >= an && (ans.qtype != htons(dns_type::SOA) || rdlen <= 20 || soa.size() > 0)) {
+			idx = end;
+			continue;
+		}
 
-	// successfully sent, remember in cache to forward answers later
-	// based on cache lookup
-	string map_key = fqdn + string(reinterpret_cast<char *>(&id), sizeof(id));
-	map_key += string(reinterpret_cast<char *>(tai->ai_addr), tai->ai_addrlen);
-	d_fwd_cache[map_key] = src;
+		// bytes before the first name and number of names in the RDATA
+		size_t pre = 0, names = 0;
+		switch (ntohs(ans.qtype)) {
+		case dns_type::CNAME:
+		case dns_type::PTR:
+		case dns_type::NS:
+			names = 1;
+			break;
+		case dns_type::MX:
+			pre = 2;
+			names = 1;
+			break;
+		case dns_type::SOA:
+			names = 2;
+			break;
+		}
 
-	if (config::log_requests)
-		syslog(LOG_INFO, "proxy fwd %s to %s", fqdn.c_str(), ns.c_str());
+		if (pre > rdlen)
+			return;
+		ans.rdata.assign(buf + idx, pre);
+		idx += pre;
+		for (size_t j = 0; j < names; ++j) {
+			if (append_name(msg, idx, ans.rdata) < 0 || idx > end)
+				return;
+		}
+		ans.rdata.append(buf + idx, end - idx);
+		idx = end;
+
+		if (ans.rdata.size() > 0xffff)
+			return;
+
+		if (i >= an) {
+			uint32_t minimum = 0;
+			memcpy(&minimum, buf + end - sizeof(minimum), sizeof(minimum));
+			neg_ttl = min(ntohl(ans.ttl), ntohl(minimum));
+			soa[0] = move(ans);
+		} else if (ans.qclass == htons(1))
+			result[n++] = move(ans);
+	}
 
-	return 0;
+	if (hdr->rcode == 0 && result.size() > 0) {
+		cache_insert(fqdn, qtype, result);
+		d_rr_cache[{fqdn, qtype}].forwarded = 1;
+	} else if (soa.size() > 0) {
+		timeval tv;
+		gettimeofday(&tv, nullptr);
+		d_rr_cache[{fqdn, qtype}] = {move(soa), tv.tv_sec + neg_ttl, static_cast<uint8_t>(hdr->rcode), 1, 1};
+		stats::set(stats::CACHE_ENTRIES, d_rr_cache.size());
+	}
 }
 
 
-int doh_proxy::forward_answer(const string &ns, const string &fqdn, uint16_t id, const char *buf, size_t blen)
+// Runs in loop() between two queries, so nothing else uses the config
+// meanwhile. The stats exporter only reads the labels of name_upstreams().
+void doh_proxy::reload()
 {
-	string map_key = fqdn + string(reinterpret_cast<char *>(&id), sizeof(id)) + ns;
-
-	// Was there a query that we sent with this qname and ID to this NS?
-	auto it = d_fwd_cache.find(map_key);
+	map<string, config::a_ns_cfg> old_ns;
+	if (config::ns_cfg)
+		old_ns = *config::ns_cfg;
+	map<string, string> old_domains = config::internal_domains;
+	set<string> old_nocache = config::internal_nocache;
+	unsigned int old_timeout = config::forward_timeout_ms, old_retries = config::forward_retries;
+
+	if (config::reload(d_cfg_base) < 0) {
+		syslog(LOG_INFO, "Reload: Unable to read %s/harddns.conf, keeping the running config.", d_cfg_base.c_str());
+		return;
+	}
 
-	if (it == d_fwd_cache.end())
-		return build_error("forward_answer:: Answer for no request of " + fqdn, -1);
+	stats::name_upstreams();
 
-	if (sendto(d_sock, buf, blen, 0, reinterpret_cast<const sockaddr *>(it->second.c_str()), it->second.size()) != (int)blen)
-		return build_error("forward_answer::sendto():", -1);
+	// Connections and session tickets of the unchanged upstreams stay warm
+	unsigned int dropped = 0;
+	for (const auto &o : old_ns) {
+		auto it = config::ns_cfg->find(o.first);
+		if (it != config::ns_cfg->end() && it->second.cn == o.second.cn && it->second.host == o.second.host &&
+		    it->second.get == o.second.get && it->second.port == o.second.port && it->second.rfc8484 == o.second.rfc8484)
+			continue;
+		ssl_conn->forget(o.first);
+		++dropped;
+	}
 
-	d_fwd_cache.erase(it);
+	// a list that fails to load leaves the current one in place
+	if (config::blocklist) {
+		string err = "";
+		if (blocklist::load(*config::blocklist, err) < 0)
+			syslog(LOG_INFO, "Reload: %s", err.c_str());
+	} else
+		blocklist::unload();
+	stats::set(stats::BLOCKLIST_ENTRIES, blocklist::size());
+
+	if (old_domains != config::internal_domains || old_nocache != config::internal_nocache ||
+	    old_timeout != config::forward_timeout_ms || old_retries != config::forward_retries) {
+		auto fwd = make_unique<forwarder>();
+		if (fwd->init(d_sock, config::internal_domains, d_usock) < 0)
+			syslog(LOG_INFO, "Reload: %s, keeping the old internal domains.", fwd->why());
+		else {
+			fwd->cache_hook([this](const char *ans, size_t len) { cache_forwarded(ans, len); });
+
+			// the old one still gets the answers for its pending queries
+			if (!d_fwd->idle())
+				d_fwd_retired.push_back(move(d_fwd));
+			d_fwd = move(fwd);
+
+			// their servers may not be in charge anymore
+			for (auto it = d_rr_cache.begin(); it != d_rr_cache.end();) {
+				if (it->second.forwarded)
+					it = d_rr_cache.erase(it);
+				else
+					++it;
+			}
+			stats::set(stats::CACHE_ENTRIES, d_rr_cache.size());
+		}
+	}
 
-	return 0;
+	syslog(LOG_INFO, "Reloaded %s/harddns.conf, %zu upstreams, %u reconnect.", d_cfg_base.c_str(), config::ns_cfg->size(), dropped);
 }
 
 
 int doh_proxy::loop()
 {
 	int r = 0;
-	char buf[4096] = {0};
-	sockaddr_in from4;
-	sockaddr_in6 from6;
-	sockaddr *from = reinterpret_cast<sockaddr *>(&from4);
-	socklen_t flen = sizeof(from4);
+	char buf[4096] = {0}, host[256];
+	sockaddr_storage from_ss;
+	sockaddr *from = reinterpret_cast<sockaddr *>(&from_ss);
+	socklen_t flen = sizeof(from_ss);
+	int lsock = d_sock;
 	dnshdr *query = nullptr, answer;
-	string fqdn = "", qname = "", raw = "", reply = "";
+	string fqdn = "", raw = "";
 	dnshttps::dns_reply result;
 	uint16_t qtype = 0, qclass = 0;
-
-	if (d_af == AF_INET6) {
-		from = reinterpret_cast<sockaddr *>(&from6);
-		flen = sizeof(from6);
-	}
+	vector<pollfd> pfds;
+	vector<size_t> nretired;
 
 	answer.qr = 1;
 	answer.ra = 1;
 	answer.q_count = htons(1);
 
 	for (;;) {
+
+		if (d_reload) {
+			d_reload = 0;
+			reload();
+		}
+
+		// without internal domains and nss_socket, there is nothing to wait for but d_sock
+		if (d_fwd->active() || !d_fwd_retired.empty() || d_usock >= 0) {
+			pfds.clear();
+			pfds.push_back({d_sock, POLLIN, 0});
+			pfds.push_back({d_usock, POLLIN, 0});	// ignored by poll() if -1
+			size_t nfds = d_fwd->pollfds(pfds);
+			int to = d_fwd->poll_timeout();
+			nretired.clear();
+			for (auto &f : d_fwd_retired) {
+				nretired.push_back(f->pollfds(pfds));
+				if (to < 0)
+					to = f->poll_timeout();
+			}
+			if (poll(pfds.data(), pfds.size(), to) < 0 && errno != EINTR)
+				return build_error("loop::poll:", -1);
+			d_fwd->handle(pfds.data() + 2, nfds);
+			d_fwd->expire();
+
+			size_t off = 2 + nfds, i = 0;
+			for (auto it = d_fwd_retired.begin(); it != d_fwd_retired.end(); ++i) {
+				(*it)->handle(pfds.data() + off, nretired[i]);
+				(*it)->expire();
+				off += nretired[i];
+				if ((*it)->idle())
+					it = d_fwd_retired.erase(it);
+				else
+					++it;
+			}
+
+			// both sockets take turns when busy
+			bool udp = pfds[0].revents & POLLIN, nss = pfds[1].revents & POLLIN;
+			if (!udp && !nss)
+				continue;
+			lsock = (nss && (!udp || lsock == d_sock)) ? d_usock : d_sock;
+		}
+
 		memset(buf, 0, sizeof(buf));
+		flen = sizeof(from_ss);
 		memset(from, 0, flen);
 
-		if ((r = recvfrom(d_sock, buf, sizeof(buf), 0, from, &flen)) <= 0)
+		if ((r = recvfrom(lsock, buf, sizeof(buf), 0, from, &flen)) <= 0)
 			continue;
 
 		errno = 0;
 
+		const uint64_t start = stats::now_us();
+
+		// r is reused for the dns->get() result below
+		const size_t qsize = r;
+		const uint64_t qtime = qlog::enabled() ? qlog::now_ns() : 0;
+
+		uint64_t allocs = 0;
+		if constexpr (WANT_ALLOC_STATS)
+			allocs = alloc_count();
+
+		d_arena.reset();
+		pmr::string reply{d_arena.resource()};
+		reply.reserve(2048);
+
 		if ((size_t)r < sizeof(dnshdr) + 2*sizeof(uint16_t) + 1)
 			continue;
 		query = reinterpret_cast<dnshdr *>(buf);
@@ -227,67 +466,96 @@ int doh_proxy::loop()
 		if (query->q_count != htons(1))
 			continue;
 
-		// actually, the string qname will contain more than just the DNS qname but also
-		// all the remaining data. But qname2host() stops after the trailing \0 is seen,
-		// and the variable is just used for that translation
-		qname = string(buf + sizeof(dnshdr), r - sizeof(dnshdr) - 2*sizeof(uint16_t));
-		int qnlen = qname2host(qname, fqdn);
+		// Decode the qname that directly follows the header. qname2host() stops after
+		// the trailing \0 is seen, the remaining data is not looked at.
+		size_t hlen = 0;
+		int qnlen = qname2host(buf + sizeof(dnshdr), r - sizeof(dnshdr) - 2*sizeof(uint16_t), 0, host, sizeof(host), hlen);
 		if (qnlen <= 0)
 			continue;
 
-		// remove trailing dot
-		auto dot = fqdn.rfind(".");
-		if (dot != string::npos)
-			fqdn.erase(dot, 1);
-
-		// If an answer, check and possibly forward if we proxied previous
-		// request to an internal DNS server. We only do a cache lookup based
-		// on fqdn and ID. Its up to the client to verify that the answer is legit;
-		// we are just forwarding from/to internal DNS server.
-		if (query->qr == 1) {
-			if (forward_answer(string(reinterpret_cast<char *>(from), flen), fqdn, query->id, buf, r) != 0)
-				syslog(LOG_INFO, "Failed: %s", this->why());
+		// without trailing dot and lowercased, so that the cache and internal domain
+		// lookups are case insensitive
+		lcs(host, hlen - 1, host);
+		fqdn.assign(host, hlen - 1);
+
+		// Answers of internal DNS servers arrive on the sockets of d_fwd
+		if (query->qr == 1)
 			continue;
-		}
 
 		// must be a query by now
 		if (query->opcode != 0)
 			continue;
 
-		bool has_fwd = 0;
-
-		// check if we need to forward queries of internal domains to internal DNS
-		for (auto it = config::internal_domains.begin(); it != config::internal_domains.end(); ++it) {
-
-			// is internal domain suffix of fqdn?
-			if (fqdn.size() >= it->first.size() && fqdn.find(it->first) == (fqdn.size() - it->first.size())) {
-				if (forward_query(it->second, string(reinterpret_cast<char *>(from), flen), fqdn, query->id, buf, r) != 0)
-					syslog(LOG_INFO, "Failed: %s", this->why());
-				has_fwd = 1;
-				break;
-			}
-		}
-
-		if (has_fwd)
-			continue;
-
 		// It's important here that qname may not contain compression (qname2host() called
 		// with start_idx = 0). Otherwise qnlen would be wrong.
 
 		qtype = ua_uint16(buf + sizeof(dnshdr) + qnlen);
 		qclass = ua_uint16(buf + sizeof(dnshdr) + qnlen + sizeof(uint16_t));
 
+		if (qtype == htons(dns_type::A))
+			stats::inc(stats::QUERIES_A);
+		else if (qtype == htons(dns_type::AAAA))
+			stats::inc(stats::QUERIES_AAAA);
+		else if (qtype == htons(dns_type::PTR))
+			stats::inc(stats::QUERIES_PTR);
+		else
+			stats::inc(stats::QUERIES_OTHER);
+
 		answer.id = query->id;
+		answer.rra_count = 0;
 
-		if (qtype != htons(dns_type::A) && qtype != htons(dns_type::AAAA)) {
+		if (blocklist::blocked(fqdn)) {
+			answer.a_count = 0;
+			answer.rcode = 3;	// NXDOMAIN
+			reply.assign(reinterpret_cast<char *>(&answer), sizeof(answer));
+			reply.append(buf + sizeof(dnshdr), qnlen + 2*sizeof(uint16_t));
+			sendto(lsock, reply.c_str(), reply.size(), 0, from, flen);
+			stats::inc(stats::BLOCKED);
+			stats::inc_rcode(answer.rcode);
+			stats::record(stats::SRC_LOCAL, stats::now_us() - start);
+			qlog::log(qlog::CLIENT_RESPONSE, from, qtime, buf, qsize, reply.c_str(), reply.size(), "blocked");
+			if (config::log_requests && !qlog::enabled())
+				syslog(LOG_INFO, "proxy blocked %s", fqdn.c_str());
+			continue;
+		}
+
+		result.clear();
+
+		bool rdata_from_cache = 0, fwd_cache = 0, negative = 0;
+		uint8_t rcode = 0;
+
+		// result, or what the cache has
+		const dnshttps::dns_reply *answers = &result;
+		uint32_t cache_ttl = 0;
+
+		// check if we need to forward queries of internal domains to internal DNS
+		int tgt = d_fwd->target_of(fqdn, fwd_cache);
+		if (tgt >= 0 && fwd_cache && qclass == htons(1) && cache_lookup(fqdn, qtype, answers, cache_ttl, &rcode, &negative))
+			rdata_from_cache = 1;
+		else if (tgt >= 0) {
+			if (d_fwd->query(tgt, from, flen, buf, qsize, sizeof(dnshdr) + qnlen + 2*sizeof(uint16_t), qtime, fwd_cache) != 0)
+				syslog(LOG_INFO, "Failed: %s", d_fwd->why());
+			else {
+				stats::inc(stats::FORWARDED);
+				qlog::log(qlog::CLIENT_QUERY, from, qtime, buf, qsize, nullptr, 0, "forward");
+				if (config::log_requests && !qlog::enabled())
+					syslog(LOG_INFO, "proxy fwd %s", fqdn.c_str());
+			}
+			continue;
+		}
+
+		if (!rdata_from_cache && qtype != htons(dns_type::A) && qtype != htons(dns_type::AAAA)) {
 
 			// if PTR lookups are disabled or do not exist in the cache, NXDOMAIN
 			if ((qtype == htons(dns_type::PTR) && !config::cache_PTR) || d_rr_cache.count({fqdn, htons(dns_type::PTR)}) == 0) {
 				answer.a_count = 0;
 				answer.rcode = 3;	// NXDOMAIN
-				reply = string(reinterpret_cast<char *>(&answer), sizeof(answer));
-				reply += string(buf + sizeof(dnshdr), qnlen + 2*sizeof(uint16_t));
-				sendto(d_sock, reply.c_str(), reply.size(), 0, from, flen);
+				reply.assign(reinterpret_cast<char *>(&answer), sizeof(answer));
+				reply.append(buf + sizeof(dnshdr), qnlen + 2*sizeof(uint16_t));
+				sendto(lsock, reply.c_str(), reply.size(), 0, from, flen);
+				stats::inc_rcode(answer.rcode);
+				stats::record(stats::SRC_LOCAL, stats::now_us() - start);
+				qlog::log(qlog::CLIENT_RESPONSE, from, qtime, buf, qsize, reply.c_str(), reply.size(), "local");
 				continue;
 			}
 		}
@@ -296,55 +564,61 @@ int doh_proxy::loop()
 
 		//printf("%s %d %d\n", fqdn.c_str(), ntohs(qtype), ntohs(qclass));
 
-		result.clear();
-
-		bool rdata_from_cache = 0;
-
 		raw = "";
 
-		if (cache_lookup(fqdn, qtype, result))
+		if (rdata_from_cache || cache_lookup(fqdn, qtype, answers, cache_ttl, &rcode, &negative))
 			rdata_from_cache = 1;
 		else if ((r = dns->get(fqdn, qtype, result, raw)) <= 0) {
 
 			answer.a_count = 0;
 			if (r < 0) {
 				answer.rcode = 2;
-				syslog(LOG_INFO, "proxy %s -> %s", fqdn.c_str(), dns->why());
+				if (!qlog::enabled())
+					syslog(LOG_INFO, "proxy %s -> %s", fqdn.c_str(), dns->why());
+			} else if (!dns->answered()) {
+				// all upstreams failed, which is no NXDOMAIN to cache for the client
+				answer.rcode = 2;
+				if (!qlog::enabled())
+					syslog(LOG_INFO, "proxy %s -> no answer from any upstream", fqdn.c_str());
 			} else
 				answer.rcode = 3;	// NXDOMAIN
 
-			reply = string(reinterpret_cast<char *>(&answer), sizeof(answer));
-			reply += string(buf + sizeof(dnshdr), qnlen + 2*sizeof(uint16_t));
-			sendto(d_sock, reply.c_str(), reply.size(), 0, from, flen);
+			reply.assign(reinterpret_cast<char *>(&answer), sizeof(answer));
+			reply.append(buf + sizeof(dnshdr), qnlen + 2*sizeof(uint16_t));
+			sendto(lsock, reply.c_str(), reply.size(), 0, from, flen);
+			stats::inc_rcode(answer.rcode);
+			stats::record(stats::SRC_UPSTREAM, stats::now_us() - start);
+			qlog::log(qlog::CLIENT_RESPONSE, from, qtime, buf, qsize, reply.c_str(), reply.size(), "upstream");
 			continue;
 		}
 
-		if (config::log_requests) {
-			string log_type = qtype == htons(dns_type::A) ? "A" : "AAAA";
+		// the query log has the full answer, without a syslog() round trip per query
+		if (config::log_requests && !qlog::enabled()) {
+			const char *log_type = qtype == htons(dns_type::A) ? "A" : "AAAA";
 			if (qtype == htons(dns_type::PTR))
 				log_type = "PTR";
-			syslog(LOG_INFO, "proxy %s %s? -> %s", fqdn.c_str(), log_type.c_str(), rdata_from_cache ? "(cached)" : raw.c_str());
+			syslog(LOG_INFO, "proxy %s %s? -> %s", fqdn.c_str(), log_type, rdata_from_cache ? "(cached)" : raw.c_str());
 		}
 
-		// We found an answer
-		answer.rcode = 0;
-		// Not yet: Will later insert answer hdr into pos 0, as we don't know a_count by now
-		//reply = string(reinterpret_cast<char *>(&answer), sizeof(answer));
+		// We found an answer, or a cached negative one of an internal domain
+		answer.rcode = rcode;
+		// Will later overwrite answer hdr at pos 0, as we don't know a_count by now
+		reply.assign(reinterpret_cast<char *>(&answer), sizeof(answer));
 
 		// copy orig question
-		reply = string(buf + sizeof(dnshdr), qnlen + 2*sizeof(uint16_t));
+		reply.append(buf + sizeof(dnshdr), qnlen + 2*sizeof(uint16_t));
 
 		if (!rdata_from_cache)
 			cache_insert(fqdn, qtype, result);
 
 		uint16_t rdlen = 0, n_answers = 0;
+		uint32_t min_ttl = 0xffffffff;
 
-		// by using an integer to access the map like an vector index, we have
-		// the order of elements as they were inserted by dns->get() by increasing index
-		// as the records were parsed
-		for (unsigned int i = 0; i < result.size(); ++i) {
+		// the map is ordered by index, so the elements are in the order in
+		// which dns->get() inserted them as the records were parsed
+		for (const auto &a : *answers) {
 
-			const auto &elem = result[i];
+			const auto &elem = a.second;
 
 			// skip the entries that were created for NSS module
 			if (elem.name.find("NSS ") == 0)
@@ -352,20 +626,37 @@ int doh_proxy::loop()
 
 			rdlen = htons(elem.rdata.size());
 
-			reply += elem.name;
-			reply += string(reinterpret_cast<const char *>(&elem.qtype), sizeof(elem.qtype));
-			reply += string(reinterpret_cast<const char *>(&elem.qclass), sizeof(elem.qclass));
-			reply += string(reinterpret_cast<const char *>(&elem.ttl), sizeof(elem.ttl));
-			reply += string(reinterpret_cast<const char *>(&rdlen), sizeof(rdlen));
-			reply += elem.rdata;
+			reply.append(elem.name.c_str(), elem.name.size());
+			reply.append(reinterpret_cast<const char *>(&elem.qtype), sizeof(elem.qtype));
+			reply.append(reinterpret_cast<const char *>(&elem.qclass), sizeof(elem.qclass));
+			uint32_t ttl = cache_ttl ? htonl(cache_ttl) : elem.ttl;
+			reply.append(reinterpret_cast<const char *>(&ttl), sizeof(ttl));
+			reply.append(reinterpret_cast<const char *>(&rdlen), sizeof(rdlen));
+			reply.append(elem.rdata.c_str(), elem.rdata.size());
 
+			if (min_ttl > ntohl(ttl))
+				min_ttl = ntohl(ttl);
 			++n_answers;
 		}
 
-		answer.a_count = htons(n_answers);
-		reply.insert(0, string(reinterpret_cast<char *>(&answer), sizeof(answer)));
+		// the SOA of a cached negative answer goes to the authority section
+		answer.a_count = negative ? 0 : htons(n_answers);
+		if (negative)
+			answer.rra_count = htons(n_answers);
+		reply.replace(0, sizeof(answer), reinterpret_cast<char *>(&answer), sizeof(answer));
+
+		sendto(lsock, reply.c_str(), reply.size(), 0, from, flen);
+
+		// for the NSS modules of the host
+		if (!rdata_from_cache && n_answers > 0 && (qtype == htons(dns_type::A) || qtype == htons(dns_type::AAAA)))
+			shmcache::insert(fqdn, qtype, reply.c_str(), reply.size(), min_ttl);
+
+		stats::inc_rcode(rcode);
+		stats::record(rdata_from_cache ? stats::SRC_CACHE : stats::SRC_UPSTREAM, stats::now_us() - start);
+		qlog::log(qlog::CLIENT_RESPONSE, from, qtime, buf, qsize, reply.c_str(), reply.size(), rdata_from_cache ? "cache" : "upstream");
 
-		sendto(d_sock, reply.c_str(), reply.size(), 0, from, flen);
+		if constexpr (WANT_ALLOC_STATS)
+			syslog(LOG_INFO, "proxy %s: %llu allocations", fqdn.c_str(), (unsigned long long)(alloc_count() - allocs));
 	}
 
 	return 0;
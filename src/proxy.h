@@ -23,11 +23,17 @@
 
 #include <unistd.h>
 #include <sys/time.h>
+#include <csignal>
 #include <map>
+#include <list>
+#include <memory>
 #include <string>
+#include <string_view>
 #include <cstdint>
 #include <utility>
 #include "dnshttps.h"
+#include "arena.h"
+#include "forward.h"
 
 
 namespace harddns {
@@ -36,25 +42,62 @@ class doh_proxy {
 
 	int d_sock{-1};
 
+	// nss_socket, on which the NSS modules of the host ask
+	int d_usock{-1};
+
 	int d_af{0};
 
 	struct cache_elem_t {
 		dnshttps::dns_reply answer;
 		time_t valid_until;
+		uint8_t rcode{0};	// NXDOMAIN for negative answers of internal domains
+		bool forwarded{0};
+		bool negative{0};	// answer is the SOA for the authority section (RFC2308)
 	};
 
-	std::map<std::pair<std::string, uint16_t>, cache_elem_t> d_rr_cache;
+	// also compares with a pair<string_view, uint16_t>, so that a lookup
+	// doesn't copy the name
+	struct key_less {
+		using is_transparent = void;
+
+		template<class A, class B>
+		bool operator()(const A &a, const B &b) const
+		{
+			int c = std::string_view(a.first).compare(b.first);
+			return c < 0 || (c == 0 && a.second < b.second);
+		}
+	};
+
+	std::map<std::pair<std::string, uint16_t>, cache_elem_t, key_less> d_rr_cache;
+
+	// temporary strings of one proxy round, reset for each received packet
+	query_arena<8*1024> d_arena;
+
+	// queries of internal_domain's
+	std::unique_ptr<forwarder> d_fwd{std::make_unique<forwarder>()};
 
-	// packet/origin addr
-	std::map<std::string, std::string> d_fwd_cache;
+	// forwarders replaced by a reload, polled until their queries are answered
+	std::list<std::unique_ptr<forwarder>> d_fwd_retired;
+
+	std::string d_cfg_base{"/etc/harddns"};
+
+	// set by the SIGHUP handler, checked by loop()
+	static volatile sig_atomic_t d_reload;
+
+	void reload();
 
 	void cache_insert(const std::string &, uint16_t, const dnshttps::dns_reply &);
 
-	bool cache_lookup(const std::string &, uint16_t, dnshttps::dns_reply &);
+	// The cached answer, valid until the cache is modified, and the TTL
+	// left for its records, or 0 if they keep their own. For negative
+	// answers the records belong to the authority section.
+	bool cache_lookup(const std::string &, uint16_t, const dnshttps::dns_reply *&, uint32_t &ttl, uint8_t *rcode = nullptr,
+	                  bool *negative = nullptr);
 
-	int forward_query(const std::string &, const std::string &, const std::string &, uint16_t, const char *, size_t);
+	void cache_forwarded(const char *, size_t);
 
-	int forward_answer(const std::string &, const std::string &, uint16_t, const char *, size_t);
+	// for the microbenchmarks
+	friend class bench_access;
 
 	// As the dnshttp object we use the globally exported 'dns'
 	// as used for the NSS module
@@ -83,9 +126,17 @@ public:
 	virtual ~doh_proxy()
 	{
 		::close(d_sock);
+		if (d_usock >= 0)
+			::close(d_usock);
 	}
 
-	int init(const std::string &, const std::string &);
+	int init(const std::string &, const std::string &, const std::string &cfg_base = "/etc/harddns");
+
+	// async-signal-safe, the config is reloaded by loop() before the next query
+	static void request_reload()
+	{
+		d_reload = 1;
+	}
 
 	int loop();
 
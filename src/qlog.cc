@@ -0,0 +1,375 @@
+/*
+ * This file is part of harddns.
+ *
+ * (C) 2023 by Sebastian Krahmer,
+ *             sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * harddns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * harddns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with harddns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <new>
+#include <string>
+#include <thread>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "qlog.h"
+#include "ring.h"
+#include "stats.h"
+
+
+namespace harddns {
+
+namespace qlog {
+
+using namespace std;
+
+
+struct entry {
+	msg_type type;
+	uint8_t family;
+	uint16_t port;
+	char addr[16];
+	uint64_t query_ns, response_ns;
+	const char *extra;
+	uint16_t qlen, rlen;
+	char msg[MAX_MSG];	// query, followed by response
+};
+
+using entry_ring = mpmc_ring<entry, 2048>;
+
+// allocated by start(), ~3MB
+static entry_ring *ring = nullptr;
+
+static string dest_path = "", identity = "";
+
+static bool is_unix = 0;
+
+static const char *content_type = "protobuf:dnstap.Dnstap";
+
+// Frame Streams control frame types
+enum { FSTRM_ACCEPT = 1, FSTRM_START = 2, FSTRM_READY = 4 };
+
+
+uint64_t now_ns()
+{
+	timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+
+bool enabled()
+{
+	return ring != nullptr;
+}
+
+
+void log(msg_type type, const sockaddr *peer, uint64_t query_ns, const char *q, size_t qlen,
+         const char *r, size_t rlen, const char *extra)
+{
+	if (!ring)
+		return;
+
+	if (qlen > MAX_MSG)
+		qlen = 0;
+	if (qlen + rlen > MAX_MSG)
+		rlen = 0;
+
+	// keeps the 1.5k off the stack of the caller
+	thread_local entry e;
+	e.type = type;
+	e.family = peer->sa_family;
+	e.port = 0;
+	if (peer->sa_family == AF_INET) {
+		auto sin = reinterpret_cast<const sockaddr_in *>(peer);
+		memcpy(e.addr, &sin->sin_addr, 4);
+		e.port = ntohs(sin->sin_port);
+	} else if (peer->sa_family == AF_INET6) {
+		auto sin6 = reinterpret_cast<const sockaddr_in6 *>(peer);
+		memcpy(e.addr, &sin6->sin6_addr, 16);
+		e.port = ntohs(sin6->sin6_port);
+	}
+	e.query_ns = query_ns;	// 0 for forwarded answers
+	e.response_ns = now_ns();
+	e.extra = extra;
+	e.qlen = qlen;
+	e.rlen = rlen;
+	if (qlen)
+		memcpy(e.msg, q, qlen);
+	if (rlen)
+		memcpy(e.msg + qlen, r, rlen);
+
+	if (!ring->push(e))
+		stats::inc(stats::QLOG_DROPPED);
+}
+
+
+// Minimal protobuf encoding, just enough for dnstap.proto
+
+static void pb_varint(string &out, uint64_t v)
+{
+	while (v >= 0x80) {
+		out += (char)(v|0x80);
+		v >>= 7;
+	}
+	out += (char)v;
+}
+
+
+static void pb_uint(string &out, unsigned int field, uint64_t v)
+{
+	pb_varint(out, field<<3);
+	pb_varint(out, v);
+}
+
+
+static void pb_fixed32(string &out, unsigned int field, uint32_t v)
+{
+	pb_varint(out, (field<<3)|5);
+	for (int i = 0; i < 4; ++i, v >>= 8)
+		out += (char)(v & 0xff);
+}
+
+
+static void pb_bytes(string &out, unsigned int field, const char *p, size_t n)
+{
+	pb_varint(out, (field<<3)|2);
+	pb_varint(out, n);
+	out.append(p, n);
+}
+
+
+static void put32(string &out, uint32_t v)
+{
+	uint32_t be = htonl(v);
+	out.append(reinterpret_cast<char *>(&be), sizeof(be));
+}
+
+
+// appends the Frame Streams data frame of e to out
+static void encode(const entry &e, string &msg, string &tap, string &out)
+{
+	msg.clear();
+	pb_uint(msg, 1, e.type);
+	if (e.family == AF_INET || e.family == AF_INET6) {
+		pb_uint(msg, 2, e.family == AF_INET ? 1 : 2);	// SocketFamily INET/INET6
+		pb_uint(msg, 3, 1);				// SocketProtocol UDP
+		pb_bytes(msg, 4, e.addr, e.family == AF_INET ? 4 : 16);
+		pb_uint(msg, 6, e.port);
+	}
+	if (e.qlen) {
+		pb_uint(msg, 8, e.query_ns/1000000000);
+		pb_fixed32(msg, 9, e.query_ns % 1000000000);
+		pb_bytes(msg, 10, e.msg, e.qlen);
+	}
+	if (e.type == CLIENT_RESPONSE) {
+		pb_uint(msg, 12, e.response_ns/1000000000);
+		pb_fixed32(msg, 13, e.response_ns % 1000000000);
+		if (e.rlen)
+			pb_bytes(msg, 14, e.msg + e.qlen, e.rlen);
+	}
+
+	tap.clear();
+	pb_bytes(tap, 1, identity.c_str(), identity.size());
+	pb_bytes(tap, 2, "harddns 0.58", 12);
+	if (e.extra)
+		pb_bytes(tap, 3, e.extra, strlen(e.extra));
+	pb_bytes(tap, 14, msg.c_str(), msg.size());
+	pb_uint(tap, 15, 1);	// Dnstap.Type MESSAGE
+
+	put32(out, tap.size());
+	out += tap;
+}
+
+
+static void control_frame(uint32_t type, string &out)
+{
+	string ctrl = "";
+	put32(ctrl, type);
+	put32(ctrl, 1);		// CONTENT_TYPE field
+	put32(ctrl, strlen(content_type));
+	ctrl += content_type;
+
+	put32(out, 0);			// escape
+	put32(out, ctrl.size());
+	out += ctrl;
+}
+
+
+static int write_all(int fd, const string &s)
+{
+	for (size_t written = 0; written < s.size();) {
+		ssize_t n = ::send(fd, s.c_str() + written, s.size() - written, MSG_NOSIGNAL);
+		if (n < 0 && errno == ENOTSOCK)
+			n = ::write(fd, s.c_str() + written, s.size() - written);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		written += n;
+	}
+	return 0;
+}
+
+
+// bidirectional Frame Streams handshake: READY -> ACCEPT, then START
+static int connect_unix()
+{
+	sockaddr_un sun;
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	memcpy(sun.sun_path, dest_path.c_str(), dest_path.size());
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	if (connect(fd, reinterpret_cast<sockaddr *>(&sun), sizeof(sun)) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	string out = "";
+	control_frame(FSTRM_READY, out);
+	if (write_all(fd, out) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	// escape, length, type of the ACCEPT frame, skip the rest
+	char buf[512];
+	size_t have = 0;
+	pollfd pfd{fd, POLLIN, 0};
+	while (have < 12) {
+		ssize_t n = 0;
+		if (poll(&pfd, 1, 1000) != 1 || (n = read(fd, buf + have, sizeof(buf) - have)) <= 0) {
+			close(fd);
+			return -1;
+		}
+		have += n;
+	}
+	uint32_t type = 0;
+	memcpy(&type, buf + 8, sizeof(type));
+	if (ntohl(type) != FSTRM_ACCEPT) {
+		close(fd);
+		return -1;
+	}
+
+	out.clear();
+	control_frame(FSTRM_START, out);
+	if (write_all(fd, out) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+
+static void writer(int fd)
+{
+	entry e;
+	string msg = "", tap = "", batch = "";
+	time_t last_try = 0;
+	timespec ts = {0, 10000000};	// 10ms
+
+	msg.reserve(2*MAX_MSG);
+	tap.reserve(2*MAX_MSG);
+	batch.reserve(128*1024);
+
+	for (;;) {
+		if (fd < 0 && is_unix && time(nullptr) != last_try) {
+			last_try = time(nullptr);
+			fd = connect_unix();
+		}
+
+		// batch as much as is queued into a single write
+		unsigned int n = 0;
+		for (; batch.size() < 64*1024 && ring->pop(e); ++n)
+			encode(e, msg, tap, batch);
+
+		if (n == 0) {
+			nanosleep(&ts, nullptr);
+			continue;
+		}
+
+		if (fd < 0 || write_all(fd, batch) < 0) {
+			stats::add(stats::local().counters[stats::QLOG_DROPPED], n);
+			if (fd >= 0 && is_unix) {
+				close(fd);
+				fd = -1;
+			}
+		}
+		batch.clear();
+	}
+}
+
+
+int start(const string &dest, string &err)
+{
+	int fd = -1;
+
+	char host[256] = {0};
+	gethostname(host, sizeof(host) - 1);
+	identity = host;
+
+	if (dest.find("unix:") == 0) {
+		is_unix = 1;
+		dest_path = dest.substr(5);
+		sockaddr_un sun;
+		if (dest_path.empty() || dest_path.size() >= sizeof(sun.sun_path)) {
+			err = "qlog::start: Invalid socket path.";
+			return -1;
+		}
+		// a receiver that's not up yet is retried by the writer
+		fd = connect_unix();
+	} else {
+		dest_path = dest;
+		if ((fd = open(dest_path.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0600)) < 0) {
+			err = string("qlog::start::open:") + strerror(errno);
+			return -1;
+		}
+		string out = "";
+		control_frame(FSTRM_START, out);
+		if (write_all(fd, out) < 0) {
+			err = string("qlog::start::write:") + strerror(errno);
+			close(fd);
+			return -1;
+		}
+	}
+
+	if (!(ring = new (nothrow) entry_ring)) {
+		err = "qlog::start: Out of memory.";
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+
+	thread(writer, fd).detach();
+	return 0;
+}
+
+
+}
+
+}
+
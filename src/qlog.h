@@ -0,0 +1,65 @@
+/*
+ * This file is part of harddns.
+ *
+ * (C) 2023 by Sebastian Krahmer,
+ *             sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * harddns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * harddns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with harddns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef harddns_qlog_h
+#define harddns_qlog_h
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+#include <sys/socket.h>
+
+
+namespace harddns {
+
+namespace qlog {
+
+
+// dnstap Message.Type values
+enum msg_type : uint8_t {
+	CLIENT_QUERY = 5,
+	CLIENT_RESPONSE = 6
+};
+
+// larger query/response pairs are logged without the response
+constexpr size_t MAX_MSG = 1536;
+
+
+// Starts the writer thread. dest is a file name (truncated) or "unix:/path"
+// for a Frame Streams receiver such as "dnstap -u". Must be called before chroot().
+int start(const std::string &dest, std::string &err);
+
+bool enabled();
+
+// CLOCK_REALTIME in ns, as dnstap wants wall clock timestamps
+uint64_t now_ns();
+
+// Queues a dnstap record without blocking. The response time is taken now.
+// extra tells where the answer came from and must be a string literal.
+void log(msg_type, const sockaddr *peer, uint64_t query_ns, const char *q, size_t qlen,
+         const char *r, size_t rlen, const char *extra);
+
+
+}
+
+}
+
+#endif
+
@@ -0,0 +1,109 @@
+/*
+ * This file is part of harddns.
+ *
+ * (C) 2023 by Sebastian Krahmer,
+ *             sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * harddns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * harddns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with harddns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef harddns_ring_h
+#define harddns_ring_h
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+
+namespace harddns {
+
+
+// Bounded lock-free MPMC queue (Vyukov). Each slot carries a sequence number
+// that tells producers and consumers whether it is free for the lap they are in,
+// so push() and pop() are a single CAS on the fast path and never block.
+// push() fails rather than waits if the ring is full.
+template<class T, std::size_t N>
+class mpmc_ring {
+
+	static_assert(N >= 2 && (N & (N - 1)) == 0, "ring size must be a power of 2");
+
+	struct slot {
+		std::atomic<std::size_t> seq;
+		T data;
+	};
+
+	slot d_slots[N];
+
+	alignas(64) std::atomic<std::size_t> d_tail{0};
+
+	alignas(64) std::atomic<std::size_t> d_head{0};
+
+public:
+
+	mpmc_ring()
+	{
+		for (std::size_t i = 0; i < N; ++i)
+			d_slots[i].seq.store(i, std::memory_order_relaxed);
+	}
+
+	mpmc_ring(const mpmc_ring &) = delete;
+
+	mpmc_ring &operator=(const mpmc_ring &) = delete;
+
+	bool push(const T &v)
+	{
+		std::size_t pos = d_tail.load(std::memory_order_relaxed);
+		for (;;) {
+			slot &s = d_slots[pos & (N - 1)];
+			std::size_t seq = s.seq.load(std::memory_order_acquire);
+			intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+			if (dif == 0) {
+				if (d_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					s.data = v;
+					s.seq.store(pos + 1, std::memory_order_release);
+					return 1;
+				}
+			} else if (dif < 0)
+				return 0;
+			else
+				pos = d_tail.load(std::memory_order_relaxed);
+		}
+	}
+
+	bool pop(T &v)
+	{
+		std::size_t pos = d_head.load(std::memory_order_relaxed);
+		for (;;) {
+			slot &s = d_slots[pos & (N - 1)];
+			std::size_t seq = s.seq.load(std::memory_order_acquire);
+			intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+			if (dif == 0) {
+				if (d_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					v = s.data;
+					s.seq.store(pos + N, std::memory_order_release);
+					return 1;
+				}
+			} else if (dif < 0)
+				return 0;
+			else
+				pos = d_head.load(std::memory_order_relaxed);
+		}
+	}
+};
+
+
+}
+
+#endif
+
@@ -0,0 +1,287 @@
+/*
+ * This file is part of harddns.
+ *
+ * (C) 2023 by Sebastian Krahmer,
+ *             sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * harddns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * harddns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with harddns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <cerrno>
+#include <cstring>
+#include <cstdint>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "shmcache.h"
+#include "blocklist.h"
+#include "misc.h"
+
+
+namespace harddns {
+
+namespace shmcache {
+
+using namespace std;
+
+
+enum {
+	// how often a reader tries to map a missing cache
+	RETRY_S = 10
+};
+
+static const size_t map_size = sizeof(header) + NSLOTS*sizeof(slot);
+
+// writable mapping of harddnsd
+static char *wbase = nullptr;
+
+// Read-only mapping of everyone else. A replaced one is not unmapped, as
+// other threads may still be reading it.
+static atomic<const char *> rbase{nullptr};
+
+static atomic<time_t> rnext_try{0};
+
+static mutex rmtx;
+
+
+static bool valid(const char *base)
+{
+	const header *hdr = reinterpret_cast<const header *>(base);
+	return memcmp(hdr->magic, "HDNSSHC\0", sizeof(hdr->magic)) == 0 && hdr->version == VERSION && hdr->nslots == NSLOTS;
+}
+
+
+// harddnsd and the NSS modules agree on the name, no matter whether it
+// came with a trailing dot or in uppercase. 0 if it doesn't fit a slot.
+static size_t key(const string &name, char *k)
+{
+	size_t n = name.size();
+	if (n > 0 && name[n - 1] == '.')
+		--n;
+	if (n == 0 || n > sizeof(slot::name))
+		return 0;
+	lcs(name.c_str(), n, k);
+	return n;
+}
+
+
+static inline slot *bucket(char *base, const char *name, size_t nlen, uint16_t qtype)
+{
+	uint64_t h = blocklist::hash(name, nlen) ^ qtype;
+	return reinterpret_cast<slot *>(base + sizeof(header)) + (h % (NSLOTS/WAYS))*WAYS;
+}
+
+
+int create(const string &path, string &err)
+{
+	string::size_type slash = path.rfind("/");
+	if (slash != string::npos && slash > 0)
+		mkdir(path.substr(0, slash).c_str(), 0755);
+
+	// take over a cache of an earlier run, so it stays warm
+	int fd = open(path.c_str(), O_RDWR|O_CLOEXEC);
+	if (fd >= 0) {
+		struct stat st;
+		void *base = MAP_FAILED;
+		if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(header))
+			base = mmap(nullptr, st.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (base != MAP_FAILED) {
+			if ((size_t)st.st_size == map_size && valid(reinterpret_cast<char *>(base)) && st.st_uid == geteuid()) {
+				// a harddnsd that died while writing a slot left its seq
+				// odd, so readers would skip that slot for good
+				slot *sl = reinterpret_cast<slot *>(reinterpret_cast<char *>(base) + sizeof(header));
+				for (uint32_t i = 0; i < NSLOTS; ++i) {
+					uint32_t seq = sl[i].seq.load(memory_order_relaxed);
+					if (seq & 1) {
+						sl[i].valid_until = 0;
+						sl[i].seq.store(seq + 1, memory_order_release);
+					}
+				}
+				wbase = reinterpret_cast<char *>(base);
+				return 0;
+			}
+			// readers of an old layout go for the new file
+			if (memcmp(base, "HDNSSHC\0", 8) == 0)
+				reinterpret_cast<header *>(base)->retired = 1;
+			munmap(base, st.st_size);
+		}
+	}
+
+	// readers never see a half initialized file
+	string tmp = path + ".tmp";
+	unlink(tmp.c_str());
+	if ((fd = open(tmp.c_str(), O_RDWR|O_CREAT|O_EXCL|O_CLOEXEC, 0644)) < 0) {
+		err = "shmcache::create::open:" + string(strerror(errno));
+		return -1;
+	}
+	fchmod(fd, 0644);
+	if (ftruncate(fd, map_size) < 0) {
+		err = "shmcache::create::ftruncate:" + string(strerror(errno));
+		close(fd);
+		unlink(tmp.c_str());
+		return -1;
+	}
+	void *base = mmap(nullptr, map_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		err = "shmcache::create::mmap:" + string(strerror(errno));
+		unlink(tmp.c_str());
+		return -1;
+	}
+
+	header *hdr = reinterpret_cast<header *>(base);
+	memcpy(hdr->magic, "HDNSSHC\0", sizeof(hdr->magic));
+	hdr->version = VERSION;
+	hdr->nslots = NSLOTS;
+
+	if (rename(tmp.c_str(), path.c_str()) < 0) {
+		err = "shmcache::create::rename:" + string(strerror(errno));
+		munmap(base, map_size);
+		unlink(tmp.c_str());
+		return -1;
+	}
+
+	wbase = reinterpret_cast<char *>(base);
+	return 0;
+}
+
+
+void insert(const string &name, uint16_t qtype, const char *msg, size_t len, uint32_t ttl)
+{
+	char k[sizeof(slot::name)];
+	size_t nlen = 0;
+
+	if (!wbase || len > sizeof(slot::msg) || ttl == 0 || (nlen = key(name, k)) == 0)
+		return;
+
+	const int64_t now = time(nullptr);
+	slot *b = bucket(wbase, k, nlen, qtype), *s = b;
+
+	// the slot of that name, or the one that expires first
+	for (uint32_t i = 0; i < WAYS; ++i) {
+		if (b[i].qtype == qtype && b[i].nlen == nlen && memcmp(b[i].name, k, nlen) == 0) {
+			s = b + i;
+			break;
+		}
+		if (b[i].valid_until < s->valid_until)
+			s = b + i;
+	}
+
+	// odd while writing, so readers drop what they copied meanwhile
+	uint32_t seq = s->seq.load(memory_order_relaxed);
+	if ((seq & 1) || !s->seq.compare_exchange_strong(seq, seq + 1, memory_order_acq_rel))
+		return;
+	atomic_thread_fence(memory_order_release);
+
+	s->qtype = qtype;
+	s->len = len;
+	s->valid_until = now + ttl;
+	s->nlen = nlen;
+	memcpy(s->name, k, nlen);
+	memcpy(s->msg, msg, len);
+
+	s->seq.store(seq + 2, memory_order_release);
+}
+
+
+static const char *attach(const string &path)
+{
+	const char *base = rbase.load(memory_order_acquire);
+	if (base && !reinterpret_cast<const header *>(base)->retired.load(memory_order_relaxed))
+		return base;
+
+	time_t now = time(nullptr);
+	if (now < rnext_try.load(memory_order_relaxed))
+		return nullptr;
+
+	lock_guard<mutex> g(rmtx);
+
+	base = rbase.load(memory_order_relaxed);
+	if (base && !reinterpret_cast<const header *>(base)->retired.load(memory_order_relaxed))
+		return base;
+	rnext_try = now + RETRY_S;
+
+	int fd = open(path.c_str(), O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return nullptr;
+
+	// written by anyone but root or us, it could hold anything
+	struct stat st;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size != map_size || (st.st_uid != 0 && st.st_uid != geteuid()) || (st.st_mode & 022)) {
+		close(fd);
+		return nullptr;
+	}
+	void *m = mmap(nullptr, map_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (m == MAP_FAILED)
+		return nullptr;
+	if (!valid(reinterpret_cast<const char *>(m))) {
+		munmap(m, map_size);
+		return nullptr;
+	}
+
+	rbase.store(reinterpret_cast<const char *>(m), memory_order_release);
+	return reinterpret_cast<const char *>(m);
+}
+
+
+bool lookup(const string &path, const string &name, uint16_t qtype, string &msg, uint32_t &left)
+{
+	char k[sizeof(slot::name)];
+	size_t nlen = key(name, k);
+	if (nlen == 0)
+		return 0;
+
+	const char *base = attach(path);
+	if (!base)
+		return 0;
+
+	const int64_t now = time(nullptr);
+	const slot *b = bucket(const_cast<char *>(base), k, nlen, qtype);
+
+	for (uint32_t i = 0; i < WAYS; ++i) {
+		const slot &s = b[i];
+
+		uint32_t seq = s.seq.load(memory_order_acquire);
+		if (seq & 1)
+			continue;
+
+		uint16_t len = s.len;
+		int64_t valid_until = s.valid_until;
+		if (s.qtype != qtype || s.nlen != nlen || len > sizeof(s.msg) || memcmp(s.name, k, nlen) != 0)
+			continue;
+		msg.assign(s.msg, len);
+
+		atomic_thread_fence(memory_order_acquire);
+		if (s.seq.load(memory_order_relaxed) != seq || valid_until <= now)
+			continue;
+
+		left = valid_until - now;
+		return 1;
+	}
+
+	return 0;
+}
+
+
+}
+
+}
+
@@ -0,0 +1,85 @@
+/*
+ * This file is part of harddns.
+ *
+ * (C) 2023 by Sebastian Krahmer,
+ *             sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * harddns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * harddns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with harddns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef harddns_shmcache_h
+#define harddns_shmcache_h
+
+#include <atomic>
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+
+namespace harddns {
+
+namespace shmcache {
+
+
+// Layout of the host-wide answer cache, in host byte order:
+//
+// header | nslots slots
+//
+// Only harddnsd writes to it, every process may map it read-only. A slot
+// holds the DNS answer that harddnsd sent for a lowercase name and qtype.
+// Its seq is odd while harddnsd writes the slot, so readers copy the slot
+// and take the copy if seq was even and did not change meanwhile. The
+// slots of a name are the WAYS slots of the bucket that its hash picks.
+struct header {
+	char magic[8];			// "HDNSSHC\0"
+	uint32_t version;		// also tells the byte order
+	uint32_t nslots;
+	std::atomic<uint32_t> retired;	// file was replaced, map the new one
+	uint32_t reserved[11];
+};
+
+struct slot {
+	std::atomic<uint32_t> seq;
+	uint16_t qtype, len;
+	int64_t valid_until;
+	uint8_t nlen;
+	char name[255];
+	char msg[752];
+};
+
+static_assert(sizeof(header) == 64 && sizeof(slot) == 1024, "shmcache layout");
+
+constexpr uint32_t VERSION = 1, NSLOTS = 4096, WAYS = 4;
+
+
+// harddnsd: creates the cache at path, or takes over a matching one, and
+// maps it writable. Must happen before the chroot.
+int create(const std::string &path, std::string &err);
+
+// harddnsd: stores the answer msg to name and qtype, valid for ttl
+// seconds. Names are lowercased and without trailing dot on both sides.
+void insert(const std::string &name, uint16_t qtype, const char *msg, size_t len, uint32_t ttl);
+
+// Copies a valid answer to msg and sets the seconds it's still valid. The
+// cache at path is mapped read-only on the first call, and again if
+// harddnsd replaced it. Not there or not readable just means no hits.
+bool lookup(const std::string &path, const std::string &name, uint16_t qtype, std::string &msg, uint32_t &left);
+
+
+}
+
+}
+
+#endif
+
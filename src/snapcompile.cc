@@ -0,0 +1,127 @@
+/*
+ * This file is part of harddns.
+ *
+ * (C) 2023 by Sebastian Krahmer,
+ *             sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * harddns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * harddns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with harddns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// harddns-snapshot: writes harddns.snap, from which the NSS module
+// takes its config and trust anchors instead of parsing everything
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <iostream>
+#include <unistd.h>
+#include "config.h"
+#include "ssl.h"
+#include "init.h"
+#include "snapshot.h"
+
+
+using namespace std;
+using namespace harddns;
+
+
+static void usage(const char *p)
+{
+	cout<<"\nUsage: "<<p<<" [-F cfg_base] [-o snapshot] [-n]\n\n"
+	    <<"\t-F\tconfig directory (default /etc/harddns)\n"
+	    <<"\t-o\tsnapshot to write (default cfg_base/harddns.snap)\n"
+	    <<"\t-n\tdon't connect to the upstreams to find their trust anchors,\n"
+	    <<"\t\tthe NSS module then loads the system CAs as usual\n\n"
+	    <<"Run again after harddns.conf or the pinned keys changed, the NSS module\n"
+	    <<"ignores outdated snapshots.\n\n";
+}
+
+
+int main(int argc, char **argv)
+{
+	string cfg_base = "/etc/harddns", out = "", err = "";
+	bool offline = 0;
+	int c = 0;
+
+	while ((c = getopt(argc, argv, "F:o:nh")) != -1) {
+		switch (c) {
+		case 'F':
+			cfg_base = optarg;
+			break;
+		case 'o':
+			out = optarg;
+			break;
+		case 'n':
+			offline = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (out.empty())
+		out = cfg_base + "/harddns.snap";
+
+	harddns_init(cfg_base);
+
+	if (!ssl_conn || !config::ns || config::ns->empty()) {
+		cerr<<"No usable config in "<<cfg_base<<"/harddns.conf\n";
+		return 1;
+	}
+
+	snapshot::trust trust;
+
+	// the pinned PEMs and pin_sha256's of the config
+	for (const auto &sha256 : ssl_conn->pins())
+		trust.pins.push_back(sha256);
+
+	// the roots that the upstreams are verified against today, which
+	// pin_only doesn't need at all
+	bool pin_only = config::pin_only && trust.pins.size() > 0;
+	trust.default_store = offline && !pin_only;
+	for (const auto &ns : *config::ns) {
+		if (offline || pin_only)
+			break;
+		auto cfg = config::ns_cfg->find(ns);
+		if (cfg == config::ns_cfg->end())
+			continue;
+
+		string early = "", der = "";
+		if (ssl_conn->connect(ns, cfg->second.port, early) < 0 || ssl_conn->anchor(der) < 0) {
+			cerr<<"Warning: "<<ns<<": "<<ssl_conn->why()<<", the snapshot will use the system CAs.\n";
+			trust.default_store = 1;
+		} else if (find(trust.anchors.begin(), trust.anchors.end(), der) == trust.anchors.end())
+			trust.anchors.push_back(der);
+		ssl_conn->close();
+	}
+
+	if (snapshot::compile(out, cfg_base, trust, err) < 0) {
+		cerr<<err<<endl;
+		harddns_fini();
+		return 1;
+	}
+
+	cout<<"Wrote "<<out<<": "<<config::ns->size()<<" upstreams, "<<trust.pins.size()<<" pinned keys, ";
+	if (pin_only)
+		cout<<"pin_only.\n";
+	else if (trust.default_store)
+		cout<<"system CAs.\n";
+	else
+		cout<<trust.anchors.size()<<" trust anchors.\n";
+
+	harddns_fini();
+	return 0;
+}
+
@@ -0,0 +1,366 @@
+/*
+ * This file is part of harddns.
+ *
+ * (C) 2023 by Sebastian Krahmer,
+ *             sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * harddns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * harddns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with harddns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <new>
+#include <map>
+#include <set>
+#include <list>
+#include <string>
+#include <vector>
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+#include <cstdint>
+#include <ftw.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "snapshot.h"
+#include "config.h"
+
+
+namespace harddns {
+
+namespace snapshot {
+
+using namespace std;
+
+
+enum record_type : uint8_t {
+	R_NS = 1,		// ip, cn, host, get, port, rfc8484
+	R_INTERNAL,		// domain, ns, nocache
+	R_OPTION,		// name, value
+	R_PIN,			// SHA-256 of a SPKI
+	R_ANCHOR,		// DER X509
+	R_DEFAULT_STORE		// no fields
+};
+
+// as used by load_certificates() in init.cc
+static const char *pinned_path = "/etc/harddns/pinned";
+
+
+// FNV-1a
+static uint64_t fnv1a(uint64_t h, const void *data, size_t len)
+{
+	const unsigned char *p = reinterpret_cast<const unsigned char *>(data);
+	for (size_t i = 0; i < len; ++i) {
+		h ^= p[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+
+static thread_local uint64_t pinned_sum = 0;
+
+// Every entry counts, so adding, removing, replacing or touching a file is
+// seen even within the same second. The hashes are summed up, so the order
+// nftw() walks in does not matter.
+static int pinned_walk(const char *path, const struct stat *st, int, struct FTW *)
+{
+	const uint64_t v[] = {
+		st->st_ino, static_cast<uint64_t>(st->st_size), st->st_mode,
+		static_cast<uint64_t>(st->st_mtim.tv_sec), static_cast<uint64_t>(st->st_mtim.tv_nsec),
+		static_cast<uint64_t>(st->st_ctim.tv_sec), static_cast<uint64_t>(st->st_ctim.tv_nsec)
+	};
+	uint64_t h = fnv1a(0xcbf29ce484222325ULL, path, strlen(path) + 1);
+	pinned_sum += fnv1a(h, v, sizeof(v));
+	return 0;
+}
+
+
+static void stamp(const string &cfg_base, header &hdr)
+{
+	struct stat st;
+
+	hdr.conf_ino = hdr.conf_size = 0;
+	hdr.conf_mtime = hdr.conf_mtime_ns = hdr.conf_ctime = hdr.conf_ctime_ns = 0;
+	if (stat((cfg_base + "/harddns.conf").c_str(), &st) == 0) {
+		hdr.conf_ino = st.st_ino;
+		hdr.conf_size = st.st_size;
+		hdr.conf_mtime = st.st_mtim.tv_sec;
+		hdr.conf_mtime_ns = st.st_mtim.tv_nsec;
+		hdr.conf_ctime = st.st_ctim.tv_sec;
+		hdr.conf_ctime_ns = st.st_ctim.tv_nsec;
+	}
+
+	// the same walk as load_certificates()
+	pinned_sum = 0;
+	nftw(pinned_path, pinned_walk, 1024, FTW_PHYS);
+	hdr.pinned_sum = pinned_sum;
+}
+
+
+static bool same_stamp(const header &a, const header &b)
+{
+	return a.conf_ino == b.conf_ino && a.conf_size == b.conf_size && a.conf_mtime == b.conf_mtime &&
+	       a.conf_mtime_ns == b.conf_mtime_ns && a.conf_ctime == b.conf_ctime && a.conf_ctime_ns == b.conf_ctime_ns &&
+	       a.pinned_sum == b.pinned_sum;
+}
+
+
+class writer {
+
+	string d_buf{""};
+
+	uint32_t d_n{0};
+
+public:
+
+	void record(record_type t, const vector<string> &fields)
+	{
+		d_buf += static_cast<char>(t);
+		d_buf += static_cast<char>(fields.size());
+		for (const auto &f : fields) {
+			uint32_t len = f.size();
+			d_buf.append(reinterpret_cast<const char *>(&len), sizeof(len));
+			d_buf += f;
+		}
+		++d_n;
+	}
+
+	const string &data()
+	{
+		return d_buf;
+	}
+
+	uint32_t records()
+	{
+		return d_n;
+	}
+};
+
+
+int compile(const string &path, const string &cfg_base, const trust &t, string &err)
+{
+	if (!config::ns || !config::ns_cfg) {
+		err = "snapshot::compile: No config.";
+		return -1;
+	}
+
+	writer w;
+
+	for (const auto &ns : *config::ns) {
+		auto it = config::ns_cfg->find(ns);
+		if (it == config::ns_cfg->end())
+			continue;
+		const auto &c = it->second;
+		w.record(R_NS, {c.ip, c.cn, c.host, c.get, string(reinterpret_cast<const char *>(&c.port), sizeof(c.port)), string(1, c.rfc8484)});
+	}
+
+	for (const auto &d : config::internal_domains)
+		w.record(R_INTERNAL, {d.first, d.second, string(1, config::internal_nocache.count(d.first) > 0)});
+
+	w.record(R_OPTION, {"log_requests", config::log_requests ? "1" : "0"});
+	w.record(R_OPTION, {"nss_aaaa", config::nss_aaaa ? "1" : "0"});
+	w.record(R_OPTION, {"pin_only", config::pin_only ? "1" : "0"});
+	w.record(R_OPTION, {"cache_PTR", config::cache_PTR ? "1" : "0"});
+	w.record(R_OPTION, {"slow_query_ms", to_string(config::slow_query_ms.load())});
+	w.record(R_OPTION, {"forward_timeout_ms", to_string(config::forward_timeout_ms)});
+	w.record(R_OPTION, {"forward_retries", to_string(config::forward_retries)});
+	w.record(R_OPTION, {"nss_cache", to_string(config::nss_cache)});
+	w.record(R_OPTION, {"nss_max_conns", to_string(config::nss_max_conns)});
+
+	const pair<const char *, string *> strings[] = {
+		{"cafile", config::cafile}, {"stats_socket", config::stats_socket}, {"qlog", config::qlog}, {"blocklist", config::blocklist},
+		{"nss_socket", config::nss_socket}, {"shared_cache", config::shared_cache}
+	};
+	for (const auto &s : strings) {
+		if (s.second)
+			w.record(R_OPTION, {s.first, *s.second});
+	}
+
+	for (const auto &p : t.pins)
+		w.record(R_PIN, {p});
+	for (const auto &a : t.anchors)
+		w.record(R_ANCHOR, {a});
+	if (t.default_store)
+		w.record(R_DEFAULT_STORE, {});
+
+	header hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, "HDNSSNP\0", sizeof(hdr.magic));
+	hdr.version = VERSION;
+	hdr.nrecords = w.records();
+	stamp(cfg_base, hdr);
+
+	string tmp = path + ".tmp";
+	int fd = open(tmp.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (fd < 0) {
+		err = "snapshot::compile::open:" + string(strerror(errno));
+		return -1;
+	}
+	string out(reinterpret_cast<const char *>(&hdr), sizeof(hdr));
+	out += w.data();
+	if (write(fd, out.c_str(), out.size()) != (ssize_t)out.size() || fsync(fd) < 0) {
+		err = "snapshot::compile::write:" + string(strerror(errno));
+		close(fd);
+		unlink(tmp.c_str());
+		return -1;
+	}
+	close(fd);
+
+	if (rename(tmp.c_str(), path.c_str()) < 0) {
+		err = "snapshot::compile::rename:" + string(strerror(errno));
+		unlink(tmp.c_str());
+		return -1;
+	}
+	return 0;
+}
+
+
+int load(const string &path, const string &cfg_base, trust &t, string &err)
+{
+	int fd = open(path.c_str(), O_RDONLY|O_CLOEXEC);
+	if (fd < 0) {
+		err = "snapshot::load::open:" + string(strerror(errno));
+		return -1;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(header)) {
+		close(fd);
+		err = "snapshot::load: Invalid snapshot " + path;
+		return -1;
+	}
+
+	size_t len = st.st_size;
+	void *base = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		err = "snapshot::load::mmap:" + string(strerror(errno));
+		return -1;
+	}
+
+	const char *ptr = reinterpret_cast<const char *>(base), *end = ptr + len;
+	const header *hdr = reinterpret_cast<const header *>(base);
+
+	header now;
+	stamp(cfg_base, now);
+
+	if (memcmp(hdr->magic, "HDNSSNP\0", sizeof(hdr->magic)) != 0 || hdr->version != VERSION) {
+		munmap(base, len);
+		err = "snapshot::load: Not a snapshot or wrong version/byte order: " + path;
+		return -1;
+	}
+	if (!same_stamp(*hdr, now)) {
+		munmap(base, len);
+		err = "snapshot::load: Snapshot is older than the config: " + path;
+		return -1;
+	}
+
+	list<string> ns;
+	map<string, config::a_ns_cfg> ns_cfg;
+	map<string, string> internal_domains;
+	set<string> internal_nocache;
+	map<string, string> options;
+	trust tr;
+
+	const char *p = ptr + sizeof(header);
+	vector<string> f;
+	uint32_t i = 0;
+	for (; i < hdr->nrecords; ++i) {
+		if (end - p < 2)
+			break;
+		uint8_t type = p[0], nf = p[1];
+		p += 2;
+
+		f.clear();
+		for (uint8_t j = 0; j < nf; ++j) {
+			uint32_t flen = 0;
+			if ((size_t)(end - p) < sizeof(flen))
+				break;
+			memcpy(&flen, p, sizeof(flen));
+			p += sizeof(flen);
+			if ((size_t)(end - p) < flen)
+				break;
+			f.emplace_back(p, flen);
+			p += flen;
+		}
+		if (f.size() != nf)
+			break;
+
+		if (type == R_NS && nf == 6 && f[4].size() == sizeof(uint16_t) && f[5].size() == 1) {
+			config::a_ns_cfg c{f[0], f[1], f[2], f[3], 0, f[5][0] != 0, (unsigned int)ns_cfg.size()};
+			memcpy(&c.port, f[4].c_str(), sizeof(c.port));
+			ns.push_back(f[0]);
+			ns_cfg.insert(make_pair(f[0], c));
+		} else if (type == R_INTERNAL && nf == 3 && f[2].size() == 1) {
+			internal_domains[f[0]] = f[1];
+			if (f[2][0])
+				internal_nocache.insert(f[0]);
+		} else if (type == R_OPTION && nf == 2)
+			options[f[0]] = f[1];
+		else if (type == R_PIN && nf == 1)
+			tr.pins.push_back(f[0]);
+		else if (type == R_ANCHOR && nf == 1)
+			tr.anchors.push_back(f[0]);
+		else if (type == R_DEFAULT_STORE && nf == 0)
+			tr.default_store = 1;
+		else
+			break;
+	}
+
+	bool complete = i == hdr->nrecords && p == end;
+	munmap(base, len);
+
+	if (!complete) {
+		err = "snapshot::load: Corrupt snapshot " + path;
+		return -1;
+	}
+
+	if (!(config::ns = new (nothrow) list<string>(ns)) || !(config::ns_cfg = new (nothrow) map<string, config::a_ns_cfg>(ns_cfg))) {
+		err = "snapshot::load: OOM";
+		return -1;
+	}
+	config::internal_domains = internal_domains;
+	config::internal_nocache = internal_nocache;
+	config::log_requests = options["log_requests"] == "1";
+	config::nss_aaaa = options["nss_aaaa"] == "1";
+	config::pin_only = options["pin_only"] == "1";
+	config::cache_PTR = options["cache_PTR"] == "1";
+	config::slow_query_ms = strtoul(options["slow_query_ms"].c_str(), nullptr, 10);
+	config::forward_timeout_ms = strtoul(options["forward_timeout_ms"].c_str(), nullptr, 10);
+	config::forward_retries = strtoul(options["forward_retries"].c_str(), nullptr, 10);
+	if (options.count("nss_cache"))
+		config::nss_cache = strtoul(options["nss_cache"].c_str(), nullptr, 10);
+	if (options.count("nss_max_conns"))
+		config::nss_max_conns = strtoul(options["nss_max_conns"].c_str(), nullptr, 10);
+
+	const pair<const char *, string **> strings[] = {
+		{"cafile", &config::cafile}, {"stats_socket", &config::stats_socket}, {"qlog", &config::qlog}, {"blocklist", &config::blocklist},
+		{"nss_socket", &config::nss_socket}, {"shared_cache", &config::shared_cache}
+	};
+	for (const auto &s : strings) {
+		auto it = options.find(s.first);
+		if (it != options.end())
+			*s.second = new (nothrow) string(it->second);
+	}
+
+	t = tr;
+	return 0;
+}
+
+
+}
+
+}
+
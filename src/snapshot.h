@@ -0,0 +1,75 @@
+/*
+ * This file is part of harddns.
+ *
+ * (C) 2023 by Sebastian Krahmer,
+ *             sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * harddns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * harddns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with harddns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef harddns_snapshot_h
+#define harddns_snapshot_h
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+
+namespace harddns {
+
+namespace snapshot {
+
+
+// Layout of harddns.snap, in host byte order:
+//
+// header | records
+//
+// with each record being a type byte, a field count byte and the fields,
+// each as uint32_t length and data. The stat() data of harddns.conf and of
+// everything below the pinned directory tell whether the snapshot is still
+// up to date.
+struct header {
+	char magic[8];		// "HDNSSNP\0"
+	uint32_t version;	// also tells the byte order
+	uint32_t nrecords;
+	uint64_t conf_ino, conf_size;
+	uint64_t conf_mtime, conf_mtime_ns, conf_ctime, conf_ctime_ns;
+	uint64_t pinned_sum;	// hash of name, inode, size, mtime and ctime of each pinned file
+};
+
+constexpr uint32_t VERSION = 3;
+
+// what the snapshot holds besides the config
+struct trust {
+	std::vector<std::string> anchors;	// DER certificates to verify the upstreams
+	std::vector<std::string> pins;		// SHA-256 of the SubjectPublicKeyInfo of the pinned keys
+	bool default_store{0};			// the anchors are incomplete, use the system CAs
+};
+
+
+// Writes the current config:: values and t to path, replacing it atomically
+int compile(const std::string &path, const std::string &cfg_base, const trust &t, std::string &err);
+
+// Sets the config:: values from the snapshot at path and fills t, if the
+// snapshot matches the current harddns.conf of cfg_base. The config is
+// only touched if it does.
+int load(const std::string &path, const std::string &cfg_base, trust &t, std::string &err);
+
+
+}
+
+}
+
+#endif
+
@@ -34,7 +34,9 @@
 #include <syslog.h>
 #include "ssl.h"
 #include "misc.h"
+#include "base64.h"
 #include "config.h"
+#include "stats.h"
 
 extern "C" {
 #include <openssl/ssl.h>
@@ -42,6 +44,7 @@ extern "C" {
 #include <openssl/evp.h>
 #include <openssl/err.h>
 #include <openssl/asn1.h>
+#include <openssl/sha.h>
 }
 
 
@@ -105,9 +108,6 @@ ssl_box::ssl_box()
 
 ssl_box::~ssl_box()
 {
-	for (auto p : d_pinned) {
-		EVP_PKEY_free(p);
-	}
 	if (d_ssl)
 		SSL_free(d_ssl);
 	if (d_ssl_ctx)
@@ -116,7 +116,71 @@ ssl_box::~ssl_box()
 }
 
 
-int ssl_box::setup_ctx()
+static string spki_sha256(X509_PUBKEY *pub)
+{
+	unsigned char *der = nullptr, md[SHA256_DIGEST_LENGTH];
+	int len = i2d_X509_PUBKEY(pub, &der);
+	if (len <= 0)
+		return "";
+	SHA256(der, len, md);
+	OPENSSL_free(der);
+	return string(reinterpret_cast<char *>(md), sizeof(md));
+}
+
+
+void ssl_box::add_pinned(EVP_PKEY *evp)
+{
+	unsigned char *der = nullptr, md[SHA256_DIGEST_LENGTH];
+	int len = i2d_PUBKEY(evp, &der);
+	if (len > 0) {
+		SHA256(der, len, md);
+		OPENSSL_free(der);
+		d_pins.insert(string(reinterpret_cast<char *>(md), sizeof(md)));
+	}
+	EVP_PKEY_free(evp);
+}
+
+
+bool ssl_box::pinned(X509 *x509)
+{
+	return x509 && d_pins.count(spki_sha256(X509_get_X509_PUBKEY(x509))) > 0;
+}
+
+
+// Replaces X509_verify_cert() for the handshake. With pin_only, a pinned
+// leaf key is all that's checked, as the handshake proves that the peer
+// owns it. The other certificates that it sent are not verified and
+// therefore not looked at.
+int ssl_box::verify_cb(X509_STORE_CTX *ctx, void *arg)
+{
+	ssl_box *box = reinterpret_cast<ssl_box *>(arg);
+
+	if (box->d_pin_only && !box->d_pins.empty()) {
+		if (box->pinned(X509_STORE_CTX_get0_cert(ctx)))
+			return 1;
+		X509_STORE_CTX_set_error(ctx, X509_V_ERR_CERT_REJECTED);
+		return 0;
+	}
+
+	return X509_verify_cert(ctx);
+}
+
+
+int ssl_box::setup_ctx(const ssl_box &parent)
+{
+	if (!parent.d_ssl_ctx || SSL_CTX_up_ref(parent.d_ssl_ctx) != 1)
+		return build_error("setup_ctx: Parent has no SSL_CTX.", -1);
+
+	// verify_cb() is called with parent and its pins, which are the same
+	d_ssl_ctx = parent.d_ssl_ctx;
+	d_pins = parent.d_pins;
+	d_pin_only = parent.d_pin_only;
+	d_sessions = parent.d_sessions;
+	return 0;
+}
+
+
+int ssl_box::setup_ctx(const vector<string> *anchors)
 {
 	const SSL_METHOD *method = nullptr;
 
@@ -142,25 +206,53 @@ int ssl_box::setup_ctx()
 	if ((unsigned long)(SSL_CTX_set_options(d_ssl_ctx, op) & op) != (unsigned long)op)
 		return build_error("SSL_CTX_set_options:", -1);
 
-	struct stat st;
-	const char *cafile = "/etc/ssl/cert.pem";
-	if (stat(cafile, &st) < 0) {
-		cafile = "/etc/openssl/cert.pem";
-		if (stat(cafile, &st) < 0)
-			cafile = nullptr;
-	}
+	if (anchors) {
+		// parsing the CA bundle is what makes a cold start slow
+		X509_STORE *store = SSL_CTX_get_cert_store(d_ssl_ctx);
+		for (const auto &der : *anchors) {
+			const unsigned char *p = reinterpret_cast<const unsigned char *>(der.c_str());
+			free_ptr<X509> x509(d2i_X509(nullptr, &p, der.size()), X509_free);
+			if (!x509.get() || X509_STORE_add_cert(store, x509.get()) != 1)
+				return build_error("setup_ctx: Invalid trust anchor", -1);
+		}
+	} else {
+		struct stat st;
+		const char *cafile = "/etc/ssl/cert.pem";
+		if (stat(cafile, &st) < 0) {
+			cafile = "/etc/openssl/cert.pem";
+			if (stat(cafile, &st) < 0)
+				cafile = nullptr;
+		}
 
-	if (SSL_CTX_load_verify_locations(d_ssl_ctx, cafile, "/etc/ssl/certs") != 1)
-		return build_error("SSL_CTX_load_verify_locations:", -1);
+		if (SSL_CTX_load_verify_locations(d_ssl_ctx, cafile, "/etc/ssl/certs") != 1)
+			return build_error("SSL_CTX_load_verify_locations:", -1);
 
-	if (SSL_CTX_load_verify_locations(d_ssl_ctx, nullptr, "/etc/openssl/certs") != 1)
+		if (SSL_CTX_load_verify_locations(d_ssl_ctx, nullptr, "/etc/openssl/certs") != 1)
+			return build_error("SSL_CTX_load_verify_locations:", -1);
+
+		if (SSL_CTX_set_default_verify_paths(d_ssl_ctx) != 1)
+			return build_error("SSL_CTX_set_default_verify_dirs: %s\n", -1);
+	}
+
+	if (config::cafile && SSL_CTX_load_verify_locations(d_ssl_ctx, config::cafile->c_str(), nullptr) != 1)
 		return build_error("SSL_CTX_load_verify_locations:", -1);
 
-	if (SSL_CTX_set_default_verify_paths(d_ssl_ctx) != 1)
-		return build_error("SSL_CTX_set_default_verify_dirs: %s\n", -1);
+	// "pin_sha256 = base64" as in HPKP. A broken pin must not silently
+	// weaken verification, so no ctx means no connects.
+	for (const auto &b64 : config::pin_sha256) {
+		string sha256 = "";
+		if (b64_decode(b64, sha256).size() != SHA256_DIGEST_LENGTH) {
+			SSL_CTX_free(d_ssl_ctx);
+			d_ssl_ctx = nullptr;
+			return build_error("setup_ctx: Invalid pin_sha256 " + b64, -1);
+		}
+		d_pins.insert(sha256);
+	}
+	d_pin_only = config::pin_only;
 
 	SSL_CTX_set_verify(d_ssl_ctx, SSL_VERIFY_PEER|SSL_VERIFY_FAIL_IF_NO_PEER_CERT, nullptr);
 	SSL_CTX_set_verify_depth(d_ssl_ctx, 100);
+	SSL_CTX_set_cert_verify_callback(d_ssl_ctx, verify_cb, this);
 
 	SSL_CTX_set_mode(d_ssl_ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER|SSL_MODE_ENABLE_PARTIAL_WRITE);
 
@@ -239,21 +331,30 @@ int ssl_box::connect(const string &host, uint16_t port, string &early_data, long
 	if (getsockopt(d_sock, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err < 0)
 		return build_error("connect_ssl::getsockopt:", -1);
 
+	// With TCP_FASTOPEN_CONNECT the SYN only leaves along with the ClientHello,
+	// so the TCP RTT is accounted to the TLS handshake then
+	d_tcp_done = stats::now_us();
+
 	if ((d_ssl = SSL_new(d_ssl_ctx)) == nullptr)
 		return -1;
 	SSL_set_fd(d_ssl, d_sock);
 
 	uint32_t max_early = 0;
 
-	auto it = d_sessions.find(d_ns_ip);
-	if (it != d_sessions.end() && SSL_SESSION_is_resumable(it->second)) {
-		if (SSL_set_session(d_ssl, it->second) != 1)
-			return build_error("connect_ssl::SSL_set_session:", -1);
-		if (config::log_requests)
-			syslog(LOG_INFO, "TLS session ticket found for %s", d_ns_ip.c_str());
+	{
+		lock_guard<mutex> g(d_sessions->mtx);
 
-		if constexpr (WANT_TLS_0RTT)
-			max_early = SSL_SESSION_get_max_early_data(it->second);
+		auto it = d_sessions->by_ns.find(d_ns_ip);
+		if (it != d_sessions->by_ns.end() && SSL_SESSION_is_resumable(it->second)) {
+			if (SSL_set_session(d_ssl, it->second) != 1)
+				return build_error("connect_ssl::SSL_set_session:", -1);
+			d_offered = 1;
+			if (config::log_requests)
+				syslog(LOG_INFO, "TLS session ticket found for %s", d_ns_ip.c_str());
+
+			if constexpr (WANT_TLS_0RTT)
+				max_early = SSL_SESSION_get_max_early_data(it->second);
+		}
 	}
 
 	if constexpr (WANT_TLS_0RTT) {
@@ -308,28 +409,23 @@ int ssl_box::connect(const string &host, uint16_t port, string &early_data, long
 	if (post_connection_check(x509.get(), d_ns_ip, cn) != 1)
 		return build_error("connect_ssl::SSL Post connection check failed. CN mismatch:" + cn, -1);
 
-	if (d_pinned.size() > 0) {
-		EVP_PKEY *peer_key = X509_get_pubkey(x509.get());
-
-		if (!peer_key)
-			return build_error("connect_ssl::No key inside peer X509?!", -1);
-
+	// Any key of the verified chain may be pinned. A resumed session has no
+	// verified chain, and the certs that the peer sent along are not proof
+	// of anything. It passed the pin check when it was stored though.
+	if (!d_pins.empty() && !pinned(x509.get())) {
 		bool has = 0;
-		for (auto p : d_pinned) {
-#if OPENSSL_VERSION_NUMBER >= 0x30000000L
-			if (EVP_PKEY_eq(p, peer_key) == 1)
-#else
-			if (EVP_PKEY_cmp(p, peer_key) == 1)
-#endif
-				has = 1;
+		if (SSL_session_reused(d_ssl) == 1)
+			has = d_offered;
+		else if (STACK_OF(X509) *chain = SSL_get0_verified_chain(d_ssl)) {
+			for (int i = 0; i < sk_X509_num(chain) && !has; ++i)
+				has = pinned(sk_X509_value(chain, i));
 		}
 
-		EVP_PKEY_free(peer_key);
-
-		if (has != 1)
+		if (!has)
 			return build_error("connect_ssl::Peer X509 not in pinned list!", -1);
 	}
 
+	d_trusted = 1;
 	return 0;
 }
 
@@ -341,11 +437,16 @@ void ssl_box::close()
 		// If there ever was a session ticket negotiated
 		// by client and server, it will be available at this point.
 		// This avoids the usage of SSL_CTX_sess_set_new_cb() which
-		// would have no access to class member data.
-		auto it = d_sessions.find(d_ns_ip);
-		if (it != d_sessions.end())
+		// would have no access to class member data. A connect() that
+		// failed drops the session of that upstream instead.
+		lock_guard<mutex> g(d_sessions->mtx);
+		auto it = d_sessions->by_ns.find(d_ns_ip);
+		if (it != d_sessions->by_ns.end()) {
 			SSL_SESSION_free(it->second);
-		d_sessions[d_ns_ip] = SSL_get1_session(d_ssl);
+			d_sessions->by_ns.erase(it);
+		}
+		if (d_trusted)
+			d_sessions->by_ns[d_ns_ip] = SSL_get1_session(d_ssl);
 		SSL_shutdown(d_ssl);
 		SSL_free(d_ssl);
 	}
@@ -356,10 +457,51 @@ void ssl_box::close()
 	d_sock = -1;
 
 	d_ns_ip = "";
+	d_trusted = d_offered = 0;
+}
+
+
+int ssl_box::anchor(string &der)
+{
+	if (!d_ssl)
+		return build_error("anchor: Not connected.", -1);
+
+	STACK_OF(X509) *chain = SSL_get0_verified_chain(d_ssl);
+	if (!chain || sk_X509_num(chain) < 1)
+		return build_error("anchor: No verified chain.", -1);
+
+	X509 *top = sk_X509_value(chain, sk_X509_num(chain) - 1);
+	unsigned char *buf = nullptr;
+	int len = i2d_X509(top, &buf);
+	if (len <= 0)
+		return build_error("anchor::i2d_X509:", -1);
+	der.assign(reinterpret_cast<char *>(buf), len);
+	OPENSSL_free(buf);
+	return 0;
+}
+
+
+void ssl_box::forget(const string &ns)
+{
+	if (d_ns_ip == ns)
+		this->close();
+
+	lock_guard<mutex> g(d_sessions->mtx);
+	auto it = d_sessions->by_ns.find(ns);
+	if (it != d_sessions->by_ns.end()) {
+		SSL_SESSION_free(it->second);
+		d_sessions->by_ns.erase(it);
+	}
 }
 
 
 ssize_t ssl_box::send(const string &buf, long to)
+{
+	return this->send(buf.c_str(), buf.size(), to);
+}
+
+
+ssize_t ssl_box::send(const char *buf, size_t blen, long to)
 {
 	if (!d_ssl)
 		return -1;
@@ -369,7 +511,7 @@ ssize_t ssl_box::send(const string &buf, long to)
 	timespec ts = {0, 10000000};	// 10ms
 
 	for (;waiting < to;) {
-		r = SSL_write(d_ssl, buf.c_str() + written, buf.size() - written);
+		r = SSL_write(d_ssl, buf + written, blen - written);
 
 		switch (SSL_get_error(d_ssl, r)) {
 		case SSL_ERROR_NONE:
@@ -390,7 +532,7 @@ ssize_t ssl_box::send(const string &buf, long to)
 		} else if (r > 0)
 			written += r;
 
-		if (written == (int)buf.size())
+		if (written == (int)blen)
 			break;
 	}
 
@@ -400,13 +542,24 @@ ssize_t ssl_box::send(const string &buf, long to)
 
 ssize_t ssl_box::recv(string &s, long to)
 {
+	char buf[4096];
+
 	s = "";
 
-	if (!d_ssl)
+	ssize_t r = this->recv(buf, sizeof(buf), to);
+	if (r > 0)
+		s = string(buf, r);
+
+	return r;
+}
+
+
+ssize_t ssl_box::recv(char *buf, size_t blen, long to)
+{
+	if (!d_ssl || blen == 0)
 		return -1;
 
 	int r = 0;
-	char buf[4096] = {0};
 	long us = to/(1000*2);	// half TO for select, other for potential repeated read's
 	long waiting = 0;
 	timeval tv = {(time_t)us/1000000, (suseconds_t)us%1000000};
@@ -423,7 +576,7 @@ ssize_t ssl_box::recv(string &s, long to)
 	}
 
 	for (; waiting < to/2;) {
-		r = SSL_read(d_ssl, buf, sizeof(buf) - 1);
+		r = SSL_read(d_ssl, buf, blen);
 		switch (SSL_get_error(d_ssl, r)) {
 		case SSL_ERROR_NONE:
 			break;
@@ -444,9 +597,6 @@ ssize_t ssl_box::recv(string &s, long to)
 			break;
 	}
 
-	if (r > 0)
-		s = string(buf, r);
-
 	return r;
 }
 
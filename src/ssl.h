@@ -27,6 +27,8 @@
 #include <cstdio>
 #include <string>
 #include <memory>
+#include <mutex>
+#include <unordered_set>
 #include <cstring>
 #include <stdint.h>
 
@@ -47,14 +49,43 @@ class ssl_box {
 private:
 	int d_sock{-1};
 
-	std::vector<EVP_PKEY *> d_pinned;
+	// SHA-256 of the DER SubjectPublicKeyInfo of the pinned keys
+	std::unordered_set<std::string> d_pins;
+
+	// a pinned leaf key is enough, no chain building
+	bool d_pin_only{0};
+
 	SSL_CTX *d_ssl_ctx{nullptr};
 	SSL *d_ssl{nullptr};
 
-	std::map<std::string, SSL_SESSION *> d_sessions;
+	// session tickets by upstream, shared with the siblings of a box
+	struct sessions {
+		std::mutex mtx;
+		std::map<std::string, SSL_SESSION *> by_ns;
+
+		~sessions()
+		{
+			for (auto &s : by_ns)
+				SSL_SESSION_free(s.second);
+		}
+	};
+
+	std::shared_ptr<sessions> d_sessions{std::make_shared<sessions>()};
+
+	// Only a connection that passed verification, CN and pin check leaves
+	// its session to resume. So a resumed session was pinned when its full
+	// handshake happened.
+	bool d_trusted{0}, d_offered{0};
 
 	std::string d_err{""}, d_ns_ip{""};
 
+	// monotonic us when the TCP connect of the last connect() completed
+	uint64_t d_tcp_done{0};
+
+	static int verify_cb(X509_STORE_CTX *, void *);
+
+	bool pinned(X509 *);
+
 	template<class T>
 	T build_error(const std::string &msg, T r)
 	{
@@ -85,12 +116,29 @@ public:
 		return d_err.c_str();
 	}
 
-	void add_pinned(EVP_PKEY *evp)
+	// takes ownership
+	void add_pinned(EVP_PKEY *evp);
+
+	// raw SHA-256 of a SubjectPublicKeyInfo
+	void add_pin(const std::string &sha256)
+	{
+		d_pins.insert(sha256);
+	}
+
+	const std::unordered_set<std::string> &pins()
 	{
-		d_pinned.push_back(evp);
+		return d_pins;
 	}
 
-	int setup_ctx();
+	// Trusts the system CAs, or only the given DER certificates, as
+	// taken from a snapshot. The cafile and pin_sha256's of the config are
+	// added in any case.
+	int setup_ctx(const std::vector<std::string> *anchors = nullptr);
+
+	// Makes this box a sibling of parent, which has to be set up and has to
+	// outlive it. Siblings share the SSL_CTX, pins and session tickets, but
+	// each has a connection of its own.
+	int setup_ctx(const ssl_box &parent);
 
 	// 1s
 	int connect(const std::string &, uint16_t, std::string&, long to = 1000000000);
@@ -98,14 +146,38 @@ public:
 	// 1s
 	ssize_t send(const std::string &, long to = 1000000000);
 
+	ssize_t send(const char *, size_t, long to = 1000000000);
+
 	ssize_t recv(std::string &, long to = 1000000000);
 
+	// recv into caller provided buffer, no allocation
+	ssize_t recv(char *, size_t, long to = 1000000000);
+
 	void close();
 
+	// DER of the trust anchor that the peer of the current connection
+	// was verified against
+	int anchor(std::string &der);
+
+	// Closes the connection to ns if there is one and drops its session,
+	// for upstreams that were removed or changed by a config reload
+	void forget(const std::string &ns);
+
 	std::string peer()
 	{
 		return d_ns_ip;
 	}
+
+	uint64_t tcp_connected_at()
+	{
+		return d_tcp_done;
+	}
+
+	// whether the last connect() resumed a session
+	bool resumed()
+	{
+		return d_ssl && SSL_session_reused(d_ssl) == 1;
+	}
 };
 
 
@@ -0,0 +1,430 @@
+/*
+ * This file is part of harddns.
+ *
+ * (C) 2023 by Sebastian Krahmer,
+ *             sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * harddns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * harddns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with harddns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <new>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "stats.h"
+#include "config.h"
+#include "ring.h"
+
+
+namespace harddns {
+
+namespace stats {
+
+using namespace std;
+
+
+static atomic<shard *> shards{nullptr};
+
+static cell gauges[N_GAUGES];
+
+static mpmc_ring<query_timing, 1024> timings;
+
+static atomic<bool> has_drainer{0};
+
+// "upstream=..." label per upstream slot, read by the exporter thread
+static mutex labels_mtx;
+static string upstream_labels[MAX_UPSTREAMS];
+
+
+#ifdef NSS_MODULE
+
+// Nothing scrapes the counters inside the processes that load the NSS module,
+// so their threads all write to the same shard rather than leaving one each.
+static shard sink;
+
+shard *new_shard()
+{
+	return &sink;
+}
+
+#else
+
+shard *new_shard()
+{
+	shard *s = new shard();
+
+	// lock-free push to the front, shards are never unlinked
+	s->next = shards.load(memory_order_relaxed);
+	while (!shards.compare_exchange_weak(s->next, s, memory_order_release, memory_order_relaxed))
+		;
+	return s;
+}
+
+#endif
+
+
+void set(gauge g, uint64_t v)
+{
+	gauges[g].store(v, memory_order_relaxed);
+}
+
+
+void submit(const query_timing &t)
+{
+	if (!timings.push(t))
+		inc(TIMINGS_DROPPED);
+
+	// The NSS module doesn't start threads inside foreign processes, so it
+	// drains inline
+	if (!has_drainer.load(memory_order_relaxed))
+		drain();
+}
+
+
+static const char *stage_names[N_STAGES] = {"connect", "tls", "send", "first_byte", "http", "parse"};
+
+
+void drain()
+{
+	query_timing t;
+	shard &s = local();
+
+	while (timings.pop(t)) {
+		for (unsigned int i = t.connected ? STAGE_CONNECT : STAGE_SEND; i < N_STAGES; ++i)
+			record(s.stage_latency[i], t.stage_us[i]);
+
+		if (config::slow_query_ms == 0 || t.total_us < config::slow_query_ms*1000)
+			continue;
+
+		syslog(LOG_INFO, "slow query %s (type %u) via %s%s: %uus total, connect %uus tls %uus send %uus first byte %uus http %uus parse %uus",
+		       t.name, t.qtype, t.upstream, t.ok ? "" : " (failed)", t.total_us, t.stage_us[STAGE_CONNECT], t.stage_us[STAGE_TLS],
+		       t.stage_us[STAGE_SEND], t.stage_us[STAGE_FIRST_BYTE], t.stage_us[STAGE_HTTP], t.stage_us[STAGE_PARSE]);
+	}
+}
+
+
+void start_drainer()
+{
+	has_drainer = 1;
+	thread([] {
+		timespec ts = {0, 100000000};	// 100ms
+		for (;;) {
+			drain();
+			nanosleep(&ts, nullptr);
+		}
+	}).detach();
+}
+
+
+// plain sum over all shards
+struct snapshot {
+	uint64_t counters[N_COUNTERS]{0}, rcodes[16]{0};
+	uint64_t upstream[MAX_UPSTREAMS][N_UP_COUNTERS]{{0}};
+
+	struct {
+		uint64_t buckets[HIST_BUCKETS]{0}, sum_us{0}, count{0};
+	} latency[N_SOURCES], upstream_latency[MAX_UPSTREAMS], stage_latency[N_STAGES];
+};
+
+
+template<class H1, class H2>
+static void sum(H1 &dst, const H2 &src)
+{
+	for (unsigned int i = 0; i < HIST_BUCKETS; ++i)
+		dst.buckets[i] += src.buckets[i].load(memory_order_relaxed);
+	dst.sum_us += src.sum_us.load(memory_order_relaxed);
+	dst.count += src.count.load(memory_order_relaxed);
+}
+
+
+static void take(snapshot &snap)
+{
+	for (shard *s = shards.load(memory_order_acquire); s; s = s->next) {
+		for (unsigned int i = 0; i < N_COUNTERS; ++i)
+			snap.counters[i] += s->counters[i].load(memory_order_relaxed);
+		for (unsigned int i = 0; i < 16; ++i)
+			snap.rcodes[i] += s->rcodes[i].load(memory_order_relaxed);
+		for (unsigned int i = 0; i < N_SOURCES; ++i)
+			sum(snap.latency[i], s->latency[i]);
+		for (unsigned int i = 0; i < MAX_UPSTREAMS; ++i) {
+			for (unsigned int j = 0; j < N_UP_COUNTERS; ++j)
+				snap.upstream[i][j] += s->upstream[i][j].load(memory_order_relaxed);
+			sum(snap.upstream_latency[i], s->upstream_latency[i]);
+		}
+		for (unsigned int i = 0; i < N_STAGES; ++i)
+			sum(snap.stage_latency[i], s->stage_latency[i]);
+	}
+}
+
+
+// upper bound of a bucket in us
+static uint64_t bucket_le(unsigned int idx)
+{
+	if (idx < HIST_SUB)
+		return idx;
+	unsigned int g = idx/HIST_SUB, m = idx % HIST_SUB;
+	return ((uint64_t)(HIST_SUB + m + 1)<<(g - 1)) - 1;
+}
+
+
+template<class H>
+static void print_histogram(string &out, const char *name, const string &labels, const H &h)
+{
+	char buf[256];
+	uint64_t cumulative = 0;
+	string sep = labels.empty() ? "" : ",";
+
+	for (unsigned int i = 0; i < HIST_BUCKETS; ++i) {
+		cumulative += h.buckets[i];
+		snprintf(buf, sizeof(buf), "%s_bucket{%s%sle=\"%g\"} %llu\n", name, labels.c_str(), sep.c_str(),
+		         bucket_le(i)/1e6, (unsigned long long)cumulative);
+		out += buf;
+	}
+	snprintf(buf, sizeof(buf), "%s_bucket{%s%sle=\"+Inf\"} %llu\n%s_sum{%s} %g\n%s_count{%s} %llu\n",
+	         name, labels.c_str(), sep.c_str(), (unsigned long long)h.count, name, labels.c_str(), h.sum_us/1e6,
+	         name, labels.c_str(), (unsigned long long)h.count);
+	out += buf;
+}
+
+
+static void print_metric(string &out, const char *name, const string &labels, uint64_t v)
+{
+	char buf[256];
+	if (labels.empty())
+		snprintf(buf, sizeof(buf), "%s %llu\n", name, (unsigned long long)v);
+	else
+		snprintf(buf, sizeof(buf), "%s{%s} %llu\n", name, labels.c_str(), (unsigned long long)v);
+	out += buf;
+}
+
+
+static void print_help(string &out, const char *name, const char *type, const char *help)
+{
+	out += "# HELP ";
+	out += name;
+	out += " ";
+	out += help;
+	out += "\n# TYPE ";
+	out += name;
+	out += " ";
+	out += type;
+	out += "\n";
+}
+
+
+void name_upstreams()
+{
+	lock_guard<mutex> g(labels_mtx);
+
+	for (auto &l : upstream_labels)
+		l.clear();
+	if (!config::ns_cfg)
+		return;
+	for (const auto &ns : *config::ns_cfg) {
+		if (ns.second.idx < MAX_UPSTREAMS)
+			upstream_labels[ns.second.idx] = "upstream=\"" + ns.first + "\"";
+	}
+}
+
+
+string scrape()
+{
+	// make the stage histograms current
+	drain();
+
+	snapshot snap;
+	take(snap);
+
+	string out = "";
+	out.reserve(64*1024);
+
+	print_help(out, "harddns_queries_total", "counter", "Queries received by type.");
+	const char *types[] = {"A", "AAAA", "PTR", "other"};
+	for (unsigned int i = QUERIES_A; i <= QUERIES_OTHER; ++i)
+		print_metric(out, "harddns_queries_total", string("type=\"") + types[i] + "\"", snap.counters[i]);
+
+	print_help(out, "harddns_responses_total", "counter", "Responses sent by rcode.");
+	const char *rcodes[] = {"NOERROR", "FORMERR", "SERVFAIL", "NXDOMAIN", "NOTIMP", "REFUSED"};
+	for (unsigned int i = 0; i < 16; ++i) {
+		if (i >= sizeof(rcodes)/sizeof(rcodes[0]) && snap.rcodes[i] == 0)
+			continue;
+		string rc = i < sizeof(rcodes)/sizeof(rcodes[0]) ? rcodes[i] : to_string(i);
+		print_metric(out, "harddns_responses_total", "rcode=\"" + rc + "\"", snap.rcodes[i]);
+	}
+
+	print_help(out, "harddns_forwarded_total", "counter", "Queries forwarded to internal_domain servers.");
+	print_metric(out, "harddns_forwarded_total", "", snap.counters[FORWARDED]);
+	print_help(out, "harddns_forward_retries_total", "counter", "Forwarded queries sent again after a timeout.");
+	print_metric(out, "harddns_forward_retries_total", "", snap.counters[FWD_RETRIES]);
+	print_help(out, "harddns_forward_timeouts_total", "counter", "Forwarded queries answered with SERVFAIL after the last retry.");
+	print_metric(out, "harddns_forward_timeouts_total", "", snap.counters[FWD_TIMEOUTS]);
+	print_help(out, "harddns_forward_tcp_total", "counter", "Truncated forwarded answers fetched again via TCP.");
+	print_metric(out, "harddns_forward_tcp_total", "", snap.counters[FWD_TCP]);
+
+	print_help(out, "harddns_cache_hits_total", "counter", "Answers served from the cache.");
+	print_metric(out, "harddns_cache_hits_total", "", snap.counters[CACHE_HITS]);
+	print_help(out, "harddns_cache_misses_total", "counter", "Cache lookups without a valid entry.");
+	print_metric(out, "harddns_cache_misses_total", "", snap.counters[CACHE_MISSES]);
+	print_help(out, "harddns_cache_expirations_total", "counter", "Cache entries dropped because their TTL expired.");
+	print_metric(out, "harddns_cache_expirations_total", "", snap.counters[CACHE_EXPIRED]);
+	print_help(out, "harddns_cache_entries", "gauge", "Current number of cache entries.");
+	print_metric(out, "harddns_cache_entries", "", gauges[CACHE_ENTRIES].load(memory_order_relaxed));
+
+	print_help(out, "harddns_blocked_total", "counter", "Queries answered with NXDOMAIN because of the blocklist.");
+	print_metric(out, "harddns_blocked_total", "", snap.counters[BLOCKED]);
+	print_help(out, "harddns_blocklist_entries", "gauge", "Number of domains in the loaded blocklist.");
+	print_metric(out, "harddns_blocklist_entries", "", gauges[BLOCKLIST_ENTRIES].load(memory_order_relaxed));
+
+	string labels[MAX_UPSTREAMS];
+	{
+		lock_guard<mutex> g(labels_mtx);
+		for (unsigned int i = 0; i < MAX_UPSTREAMS; ++i)
+			labels[i] = upstream_labels[i];
+	}
+
+	struct { upstream_counter c; const char *name, *help; } up_ctrs[] = {
+		{UP_REQUESTS, "harddns_upstream_requests_total", "DoH requests sent to the upstream."},
+		{UP_ERRORS, "harddns_upstream_errors_total", "Failed DoH requests to the upstream."}
+	};
+	for (const auto &uc : up_ctrs) {
+		print_help(out, uc.name, "counter", uc.help);
+		for (unsigned int i = 0; i < MAX_UPSTREAMS; ++i) {
+			if (labels[i].size())
+				print_metric(out, uc.name, labels[i], snap.upstream[i][uc.c]);
+		}
+	}
+
+	print_help(out, "harddns_upstream_tls_connects_total", "counter", "TLS connects to the upstream by handshake kind.");
+	const char *kinds[] = {"full", "resumed", "0rtt"};
+	for (unsigned int i = 0; i < MAX_UPSTREAMS; ++i) {
+		if (labels[i].empty())
+			continue;
+		for (unsigned int k = 0; k < 3; ++k)
+			print_metric(out, "harddns_upstream_tls_connects_total", labels[i] + ",kind=\"" + kinds[k] + "\"", snap.upstream[i][UP_TLS_FULL + k]);
+	}
+
+	print_help(out, "harddns_query_duration_seconds", "histogram", "Time from receiving a query to sending the answer.");
+	const char *sources[] = {"cache", "upstream", "local", "forward"};
+	for (unsigned int i = 0; i < N_SOURCES; ++i)
+		print_histogram(out, "harddns_query_duration_seconds", string("source=\"") + sources[i] + "\"", snap.latency[i]);
+
+	print_help(out, "harddns_upstream_duration_seconds", "histogram", "Duration of DoH requests per upstream, including connects.");
+	for (unsigned int i = 0; i < MAX_UPSTREAMS; ++i) {
+		if (labels[i].size())
+			print_histogram(out, "harddns_upstream_duration_seconds", labels[i], snap.upstream_latency[i]);
+	}
+
+	print_help(out, "harddns_upstream_stage_duration_seconds", "histogram", "Duration of the stages of DoH requests.");
+	for (unsigned int i = 0; i < N_STAGES; ++i)
+		print_histogram(out, "harddns_upstream_stage_duration_seconds", string("stage=\"") + stage_names[i] + "\"", snap.stage_latency[i]);
+
+	print_help(out, "harddns_timings_dropped_total", "counter", "Stage timings dropped because the ring was full.");
+	print_metric(out, "harddns_timings_dropped_total", "", snap.counters[TIMINGS_DROPPED]);
+
+	print_help(out, "harddns_qlog_dropped_total", "counter", "Query log records dropped because the ring was full or the receiver was gone.");
+	print_metric(out, "harddns_qlog_dropped_total", "", snap.counters[QLOG_DROPPED]);
+
+	return out;
+}
+
+
+static void serve(int sock)
+{
+	char buf[1024];
+
+	for (;;) {
+		int fd = accept(sock, nullptr, nullptr);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			break;
+		}
+
+		// HTTP clients (curl --unix-socket) send a request first, plain
+		// readers such as socat just get the text
+		pollfd pfd{fd, POLLIN, 0};
+		bool http = 0;
+		if (poll(&pfd, 1, 100) == 1) {
+			ssize_t n = recv(fd, buf, sizeof(buf), 0);
+			http = n >= 4 && memcmp(buf, "GET ", 4) == 0;
+		}
+
+		string body = scrape(), reply = "";
+		if (http) {
+			reply = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: ";
+			reply += to_string(body.size());
+			reply += "\r\nConnection: close\r\n\r\n";
+		}
+		reply += body;
+
+		for (size_t written = 0; written < reply.size();) {
+			ssize_t n = send(fd, reply.c_str() + written, reply.size() - written, MSG_NOSIGNAL);
+			if (n <= 0)
+				break;
+			written += n;
+		}
+		close(fd);
+	}
+
+	close(sock);
+}
+
+
+int start_exporter(const string &path, string &err)
+{
+	sockaddr_un sun;
+	memset(&sun, 0, sizeof(sun));
+
+	if (path.size() >= sizeof(sun.sun_path)) {
+		err = "stats::start_exporter: Path too long.";
+		return -1;
+	}
+	sun.sun_family = AF_UNIX;
+	memcpy(sun.sun_path, path.c_str(), path.size());
+
+	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0) {
+		err = string("stats::start_exporter::socket:") + strerror(errno);
+		return -1;
+	}
+
+	unlink(path.c_str());
+	if (::bind(sock, reinterpret_cast<sockaddr *>(&sun), sizeof(sun)) < 0 || listen(sock, 16) < 0) {
+		err = string("stats::start_exporter::bind:") + strerror(errno);
+		close(sock);
+		return -1;
+	}
+	chmod(path.c_str(), 0660);
+
+	thread(serve, sock).detach();
+	return 0;
+}
+
+
+}
+
+}
+
@@ -0,0 +1,231 @@
+/*
+ * This file is part of harddns.
+ *
+ * (C) 2023 by Sebastian Krahmer,
+ *             sebastian [dot] krahmer [at] gmail [dot] com
+ *
+ * harddns is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * harddns is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with harddns. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef harddns_stats_h
+#define harddns_stats_h
+
+#include <atomic>
+#include <string>
+#include <cstdint>
+#include <time.h>
+
+
+namespace harddns {
+
+namespace stats {
+
+
+enum counter : unsigned int {
+	QUERIES_A = 0,
+	QUERIES_AAAA,
+	QUERIES_PTR,
+	QUERIES_OTHER,
+	FORWARDED,
+	FWD_RETRIES,
+	FWD_TIMEOUTS,
+	FWD_TCP,
+	CACHE_HITS,
+	CACHE_MISSES,
+	CACHE_EXPIRED,
+	TIMINGS_DROPPED,
+	QLOG_DROPPED,
+	BLOCKED,
+	N_COUNTERS
+};
+
+enum gauge : unsigned int {
+	CACHE_ENTRIES = 0,
+	BLOCKLIST_ENTRIES,
+	N_GAUGES
+};
+
+// where the answer of a proxied query came from
+enum source : unsigned int {
+	SRC_CACHE = 0,
+	SRC_UPSTREAM,
+	SRC_LOCAL,
+	SRC_FORWARD,
+	N_SOURCES
+};
+
+enum upstream_counter : unsigned int {
+	UP_REQUESTS = 0,
+	UP_ERRORS,
+	UP_TLS_FULL,
+	UP_TLS_RESUMED,
+	UP_TLS_0RTT,
+	N_UP_COUNTERS
+};
+
+// stages of a single DoH request, see dnshttps::get()
+enum stage : unsigned int {
+	STAGE_CONNECT = 0,	// TCP connect
+	STAGE_TLS,		// TLS handshake, including 0-RTT data
+	STAGE_SEND,		// sending the HTTP request
+	STAGE_FIRST_BYTE,	// request sent until first reply bytes
+	STAGE_HTTP,		// first byte until the HTTP reply is complete
+	STAGE_PARSE,		// parse_json() or parse_rfc8484()
+	N_STAGES
+};
+
+// upstreams beyond that are accounted to the last slot
+constexpr unsigned int MAX_UPSTREAMS = 64;
+
+// HDR style log-linear buckets over microseconds: 4 sub-buckets per
+// power of two, so each bucket is at most 25% wide, up to 2^26us (~67s)
+constexpr unsigned int HIST_SUB_BITS = 2, HIST_SUB = 1<<HIST_SUB_BITS;
+constexpr unsigned int HIST_BUCKETS = HIST_SUB*26;
+
+
+// A single writer (the owning thread) updates its shard with plain relaxed
+// load/store pairs, no locked instructions. Readers only sum up.
+using cell = std::atomic<uint64_t>;
+
+struct histogram {
+	cell buckets[HIST_BUCKETS], sum_us, count;
+};
+
+struct shard {
+	cell counters[N_COUNTERS];
+	cell rcodes[16];
+	histogram latency[N_SOURCES];
+	cell upstream[MAX_UPSTREAMS][N_UP_COUNTERS];
+	histogram upstream_latency[MAX_UPSTREAMS];
+	histogram stage_latency[N_STAGES];
+	shard *next{nullptr};
+};
+
+
+// Shards are created on first use by each thread and are never freed, so
+// counts of exited threads are kept. Built with NSS_MODULE, all threads
+// share a single one.
+shard *new_shard();
+
+inline shard &local()
+{
+	thread_local shard *s = new_shard();
+	return *s;
+}
+
+
+inline void add(cell &c, uint64_t n = 1)
+{
+	c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+
+inline void inc(counter c)
+{
+	add(local().counters[c]);
+}
+
+
+inline void inc_rcode(unsigned int rcode)
+{
+	add(local().rcodes[rcode & 0xf]);
+}
+
+
+inline void inc(unsigned int upstream, upstream_counter c)
+{
+	add(local().upstream[upstream < MAX_UPSTREAMS ? upstream : MAX_UPSTREAMS - 1][c]);
+}
+
+
+void set(gauge, uint64_t);
+
+
+inline unsigned int hist_bucket(uint64_t us)
+{
+	if (us < HIST_SUB)
+		return us;
+	unsigned int msb = 63 - __builtin_clzll(us);
+	unsigned int idx = (msb - HIST_SUB_BITS + 1)*HIST_SUB + ((us>>(msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+	return idx < HIST_BUCKETS ? idx : HIST_BUCKETS - 1;
+}
+
+
+inline void record(histogram &h, uint64_t us)
+{
+	add(h.buckets[hist_bucket(us)]);
+	add(h.sum_us, us);
+	add(h.count);
+}
+
+
+inline void record(source src, uint64_t us)
+{
+	record(local().latency[src], us);
+}
+
+
+inline void record_upstream(unsigned int upstream, uint64_t us)
+{
+	record(local().upstream_latency[upstream < MAX_UPSTREAMS ? upstream : MAX_UPSTREAMS - 1], us);
+}
+
+
+inline uint64_t now_us()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+
+// Stage breakdown of one DoH request, as queued for drain()
+struct query_timing {
+	char name[128];
+	char upstream[48];
+	uint16_t qtype;
+	bool ok, connected;	// connected: a connect() was part of the request
+	uint32_t total_us;
+	uint32_t stage_us[N_STAGES];
+};
+
+// Queues t without blocking, counts a drop if the ring is full
+void submit(const query_timing &t);
+
+// Aggregates queued timings into the stage histograms and syslogs
+// the ones above config::slow_query_ms
+void drain();
+
+// Calls drain() periodically from a thread of its own
+void start_drainer();
+
+
+// Copies the upstream names of config::ns_cfg to label the upstream
+// metrics by. Called again after a config reload replaced ns_cfg.
+void name_upstreams();
+
+// Prometheus text format of the sum of all shards
+std::string scrape();
+
+// Serves scrape() on a UNIX socket from a thread of its own. Must
+// be called before chroot().
+int start_exporter(const std::string &path, std::string &err);
+
+
+}
+
+}
+
+#endif
+